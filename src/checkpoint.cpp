@@ -0,0 +1,344 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION: Keeps finished charts and grid cells on disk while a map is
+//              being lit so a killed run can pick up where it stopped.
+//              The file is only ever appended to. Every record carries a
+//              hash of itself, so a record that was cut off or never made
+//              it to the disk ends the file when it is read back, and
+//              whatever comes after it is cut off before appending again.
+//
+//              header  id, version, key lo, key hi
+//              record  type, index, size, data, hash lo, hash hi
+//
+//-----------------------------------------------------------------------------
+
+#include "common.h"
+#include "checkpoint.h"
+#include "lightCache.h"
+
+//
+// kexCheckpoint::kexCheckpoint
+//
+
+kexCheckpoint::kexCheckpoint(void)
+{
+    this->key           = 0;
+    this->buffer        = NULL;
+    this->bufferSize    = 0;
+    this->bufferMax     = 0;
+    this->writeBuffer   = NULL;
+    this->writeBufferMax = 0;
+    this->lastFlushTime = 0;
+    this->bFailed       = false;
+
+    pthread_mutex_init(&bufferMutex, NULL);
+    pthread_mutex_init(&writeMutex, NULL);
+}
+
+//
+// kexCheckpoint::~kexCheckpoint
+//
+
+kexCheckpoint::~kexCheckpoint(void)
+{
+    Close();
+
+    pthread_mutex_destroy(&bufferMutex);
+    pthread_mutex_destroy(&writeMutex);
+}
+
+//
+// kexCheckpoint::ReadRecords
+//
+// Returns where the last whole record ends, or 0 if the file
+// was made for a different key
+//
+
+int kexCheckpoint::ReadRecords(void)
+{
+    int length = readFile.Length();
+    int offset;
+    uint64_t fileKey;
+
+    if(length < 16 || readFile.Read32() != CHECKPOINT_ID || readFile.Read32() != CHECKPOINT_VERSION)
+    {
+        return 0;
+    }
+
+    fileKey = (uint64_t)(uint32_t)readFile.Read32();
+    fileKey |= (uint64_t)(uint32_t)readFile.Read32() << 32;
+
+    if(fileKey != key)
+    {
+        return 0;
+    }
+
+    offset = 16;
+
+    while(offset + 20 <= length)
+    {
+        checkpointRecord_t record;
+        uint64_t hash;
+
+        readFile.SetOffset(offset);
+        record.type = readFile.Read32();
+        record.index = readFile.Read32();
+        record.size = readFile.Read32();
+
+        if(record.size < 0 || record.size > length - offset - 20)
+        {
+            break;
+        }
+
+        record.data = readFile.BufferAt();
+        readFile.SetOffset(offset + 12 + record.size);
+
+        hash = (uint64_t)(uint32_t)readFile.Read32();
+        hash |= (uint64_t)(uint32_t)readFile.Read32() << 32;
+
+        if(hash != kexLightCache::Hash(readFile.Buffer() + offset, 12 + record.size, key))
+        {
+            break;
+        }
+
+        records.Push(record);
+        offset += 20 + record.size;
+    }
+
+    return offset;
+}
+
+//
+// kexCheckpoint::Open
+//
+// Reads back the records of a checkpoint that was written for the
+// same key, then gets the file ready to append to. A missing or
+// stale file is started over. Returns false if it can't be written
+//
+
+bool kexCheckpoint::Open(const char *fileName, const uint64_t key)
+{
+    int validLength = 0;
+
+    this->key = key;
+
+    if(readFile.Exists(fileName) && readFile.Open(fileName))
+    {
+        validLength = ReadRecords();
+    }
+
+    if(validLength > 0)
+    {
+        if(!file.OpenForUpdate(fileName) || !file.Truncate(validLength))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        if(!file.Create(fileName))
+        {
+            return false;
+        }
+
+        file.Write32(CHECKPOINT_ID);
+        file.Write32(CHECKPOINT_VERSION);
+        file.Write32((int)(key & 0xFFFFFFFF));
+        file.Write32((int)(key >> 32));
+
+        if(!file.Sync())
+        {
+            return false;
+        }
+    }
+
+    lastFlushTime = GetMilliseconds();
+    return true;
+}
+
+//
+// kexCheckpoint::FreeRecords
+//
+// The records point into the file that was read back,
+// so this has to wait until they are used
+//
+
+void kexCheckpoint::FreeRecords(void)
+{
+    records.Empty();
+    readFile.Close();
+}
+
+//
+// kexCheckpoint::Close
+//
+
+void kexCheckpoint::Close(void)
+{
+    Flush(true);
+    FreeRecords();
+    file.Close();
+
+    delete[] buffer;
+    delete[] writeBuffer;
+    buffer = NULL;
+    writeBuffer = NULL;
+    bufferSize = 0;
+    bufferMax = 0;
+    writeBufferMax = 0;
+}
+
+//
+// kexCheckpoint::AddRecord
+//
+
+void kexCheckpoint::AddRecord(const int type, const int index, const byte *data, const int size)
+{
+    int header[3];
+    uint64_t hash;
+    byte *record;
+
+    pthread_mutex_lock(&bufferMutex);
+
+    if(bufferSize + 20 + size > bufferMax)
+    {
+        byte *newBuffer;
+
+        bufferMax = MAX(bufferMax * 2, bufferSize + 20 + size);
+        newBuffer = new byte[bufferMax];
+
+        memcpy(newBuffer, buffer, bufferSize);
+        delete[] buffer;
+        buffer = newBuffer;
+    }
+
+    record = buffer + bufferSize;
+
+    header[0] = type;
+    header[1] = index;
+    header[2] = size;
+
+    memcpy(record, header, 12);
+    memcpy(record + 12, data, size);
+
+    hash = kexLightCache::Hash(record, 12 + size, key);
+
+    header[0] = (int)(hash & 0xFFFFFFFF);
+    header[1] = (int)(hash >> 32);
+
+    memcpy(record + 12 + size, header, 8);
+    bufferSize += 20 + size;
+
+    pthread_mutex_unlock(&bufferMutex);
+}
+
+//
+// kexCheckpoint::AddChart
+//
+// A size of zero means the chart came out completely black
+//
+
+void kexCheckpoint::AddChart(const int index, const byte *texels, const int size)
+{
+    AddRecord(CR_CHART, index, texels, size);
+}
+
+//
+// kexCheckpoint::AddCell
+//
+
+void kexCheckpoint::AddCell(const int index, const byte marked, const byte sunShadow,
+                            const kexVec3 &color)
+{
+    byte data[14];
+
+    data[0] = marked;
+    data[1] = sunShadow;
+    memcpy(&data[2], &color.x, sizeof(float));
+    memcpy(&data[6], &color.y, sizeof(float));
+    memcpy(&data[10], &color.z, sizeof(float));
+
+    AddRecord(CR_CELL, index, data, 14);
+}
+
+//
+// kexCheckpoint::Flush
+//
+// Writes out the records that are held in memory once enough of
+// them have piled up or enough time has passed since the last time.
+// The records are swapped into a second buffer so they can be written
+// and synced while other threads keep adding to the first one. Don't
+// hold a lock that the threads adding records need while calling this
+//
+
+void kexCheckpoint::Flush(const bool bForce)
+{
+    byte *pending;
+    int writeSize;
+
+    // someone else is already writing, what piled up since goes next time
+    if(bForce)
+    {
+        pthread_mutex_lock(&writeMutex);
+    }
+    else if(pthread_mutex_trylock(&writeMutex) != 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&bufferMutex);
+
+    if(bFailed || bufferSize == 0 || !file.Opened() ||
+       (!bForce && bufferSize < CHECKPOINT_FLUSH_SIZE &&
+        GetMilliseconds() - lastFlushTime < CHECKPOINT_FLUSH_MS))
+    {
+        pthread_mutex_unlock(&bufferMutex);
+        pthread_mutex_unlock(&writeMutex);
+        return;
+    }
+
+    pending = buffer;
+    buffer = writeBuffer;
+    writeBuffer = pending;
+
+    writeSize = bufferMax;
+    bufferMax = writeBufferMax;
+    writeBufferMax = writeSize;
+
+    writeSize = bufferSize;
+    bufferSize = 0;
+    lastFlushTime = GetMilliseconds();
+
+    pthread_mutex_unlock(&bufferMutex);
+
+    if(!file.WriteBlocks(&writeBuffer, &writeSize, 1) || !file.Sync())
+    {
+        printf("\nWarning: couldn't write the checkpoint, it won't be updated any more\n");
+        bFailed = true;
+    }
+
+    pthread_mutex_unlock(&writeMutex);
+}
@@ -0,0 +1,88 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <pthread.h>
+#include "kexlib/binFile.h"
+
+#define CHECKPOINT_ID           (('K' << 24) | ('C' << 16) | ('M' << 8) | 'L')
+#define CHECKPOINT_VERSION      1
+
+// finished charts and cells are held in memory until one of these is hit
+#define CHECKPOINT_FLUSH_MS     10000
+#define CHECKPOINT_FLUSH_SIZE   (4 << 20)
+
+typedef enum
+{
+    CR_CHART    = 1,
+    CR_CELL
+} checkpointRecordType_t;
+
+typedef struct
+{
+    int             type;
+    int             index;
+    int             size;
+    const byte      *data;
+} checkpointRecord_t;
+
+class kexCheckpoint
+{
+public:
+    kexCheckpoint(void);
+    ~kexCheckpoint(void);
+
+    bool                        Open(const char *fileName, const uint64_t key);
+    void                        Close(void);
+    void                        FreeRecords(void);
+    void                        AddChart(const int index, const byte *texels, const int size);
+    void                        AddCell(const int index, const byte marked, const byte sunShadow,
+                                        const kexVec3 &color);
+    void                        Flush(const bool bForce);
+
+    const int                   NumRecords(void) const { return records.Length(); }
+    checkpointRecord_t          &Record(const int index) { return records[index]; }
+
+private:
+    void                        AddRecord(const int type, const int index, const byte *data, const int size);
+    int                         ReadRecords(void);
+
+    kexBinFile                  file;
+    kexBinFile                  readFile;
+    kexArray<checkpointRecord_t> records;
+    uint64_t                    key;
+    byte                        *buffer;
+    int                         bufferSize;
+    int                         bufferMax;
+    byte                        *writeBuffer;
+    int                         writeBufferMax;
+    int64_t                     lastFlushTime;
+    bool                        bFailed;
+    pthread_mutex_t             bufferMutex;
+    pthread_mutex_t             writeMutex;
+};
+
+#endif
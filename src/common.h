@@ -57,6 +57,8 @@
 #endif // WIN32
 
 #ifdef KEX_WIN32
+// winsock2 has to come before windows.h pulls in the old winsock
+#include <winsock2.h>
 #include <windows.h>
 #else
 #include <time.h>
@@ -82,6 +84,8 @@ typedef signed __int32 int32_t;
 typedef unsigned __int32 uint32_t;
 typedef signed __int64 int64_t;
 typedef unsigned __int64 uint64_t;
+#else
+#include <stdint.h>
 #endif
 
 typedef union
@@ -163,6 +167,7 @@ void Error(const char *error, ...);
 char *Va(const char *str, ...);
 void Delay(int ms);
 const int64_t GetSeconds(void);
+const int64_t GetMilliseconds(void);
 const kexStr &FilePath(void);
 
 #endif
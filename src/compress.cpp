@@ -0,0 +1,495 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION: BC1 (DXT1) block compression for lightmap textures.
+//              The endpoints are picked along the main axis of each
+//              block's colors, texels are snapped to the nearest
+//              point on the line between them and the endpoints are
+//              then refit to the texels
+//
+//-----------------------------------------------------------------------------
+
+#include "common.h"
+#include "compress.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COMPRESS_SSE2
+#include <emmintrin.h>
+#endif
+
+//
+// Compress_To565
+//
+
+static d_inline word Compress_To565(const int *rgb)
+{
+    return (word)((((rgb[0] * 31 + 127) / 255) << 11) |
+                  (((rgb[1] * 63 + 127) / 255) << 5) |
+                   ((rgb[2] * 31 + 127) / 255));
+}
+
+//
+// Compress_From565
+//
+
+static d_inline void Compress_From565(const word color, int *rgb)
+{
+    int r = (color >> 11) & 31;
+    int g = (color >> 5) & 63;
+    int b = color & 31;
+
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+//
+// Compress_BuildPalette
+//
+
+static void Compress_BuildPalette(const word c0, const word c1, int palette[4][3])
+{
+    Compress_From565(c0, palette[0]);
+    Compress_From565(c1, palette[1]);
+
+    for(int k = 0; k < 3; k++)
+    {
+        if(c0 > c1)
+        {
+            palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+            palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+        }
+        else
+        {
+            palette[2][k] = (palette[0][k] + palette[1][k]) / 2;
+            palette[3][k] = 0;
+        }
+    }
+}
+
+//
+// Compress_ProjectBlock
+//
+// Dot product of every texel in a block with dir. Texels
+// are stored as RGBX so four of them fit in one register
+//
+
+static void Compress_ProjectBlock(const byte block[64], const int dir[3], int dots[16])
+{
+#ifdef COMPRESS_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i axis = _mm_setr_epi16((short)dir[0], (short)dir[1], (short)dir[2], 0,
+                                  (short)dir[0], (short)dir[1], (short)dir[2], 0);
+
+    for(int i = 0; i < 4; i++)
+    {
+        __m128i texels = _mm_loadu_si128((const __m128i*)(block + i * 16));
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(texels, zero), axis);
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(texels, zero), axis);
+
+        // each texel left two partial sums (rg and bx). add them together
+        __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+
+        _mm_storeu_si128((__m128i*)(dots + i * 4),
+                         _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd)));
+    }
+#else
+    for(int i = 0; i < 16; i++)
+    {
+        dots[i] = block[i * 4 + 0] * dir[0] +
+                  block[i * 4 + 1] * dir[1] +
+                  block[i * 4 + 2] * dir[2];
+    }
+#endif
+}
+
+//
+// Compress_PickIndices
+//
+// Snaps every texel to the closest of the four points
+// between c0 and c1 and returns the squared error
+//
+
+static int Compress_PickIndices(const byte block[64], const word c0, const word c1,
+                                unsigned int *indices)
+{
+    int palette[4][3];
+    int dir[3];
+    int dots[16];
+    int base;
+    int denom;
+    int error = 0;
+    static const int levelToIndex[4] = { 1, 3, 2, 0 };
+
+    Compress_BuildPalette(c0, c1, palette);
+    *indices = 0;
+
+    for(int k = 0; k < 3; k++)
+    {
+        dir[k] = palette[0][k] - palette[1][k];
+    }
+
+    denom = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2];
+
+    // with equal endpoints every texel just uses the first color
+    if(denom != 0)
+    {
+        Compress_ProjectBlock(block, dir, dots);
+        base = palette[1][0] * dir[0] + palette[1][1] * dir[1] + palette[1][2] * dir[2];
+    }
+
+    for(int i = 0; i < 16; i++)
+    {
+        int index = 0;
+        int *color;
+
+        if(denom != 0)
+        {
+            int level = ((dots[i] - base) * 6 + denom) / (denom * 2);
+
+            if(dots[i] < base) level = 0;
+            if(level > 3) level = 3;
+
+            index = levelToIndex[level];
+        }
+
+        color = palette[index];
+
+        for(int k = 0; k < 3; k++)
+        {
+            int d = block[i * 4 + k] - color[k];
+            error += d * d;
+        }
+
+        *indices |= index << (i * 2);
+    }
+
+    return error;
+}
+
+//
+// Compress_RefineEndpoints
+//
+// Least squares fit of the two endpoints to the texels
+// using the weights from the indices they were given
+//
+
+static bool Compress_RefineEndpoints(const byte block[64], const unsigned int indices,
+                                     word *c0, word *c1)
+{
+    static const int weights[4] = { 3, 0, 2, 1 };
+    int aa = 0, bb = 0, ab = 0;
+    int ax[3] = { 0, 0, 0 };
+    int bx[3] = { 0, 0, 0 };
+    int e0[3];
+    int e1[3];
+    int det;
+
+    for(int i = 0; i < 16; i++)
+    {
+        int a = weights[(indices >> (i * 2)) & 3];
+        int b = 3 - a;
+
+        aa += a * a;
+        bb += b * b;
+        ab += a * b;
+
+        for(int k = 0; k < 3; k++)
+        {
+            ax[k] += a * block[i * 4 + k];
+            bx[k] += b * block[i * 4 + k];
+        }
+    }
+
+    det = aa * bb - ab * ab;
+
+    // all texels landed on the same point
+    if(det == 0)
+    {
+        return false;
+    }
+
+    for(int k = 0; k < 3; k++)
+    {
+        // the weights are scaled by 3, which scales the result back down
+        e0[k] = (int)kexMath::Floor((float)(3 * (ax[k] * bb - bx[k] * ab)) / det + 0.5f);
+        e1[k] = (int)kexMath::Floor((float)(3 * (bx[k] * aa - ax[k] * ab)) / det + 0.5f);
+
+        e0[k] = MAX(MIN(e0[k], 255), 0);
+        e1[k] = MAX(MIN(e1[k], 255), 0);
+    }
+
+    *c0 = Compress_To565(e0);
+    *c1 = Compress_To565(e1);
+
+    if(*c0 < *c1)
+    {
+        word tmp = *c0;
+        *c0 = *c1;
+        *c1 = tmp;
+    }
+
+    return true;
+}
+
+//
+// Compress_EncodeBlock
+//
+
+static void Compress_EncodeBlock(const byte block[64], byte *out)
+{
+    int rgbMin[3];
+    int rgbMax[3];
+    float mean[3];
+    float cov[6];
+    float axis[3];
+    float scale;
+    int dir[3];
+    int dots[16];
+    int e0[3];
+    int e1[3];
+    int iMin = 0;
+    int iMax = 0;
+    int error;
+    word c0, c1;
+    unsigned int indices;
+
+    for(int k = 0; k < 3; k++)
+    {
+        rgbMin[k] = rgbMax[k] = block[k];
+        mean[k] = block[k];
+
+        for(int i = 1; i < 16; i++)
+        {
+            int c = block[i * 4 + k];
+
+            if(c < rgbMin[k]) rgbMin[k] = c;
+            if(c > rgbMax[k]) rgbMax[k] = c;
+
+            mean[k] += c;
+        }
+
+        mean[k] /= 16.0f;
+        axis[k] = (float)(rgbMax[k] - rgbMin[k]);
+    }
+
+    // find the main axis of the colors with a few power iterations,
+    // starting from the diagonal of their bounding box
+    memset(cov, 0, sizeof(cov));
+
+    for(int i = 0; i < 16; i++)
+    {
+        float r = block[i * 4 + 0] - mean[0];
+        float g = block[i * 4 + 1] - mean[1];
+        float b = block[i * 4 + 2] - mean[2];
+
+        cov[0] += r * r;
+        cov[1] += r * g;
+        cov[2] += r * b;
+        cov[3] += g * g;
+        cov[4] += g * b;
+        cov[5] += b * b;
+    }
+
+    for(int iter = 0; iter < 4; iter++)
+    {
+        float x = axis[0] * cov[0] + axis[1] * cov[1] + axis[2] * cov[2];
+        float y = axis[0] * cov[1] + axis[1] * cov[3] + axis[2] * cov[4];
+        float z = axis[0] * cov[2] + axis[1] * cov[4] + axis[2] * cov[5];
+
+        axis[0] = x;
+        axis[1] = y;
+        axis[2] = z;
+
+        scale = MAX(MAX(kexMath::Fabs(x), kexMath::Fabs(y)), kexMath::Fabs(z));
+
+        if(scale == 0)
+        {
+            break;
+        }
+
+        axis[0] /= scale;
+        axis[1] /= scale;
+        axis[2] /= scale;
+    }
+
+    for(int k = 0; k < 3; k++)
+    {
+        dir[k] = (int)(axis[k] * 255.0f);
+    }
+
+    Compress_ProjectBlock(block, dir, dots);
+
+    for(int i = 1; i < 16; i++)
+    {
+        if(dots[i] < dots[iMin]) iMin = i;
+        if(dots[i] > dots[iMax]) iMax = i;
+    }
+
+    // pull the endpoints in a bit so they aren't spent on outliers
+    for(int k = 0; k < 3; k++)
+    {
+        int inset;
+
+        e0[k] = block[iMax * 4 + k];
+        e1[k] = block[iMin * 4 + k];
+
+        inset = (e0[k] - e1[k]) / 16;
+
+        e0[k] -= inset;
+        e1[k] += inset;
+    }
+
+    c0 = Compress_To565(e0);
+    c1 = Compress_To565(e1);
+
+    if(c0 < c1)
+    {
+        word tmp = c0;
+        c0 = c1;
+        c1 = tmp;
+    }
+
+    error = Compress_PickIndices(block, c0, c1, &indices);
+
+    // fit the endpoints to the chosen indices and keep them if they're better
+    for(int iter = 0; iter < 2 && error != 0; iter++)
+    {
+        word r0, r1;
+        unsigned int refined;
+        int refinedError;
+
+        if(!Compress_RefineEndpoints(block, indices, &r0, &r1))
+        {
+            break;
+        }
+
+        refinedError = Compress_PickIndices(block, r0, r1, &refined);
+
+        if(refinedError >= error)
+        {
+            break;
+        }
+
+        c0 = r0;
+        c1 = r1;
+        indices = refined;
+        error = refinedError;
+    }
+
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    out[4] = indices & 0xff;
+    out[5] = (indices >> 8) & 0xff;
+    out[6] = (indices >> 16) & 0xff;
+    out[7] = (indices >> 24) & 0xff;
+}
+
+//
+// Compress_BC1Size
+//
+
+int Compress_BC1Size(const int width, const int height)
+{
+    return ((width + BC1_BLOCK_SIZE - 1) / BC1_BLOCK_SIZE) *
+           ((height + BC1_BLOCK_SIZE - 1) / BC1_BLOCK_SIZE) * BC1_BLOCK_BYTES;
+}
+
+//
+// Compress_EncodeBC1
+//
+// Compresses a RGB image. Blocks that hang over the edge of
+// the image repeat the last row and column
+//
+
+void Compress_EncodeBC1(const byte *rgb, const int width, const int height, byte *out)
+{
+    byte block[64];
+
+    for(int y = 0; y < height; y += BC1_BLOCK_SIZE)
+    {
+        for(int x = 0; x < width; x += BC1_BLOCK_SIZE)
+        {
+            for(int i = 0; i < 16; i++)
+            {
+                int tx = MIN(x + (i & 3), width - 1);
+                int ty = MIN(y + (i >> 2), height - 1);
+                const byte *texel = &rgb[((ty * width) + tx) * 3];
+
+                block[i * 4 + 0] = texel[0];
+                block[i * 4 + 1] = texel[1];
+                block[i * 4 + 2] = texel[2];
+                block[i * 4 + 3] = 0;
+            }
+
+            Compress_EncodeBlock(block, out);
+            out += BC1_BLOCK_BYTES;
+        }
+    }
+}
+
+//
+// Compress_DecodeBC1
+//
+
+void Compress_DecodeBC1(const byte *data, const int width, const int height, byte *rgb)
+{
+    int palette[4][3];
+
+    for(int y = 0; y < height; y += BC1_BLOCK_SIZE)
+    {
+        for(int x = 0; x < width; x += BC1_BLOCK_SIZE)
+        {
+            word c0 = data[0] | (data[1] << 8);
+            word c1 = data[2] | (data[3] << 8);
+            unsigned int indices = data[4] | (data[5] << 8) | (data[6] << 16) | ((unsigned int)data[7] << 24);
+
+            Compress_BuildPalette(c0, c1, palette);
+
+            for(int i = 0; i < 16; i++)
+            {
+                int tx = x + (i & 3);
+                int ty = y + (i >> 2);
+                int *color = palette[(indices >> (i * 2)) & 3];
+                byte *texel;
+
+                if(tx >= width || ty >= height)
+                {
+                    continue;
+                }
+
+                texel = &rgb[((ty * width) + tx) * 3];
+                texel[0] = (byte)color[0];
+                texel[1] = (byte)color[1];
+                texel[2] = (byte)color[2];
+            }
+
+            data += BC1_BLOCK_BYTES;
+        }
+    }
+}
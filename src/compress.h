@@ -0,0 +1,36 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+// BC1 (DXT1) stores every 4x4 block of texels in 8 bytes
+#define BC1_BLOCK_SIZE      4
+#define BC1_BLOCK_BYTES     8
+
+int Compress_BC1Size(const int width, const int height);
+void Compress_EncodeBC1(const byte *rgb, const int width, const int height, byte *out);
+void Compress_DecodeBC1(const byte *data, const int width, const int height, byte *rgb);
+
+#endif
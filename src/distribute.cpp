@@ -0,0 +1,646 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION: Spreads the grid cells and charts of a map over other
+//              dlight processes. Both ends load the same map with the same
+//              settings, so only job ranges and their results go over the
+//              wire. A worker says hello with the map number and a hash of
+//              everything that affects the lighting, then loops on jobs
+//              until the coordinator says the map is done.
+//
+//              Messages are 32-bit integers in host order, so both ends
+//              need the same byte order. The id in the hello catches a
+//              mismatch.
+//
+//              hello   (worker)        id, version, map, key lo, key hi
+//              reply   (coordinator)   accepted, coordinator's map
+//              job     (coordinator)   pass, first, count
+//              result  (worker)        pass, first, count, texels traced,
+//                                      sun classified, sunlit texels, then
+//                                      the results
+//
+//-----------------------------------------------------------------------------
+
+#include "common.h"
+#include "lightmap.h"
+#include "distribute.h"
+
+//
+// kexCoordinator::kexCoordinator
+//
+
+kexCoordinator::kexCoordinator(kexLightmapBuilder &builder) : builder(builder)
+{
+    this->numWorkers    = 0;
+    this->numPending    = 0;
+    this->map           = 0;
+    this->key           = 0;
+    this->pass          = 0;
+    this->count         = 0;
+    this->jobSize       = 0;
+    this->numJobs       = 0;
+    this->numJobsDone   = 0;
+    this->jobStates     = NULL;
+    this->jobCopies     = NULL;
+}
+
+//
+// kexCoordinator::~kexCoordinator
+//
+
+kexCoordinator::~kexCoordinator(void)
+{
+    Finish();
+}
+
+//
+// kexCoordinator::Start
+//
+
+void kexCoordinator::Start(const char *address, const int map, const uint64_t key)
+{
+    this->map = map;
+    this->key = key;
+
+    if(!listener.Listen(address))
+    {
+        Error("Couldn't listen for workers on %s\n", address);
+        return;
+    }
+
+    printf("Listening for workers on %s\n\n", address);
+}
+
+//
+// kexCoordinator::Finish
+//
+// Tells every worker the map is done and stops listening
+//
+
+void kexCoordinator::Finish(void)
+{
+    for(int i = 0; i < numWorkers; i++)
+    {
+        int job[3] = { DP_DONE, 0, 0 };
+
+        workers[i].socket->Send(job, sizeof(job));
+        delete workers[i].socket;
+    }
+
+    numWorkers = 0;
+
+    for(int i = 0; i < numPending; i++)
+    {
+        delete pending[i].socket;
+    }
+
+    numPending = 0;
+    listener.Close();
+
+    delete[] jobStates;
+    delete[] jobCopies;
+
+    jobStates = NULL;
+    jobCopies = NULL;
+}
+
+//
+// kexCoordinator::JobCount
+//
+
+int kexCoordinator::JobCount(const int job) const
+{
+    return MIN(jobSize, count - job * jobSize);
+}
+
+//
+// kexCoordinator::RunPass
+//
+// Splits count cells or charts into jobs and waits until every
+// one of them has come back. Jobs are lit here while no workers
+// are connected so the map always gets finished
+//
+
+void kexCoordinator::RunPass(const int pass, const int count, const int jobSize)
+{
+    this->pass = pass;
+    this->count = count;
+    this->jobSize = jobSize;
+
+    numJobs = (count + jobSize - 1) / jobSize;
+    numJobsDone = 0;
+
+    delete[] jobStates;
+    delete[] jobCopies;
+
+    jobStates = new byte[numJobs];
+    jobCopies = new int[numJobs];
+
+    memset(jobStates, JOB_PENDING, numJobs);
+    memset(jobCopies, 0, sizeof(int) * numJobs);
+
+    // jobs that were finished before the last run stopped
+    for(int i = 0; i < numJobs; i++)
+    {
+        if(builder.JobResumed(pass, i * jobSize, JobCount(i)))
+        {
+            jobStates[i] = JOB_DONE;
+            numJobsDone++;
+        }
+    }
+
+    while(numJobsDone < numJobs)
+    {
+        int job;
+
+        DispatchJobs();
+
+        if(numWorkers > 0)
+        {
+            Poll(1000);
+            continue;
+        }
+
+        // nobody to hand it to, so light it here and check
+        // for workers in between jobs
+        if((job = NextJob()) != -1)
+        {
+            builder.RunJob(pass, job * jobSize, JobCount(job));
+
+            jobStates[job] = JOB_DONE;
+            numJobsDone++;
+        }
+
+        Poll(0);
+    }
+}
+
+//
+// kexCoordinator::NextJob
+//
+// Picks a job that hasn't been sent yet, or one that is still
+// out on too few workers once all of them have been sent
+//
+
+int kexCoordinator::NextJob(void)
+{
+    int best = -1;
+
+    for(int i = 0; i < numJobs; i++)
+    {
+        if(jobStates[i] == JOB_PENDING)
+        {
+            return i;
+        }
+
+        if(jobStates[i] == JOB_SENT && jobCopies[i] < DISTRIBUTE_MAX_COPIES &&
+           (best == -1 || jobCopies[i] < jobCopies[best]))
+        {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+//
+// kexCoordinator::DispatchJobs
+//
+// Sends a job to every worker that isn't busy. A worker whose
+// send fails is dropped once its socket reports the error
+//
+
+void kexCoordinator::DispatchJobs(void)
+{
+    for(int i = 0; i < numWorkers; i++)
+    {
+        remoteWorker_t *worker = &workers[i];
+        int job;
+        int msg[3];
+
+        if(worker->count != 0)
+        {
+            continue;
+        }
+
+        if((job = NextJob()) == -1)
+        {
+            break;
+        }
+
+        worker->job = job;
+        worker->pass = pass;
+        worker->first = job * jobSize;
+        worker->count = JobCount(job);
+
+        msg[0] = worker->pass;
+        msg[1] = worker->first;
+        msg[2] = worker->count;
+
+        worker->socket->Send(msg, sizeof(msg));
+        worker->sentTime = GetMilliseconds();
+
+        jobStates[job] = JOB_SENT;
+        jobCopies[job]++;
+    }
+}
+
+//
+// kexCoordinator::Poll
+//
+// Waits up to ms milliseconds for results, hellos or new workers
+//
+
+void kexCoordinator::Poll(const int ms)
+{
+    kexSocket *sockets[DISTRIBUTE_MAX_WORKERS * 2 + 1];
+    bool bReadable[DISTRIBUTE_MAX_WORKERS * 2 + 1];
+    int joined = numWorkers;
+    int waiting = numPending;
+
+    sockets[0] = &listener;
+
+    for(int i = 0; i < joined; i++)
+    {
+        sockets[i + 1] = workers[i].socket;
+    }
+
+    for(int i = 0; i < waiting; i++)
+    {
+        sockets[joined + i + 1] = pending[i].socket;
+    }
+
+    if(kexSocket::Select(sockets, joined + waiting + 1, bReadable, ms) > 0)
+    {
+        // go backwards since dropping a worker moves the last one into its slot
+        for(int i = joined - 1; i >= 0; i--)
+        {
+            if(bReadable[i + 1] && !ReceiveResult(i))
+            {
+                DropWorker(i);
+            }
+        }
+
+        for(int i = waiting - 1; i >= 0; i--)
+        {
+            if(bReadable[joined + i + 1])
+            {
+                ReadHello(i);
+            }
+        }
+
+        if(bReadable[0])
+        {
+            AcceptWorker();
+        }
+    }
+
+    CheckDeadlines();
+}
+
+//
+// kexCoordinator::AcceptWorker
+//
+// The connection only becomes a worker once ReadHello has all of its hello
+//
+
+void kexCoordinator::AcceptWorker(void)
+{
+    kexSocket *socket = new kexSocket;
+
+    if(!listener.Accept(*socket) || numPending >= DISTRIBUTE_MAX_WORKERS)
+    {
+        delete socket;
+        return;
+    }
+
+    pending[numPending].socket = socket;
+    pending[numPending].helloSize = 0;
+    pending[numPending].acceptTime = GetMilliseconds();
+    numPending++;
+}
+
+//
+// kexCoordinator::ReadHello
+//
+// Reads what has arrived of the connection's hello. Once it's all
+// there the connection joins as a worker or is turned away
+//
+
+void kexCoordinator::ReadHello(const int index)
+{
+    pendingWorker_t *conn = &pending[index];
+    int *hello = conn->hello;
+    int reply[2];
+    int rc;
+
+    rc = conn->socket->RecvSome((byte*)hello + conn->helloSize,
+                                sizeof(conn->hello) - conn->helloSize);
+
+    if(rc == -1)
+    {
+        DropPending(index);
+        return;
+    }
+
+    conn->helloSize += rc;
+
+    if(conn->helloSize < (int)sizeof(conn->hello))
+    {
+        return;
+    }
+
+    if(hello[0] != DISTRIBUTE_ID || hello[1] != DISTRIBUTE_VERSION)
+    {
+        printf("\nIgnoring a connection that isn't a worker of this version of DLight\n");
+        DropPending(index);
+        return;
+    }
+
+    reply[0] = (hello[2] == map && hello[3] == (int)(key & 0xffffffff) && hello[4] == (int)(key >> 32) &&
+                numWorkers < DISTRIBUTE_MAX_WORKERS);
+    reply[1] = map;
+
+    if(!conn->socket->Send(reply, sizeof(reply)) || !reply[0])
+    {
+        if(hello[2] == map)
+        {
+            printf("\nTurned away a worker whose settings or wad don't match\n");
+        }
+
+        DropPending(index);
+        return;
+    }
+
+    conn->socket->SetTimeout(DISTRIBUTE_RECV_TIMEOUT_MS);
+
+    workers[numWorkers].socket = conn->socket;
+    workers[numWorkers].job = -1;
+    workers[numWorkers].pass = 0;
+    workers[numWorkers].first = 0;
+    workers[numWorkers].count = 0;
+    workers[numWorkers].sentTime = 0;
+    numWorkers++;
+
+    // the socket now belongs to the worker
+    conn->socket = NULL;
+    DropPending(index);
+
+    printf("\nWorker joined (%i connected)\n", numWorkers);
+}
+
+//
+// kexCoordinator::DropPending
+//
+
+void kexCoordinator::DropPending(const int index)
+{
+    delete pending[index].socket;
+    pending[index] = pending[--numPending];
+}
+
+//
+// kexCoordinator::CheckDeadlines
+//
+// Drops connections that never finished their hello and workers
+// that have been on their job for too long. Dropping a worker
+// puts its job back in line
+//
+
+void kexCoordinator::CheckDeadlines(void)
+{
+    int64_t now = GetMilliseconds();
+
+    for(int i = numPending - 1; i >= 0; i--)
+    {
+        if(now - pending[i].acceptTime > DISTRIBUTE_HELLO_TIMEOUT_MS)
+        {
+            printf("\nDropped a connection that never said hello\n");
+            DropPending(i);
+        }
+    }
+
+    for(int i = numWorkers - 1; i >= 0; i--)
+    {
+        if(workers[i].count != 0 && now - workers[i].sentTime > DISTRIBUTE_JOB_TIMEOUT_MS)
+        {
+            printf("\nWorker is taking too long on its job\n");
+            DropWorker(i);
+        }
+    }
+}
+
+//
+// kexCoordinator::DropWorker
+//
+// Puts the worker's job back in line unless another
+// worker has it or it already came back
+//
+
+void kexCoordinator::DropWorker(const int index)
+{
+    const remoteWorker_t *worker = &workers[index];
+    int job = worker->job;
+
+    if(worker->count != 0 && worker->pass == pass)
+    {
+        jobCopies[job]--;
+
+        if(jobStates[job] == JOB_SENT && jobCopies[job] == 0)
+        {
+            jobStates[job] = JOB_PENDING;
+        }
+    }
+
+    delete workers[index].socket;
+    workers[index] = workers[--numWorkers];
+
+    printf("\nLost a worker (%i connected)\n", numWorkers);
+}
+
+//
+// kexCoordinator::ReceiveResult
+//
+// Returns false if the worker is gone or sent something it
+// wasn't asked for. Only the first copy of a job is used
+//
+
+bool kexCoordinator::ReceiveResult(const int index)
+{
+    remoteWorker_t *worker = &workers[index];
+    bool bCurrent;
+    bool bApply;
+
+    if(worker->count == 0)
+    {
+        return false;
+    }
+
+    bCurrent = (worker->pass == pass);
+    bApply = (bCurrent && jobStates[worker->job] != JOB_DONE);
+
+    if(!builder.ReceiveJobResults(*worker->socket, worker->pass, worker->first, worker->count, bApply))
+    {
+        return false;
+    }
+
+    if(bApply)
+    {
+        jobStates[worker->job] = JOB_DONE;
+        numJobsDone++;
+    }
+
+    if(bCurrent)
+    {
+        jobCopies[worker->job]--;
+    }
+
+    worker->count = 0;
+    return true;
+}
+
+//
+// kexDistributedWorker::kexDistributedWorker
+//
+
+kexDistributedWorker::kexDistributedWorker(kexLightmapBuilder &builder) : builder(builder)
+{
+}
+
+//
+// kexDistributedWorker::~kexDistributedWorker
+//
+
+kexDistributedWorker::~kexDistributedWorker(void)
+{
+}
+
+//
+// kexDistributedWorker::Hello
+//
+
+bool kexDistributedWorker::Hello(const int map, const uint64_t key, int *reply)
+{
+    int hello[5];
+
+    hello[0] = DISTRIBUTE_ID;
+    hello[1] = DISTRIBUTE_VERSION;
+    hello[2] = map;
+    hello[3] = (int)(key & 0xffffffff);
+    hello[4] = (int)(key >> 32);
+
+    return socket.Send(hello, sizeof(hello)) && socket.Recv(reply, sizeof(int) * 2);
+}
+
+//
+// kexDistributedWorker::Serve
+//
+// Keeps trying to reach the coordinator until it is working on
+// this map, then lights the jobs it is sent until the map is done.
+// Returns early if the coordinator has already moved past the map
+//
+
+void kexDistributedWorker::Serve(const char *address, const int map, const uint64_t key)
+{
+    int64_t startTime = GetSeconds();
+    bool bWaiting = false;
+    int reply[2];
+    int job[3];
+
+    while(1)
+    {
+        if(socket.Connect(address) && Hello(map, key, reply))
+        {
+            if(reply[0])
+            {
+                break;
+            }
+
+            if(reply[1] > map)
+            {
+                printf("Coordinator is past MAP%02d, skipping it\n\n", map);
+                socket.Close();
+                return;
+            }
+
+            if(reply[1] == map)
+            {
+                Error("Coordinator at %s is using different settings or a different wad\n", address);
+                return;
+            }
+        }
+
+        socket.Close();
+
+        if(GetSeconds() - startTime > DISTRIBUTE_CONNECT_TIMEOUT)
+        {
+            Error("Gave up waiting for the coordinator at %s\n", address);
+            return;
+        }
+
+        if(!bWaiting)
+        {
+            printf("Waiting for the coordinator at %s\n", address);
+            fflush(stdout);
+            bWaiting = true;
+        }
+
+        Delay(1000);
+    }
+
+    printf("Connected to the coordinator at %s\n\n", address);
+
+    while(1)
+    {
+        // the coordinator hangs up on workers that are still on a
+        // copy of a job once the map is done, so this isn't fatal
+        if(!socket.Recv(job, sizeof(job)))
+        {
+            break;
+        }
+
+        if(job[0] == DP_DONE)
+        {
+            break;
+        }
+
+        if((job[0] != DP_GRID && job[0] != DP_CHARTS) || job[1] < 0 || job[2] <= 0 ||
+           job[1] + job[2] > (job[0] == DP_GRID ? builder.NumLightGrids() : builder.NumCharts()))
+        {
+            Error("\nCoordinator sent a bad job\n");
+            return;
+        }
+
+        builder.RunJob(job[0], job[1], job[2]);
+
+        if(!builder.SendJobResults(socket, job[0], job[1], job[2]))
+        {
+            break;
+        }
+    }
+
+    printf("\nDone with MAP%02d\n\n", map);
+    socket.Close();
+}
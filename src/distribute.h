@@ -0,0 +1,155 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+
+#ifndef __DISTRIBUTE_H__
+#define __DISTRIBUTE_H__
+
+#include "kexlib/socket.h"
+
+#define DISTRIBUTE_ID               (('W' << 24) | ('D' << 16) | ('M' << 8) | 'L')
+#define DISTRIBUTE_VERSION          2
+
+#define DISTRIBUTE_MAX_WORKERS      64
+
+// how much work is handed to a worker at a time
+#define DISTRIBUTE_CELLS_PER_JOB    2048
+#define DISTRIBUTE_CHARTS_PER_JOB   32
+
+// at the end of a pass, jobs that are still out are also handed to
+// idle workers in case the one that has it is slow or hung
+#define DISTRIBUTE_MAX_COPIES       2
+
+// a worker that stops sending in the middle of a result is dropped
+#define DISTRIBUTE_RECV_TIMEOUT_MS  60000
+
+// a connection that doesn't say hello in time is dropped
+#define DISTRIBUTE_HELLO_TIMEOUT_MS 10000
+
+// a worker that hasn't sent back its job in time is taken to be hung,
+// so it's dropped and the job goes back in line
+#define DISTRIBUTE_JOB_TIMEOUT_MS   600000
+
+// how long a worker keeps trying to reach the coordinator
+#define DISTRIBUTE_CONNECT_TIMEOUT  600
+
+typedef enum
+{
+    DP_GRID     = 1,
+    DP_CHARTS,
+    DP_DONE
+} distributePass_t;
+
+class kexLightmapBuilder;
+
+//
+// hands out chunks of grid cells and charts to worker processes
+// and merges their results back into the builder
+//
+class kexCoordinator
+{
+public:
+    kexCoordinator(kexLightmapBuilder &builder);
+    ~kexCoordinator(void);
+
+    void                    Start(const char *address, const int map, const uint64_t key);
+    void                    RunPass(const int pass, const int count, const int jobSize);
+    void                    Finish(void);
+
+private:
+    typedef enum
+    {
+        JOB_PENDING     = 0,
+        JOB_SENT,
+        JOB_DONE
+    } jobState_t;
+
+    // a worker can still be on a copy of a job from the last pass,
+    // so what it was sent is kept to read the result back
+    typedef struct
+    {
+        kexSocket           *socket;
+        int                 job;
+        int                 pass;
+        int                 first;
+        int                 count;
+        int64_t             sentTime;
+    } remoteWorker_t;
+
+    // a connection whose hello is read as it comes in, so a
+    // slow one doesn't hold up the workers that already joined
+    typedef struct
+    {
+        kexSocket           *socket;
+        int                 hello[5];
+        int                 helloSize;
+        int64_t             acceptTime;
+    } pendingWorker_t;
+
+    void                    Poll(const int ms);
+    void                    AcceptWorker(void);
+    void                    ReadHello(const int index);
+    void                    DropPending(const int index);
+    void                    CheckDeadlines(void);
+    void                    DropWorker(const int index);
+    bool                    ReceiveResult(const int index);
+    void                    DispatchJobs(void);
+    int                     NextJob(void);
+    int                     JobCount(const int job) const;
+
+    kexLightmapBuilder      &builder;
+    kexSocket               listener;
+    remoteWorker_t          workers[DISTRIBUTE_MAX_WORKERS];
+    int                     numWorkers;
+    pendingWorker_t         pending[DISTRIBUTE_MAX_WORKERS];
+    int                     numPending;
+    int                     map;
+    uint64_t                key;
+    int                     pass;
+    int                     count;
+    int                     jobSize;
+    int                     numJobs;
+    int                     numJobsDone;
+    byte                    *jobStates;
+    int                     *jobCopies;
+};
+
+//
+// connects to a coordinator and lights whatever it is sent
+//
+class kexDistributedWorker
+{
+public:
+    kexDistributedWorker(kexLightmapBuilder &builder);
+    ~kexDistributedWorker(void);
+
+    void                    Serve(const char *address, const int map, const uint64_t key);
+
+private:
+    bool                    Hello(const int map, const uint64_t key, int *reply);
+
+    kexLightmapBuilder      &builder;
+    kexSocket               socket;
+};
+
+#endif
@@ -0,0 +1,458 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION: Saves the level structures and surfaces that are built from
+//              the map's lumps, so the next run with the same lumps can map
+//              the file and use them in place. Pointers are stored as
+//              indices and fixed up after loading. The file is only meant
+//              for the machine and build that wrote it
+//
+//-----------------------------------------------------------------------------
+
+#include "common.h"
+#include "wad.h"
+#include "mapData.h"
+#include "surfaces.h"
+#include "lightCache.h"
+#include "geometryCache.h"
+
+#define ALIGN_SECTION(x)    (((x) + (GEOMETRYCACHE_ALIGN-1)) & ~(GEOMETRYCACHE_ALIGN-1))
+
+//
+// kexGeometryCache::kexGeometryCache
+//
+
+kexGeometryCache::kexGeometryCache(void)
+{
+}
+
+//
+// kexGeometryCache::~kexGeometryCache
+//
+
+kexGeometryCache::~kexGeometryCache(void)
+{
+    Close();
+}
+
+//
+// kexGeometryCache::Close
+//
+// The level structures that were loaded point into the file,
+// so this can only be done once the map is no longer used
+//
+
+void kexGeometryCache::Close(void)
+{
+    if(file.Opened())
+    {
+        file.Close();
+    }
+}
+
+//
+// kexGeometryCache::MapKey
+//
+// Hashes every lump that the level structures and surfaces are built
+// from. The sun ignore tag decides which sectors count as sky, so it
+// is part of the key too
+//
+
+uint64_t kexGeometryCache::MapKey(kexWadFile &wadFile, kexDoomMap &doomMap)
+{
+    static const mapLumps_t mapLumps[] =
+    {
+        ML_LINEDEFS, ML_SIDEDEFS, ML_VERTEXES, ML_SECTORS
+    };
+    static const glMapLumps_t glMapLumps[] =
+    {
+        ML_GL_VERTS, ML_GL_SEGS, ML_GL_SSECT, ML_GL_NODES, ML_GL_PVS
+    };
+    uint64_t hash = FNV_OFFSET_BASIS;
+    lump_t *lump;
+
+    for(unsigned int i = 0; i < sizeof(mapLumps) / sizeof(mapLumps[0]); i++)
+    {
+        if(!(lump = wadFile.GetMapLump(mapLumps[i])))
+        {
+            hash = kexLightCache::HashInt(-1, hash);
+            continue;
+        }
+
+        hash = kexLightCache::HashInt(lump->size, hash);
+        hash = kexLightCache::Hash(wadFile.GetLumpData(lump), lump->size, hash);
+    }
+
+    for(unsigned int i = 0; i < sizeof(glMapLumps) / sizeof(glMapLumps[0]); i++)
+    {
+        if(!(lump = wadFile.GetGLMapLump(glMapLumps[i])))
+        {
+            hash = kexLightCache::HashInt(-1, hash);
+            continue;
+        }
+
+        hash = kexLightCache::HashInt(lump->size, hash);
+        hash = kexLightCache::Hash(wadFile.GetLumpData(lump), lump->size, hash);
+    }
+
+    hash = kexLightCache::HashInt(doomMap.GetSunIgnoreTag(), hash);
+
+    return hash;
+}
+
+//
+// kexGeometryCache::Layout
+//
+// Structures are stored as they are in memory, so a cache written by
+// a build with a different layout can't be used
+//
+
+int kexGeometryCache::Layout(void)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    hash = kexLightCache::HashInt(sizeof(void*), hash);
+    hash = kexLightCache::HashInt(sizeof(bool), hash);
+    hash = kexLightCache::HashInt(sizeof(vertex_t), hash);
+    hash = kexLightCache::HashInt(sizeof(leaf_t), hash);
+    hash = kexLightCache::HashInt(sizeof(kexBBox), hash);
+    hash = kexLightCache::HashInt(sizeof(kexVec3), hash);
+    hash = kexLightCache::HashInt(sizeof(surface_t), hash);
+
+    return (int)(hash & 0x7FFFFFFF);
+}
+
+//
+// kexGeometryCache::Section
+//
+// Returns where a section starts in the file, or NULL if it
+// doesn't have the expected length or runs past the end
+//
+
+byte *kexGeometryCache::Section(const geometryCacheHeader_t *header, const int section,
+                                const int length)
+{
+    int offset = header->offsets[section];
+
+    if(header->lengths[section] != length || offset < 0 ||
+       (offset & (GEOMETRYCACHE_ALIGN-1)) || offset > file.Length() - length)
+    {
+        return NULL;
+    }
+
+    return &file.Buffer()[offset];
+}
+
+//
+// kexGeometryCache::Load
+//
+// Points the level structures of the map at the cache and adds its
+// surfaces. Returns false if the cache is missing or was saved for
+// different lumps, in which case the map has to be built as usual
+//
+
+bool kexGeometryCache::Load(const char *fileName, kexWadFile &wadFile, kexDoomMap &doomMap)
+{
+    geometryCacheHeader_t *header;
+    kexVec3 *surfaceVerts;
+    surface_t *surfs;
+    int numSurfaceVerts;
+    int numLeafs;
+
+    doomMap.LoadMapLumps(wadFile);
+
+    // the pointers in the cache are patched in place
+    if(!file.Exists(fileName) || !file.OpenMapped(fileName, true))
+    {
+        return false;
+    }
+
+    header = (geometryCacheHeader_t*)file.Buffer();
+
+    if(file.Length() < (int)sizeof(geometryCacheHeader_t) ||
+       header->id != GEOMETRYCACHE_ID ||
+       header->version != GEOMETRYCACHE_VERSION ||
+       header->layout != Layout() ||
+       header->mapKey != MapKey(wadFile, doomMap) ||
+       header->numSurfaces < 0 ||
+       header->lengths[GC_VERTEXES] < 0 ||
+       header->lengths[GC_SURFACEVERTS] < 0)
+    {
+        file.Close();
+        return false;
+    }
+
+    // BuildLeafs makes a leaf for every seg
+    numLeafs = doomMap.numSegs;
+    numSurfaceVerts = header->lengths[GC_SURFACEVERTS] / sizeof(kexVec3);
+
+    doomMap.numVertexes = header->lengths[GC_VERTEXES] / sizeof(vertex_t);
+    doomMap.numLeafs = doomMap.numSSects;
+
+    doomMap.vertexes = (vertex_t*)Section(header, GC_VERTEXES,
+                                          sizeof(vertex_t) * doomMap.numVertexes);
+    doomMap.nodeBounds = (kexBBox*)Section(header, GC_NODEBOUNDS,
+                                           sizeof(kexBBox) * doomMap.numNodes);
+    doomMap.leafs = (leaf_t*)Section(header, GC_LEAFS, sizeof(leaf_t) * numLeafs);
+    doomMap.segLeafLookup = (int*)Section(header, GC_SEGLEAFLOOKUP,
+                                          sizeof(int) * doomMap.numSegs);
+    doomMap.ssLeafLookup = (int*)Section(header, GC_SSLEAFLOOKUP,
+                                         sizeof(int) * doomMap.numSSects);
+    doomMap.ssLeafCount = (int*)Section(header, GC_SSLEAFCOUNT,
+                                        sizeof(int) * doomMap.numSSects);
+    doomMap.ssLeafBounds = (kexBBox*)Section(header, GC_SSLEAFBOUNDS,
+                                             sizeof(kexBBox) * doomMap.numSSects);
+    doomMap.bSkySectors = (bool*)Section(header, GC_SKYSECTORS,
+                                         sizeof(bool) * doomMap.numSectors);
+    doomMap.bSSectsVisibleToSky = (bool*)Section(header, GC_SSECTSVISIBLETOSKY,
+                                                 sizeof(bool) * doomMap.numSSects);
+    surfs = (surface_t*)Section(header, GC_SURFACES, sizeof(surface_t) * header->numSurfaces);
+    surfaceVerts = (kexVec3*)Section(header, GC_SURFACEVERTS, sizeof(kexVec3) * numSurfaceVerts);
+
+    if(!doomMap.vertexes || !doomMap.nodeBounds || !doomMap.leafs ||
+       !doomMap.segLeafLookup || !doomMap.ssLeafLookup || !doomMap.ssLeafCount ||
+       !doomMap.ssLeafBounds || !doomMap.bSkySectors || !doomMap.bSSectsVisibleToSky ||
+       !surfs || !surfaceVerts)
+    {
+        // leave the map as if it was never touched so it can be built normally
+        doomMap.vertexes = NULL;
+        doomMap.nodeBounds = NULL;
+        doomMap.leafs = NULL;
+        doomMap.segLeafLookup = NULL;
+        doomMap.ssLeafLookup = NULL;
+        doomMap.ssLeafCount = NULL;
+        doomMap.ssLeafBounds = NULL;
+        doomMap.bSkySectors = NULL;
+        doomMap.bSSectsVisibleToSky = NULL;
+
+        file.Close();
+        return false;
+    }
+
+    // turn the stored indices back into pointers
+    for(int i = 0; i < numLeafs; i++)
+    {
+        leaf_t *leaf = &doomMap.leafs[i];
+        int vertex = (int)(intptr_t)leaf->vertex;
+        int seg = (int)(intptr_t)leaf->seg;
+
+        leaf->vertex = vertex ? &doomMap.vertexes[vertex-1] : NULL;
+        leaf->seg = seg ? &doomMap.mapSegs[seg-1] : NULL;
+    }
+
+    doomMap.segSurfaces[0] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
+                             doomMap.numSegs, hb_map);
+    doomMap.segSurfaces[1] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
+                             doomMap.numSegs, hb_map);
+    doomMap.segSurfaces[2] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
+                             doomMap.numSegs, hb_map);
+    doomMap.leafSurfaces[0] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
+                              doomMap.numSSects, hb_map);
+    doomMap.leafSurfaces[1] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
+                              doomMap.numSSects, hb_map);
+
+    for(int i = 0; i < header->numSurfaces; i++)
+    {
+        surface_t *surf = &surfs[i];
+        int data = (int)(intptr_t)surf->data;
+
+        surf->verts = &surfaceVerts[(intptr_t)surf->verts];
+        surf->subSector = &doomMap.mapSSects[(intptr_t)surf->subSector];
+
+        switch(surf->type)
+        {
+        case ST_MIDDLESEG:
+            surf->data = &doomMap.mapSegs[data];
+            doomMap.segSurfaces[0][data] = surf;
+            break;
+        case ST_LOWERSEG:
+            surf->data = &doomMap.mapSegs[data];
+            doomMap.segSurfaces[1][data] = surf;
+            break;
+        case ST_UPPERSEG:
+            surf->data = &doomMap.mapSegs[data];
+            doomMap.segSurfaces[2][data] = surf;
+            break;
+        case ST_FLOOR:
+            surf->data = &doomMap.mapSectors[data];
+            doomMap.leafSurfaces[0][surf->typeIndex] = surf;
+            break;
+        case ST_CEILING:
+            surf->data = &doomMap.mapSectors[data];
+            doomMap.leafSurfaces[1][surf->typeIndex] = surf;
+            break;
+        default:
+            break;
+        }
+
+        surfaces.Push(surf);
+    }
+
+    printf("Loaded level structures and %i surfaces from %s\n\n",
+           header->numSurfaces, fileName);
+
+    return true;
+}
+
+//
+// kexGeometryCache::Save
+//
+// Writes the level structures and surfaces of a map that was just
+// built. Has to be done before the map is lit, since lighting fills
+// in the surfaces' lightmap fields
+//
+
+bool kexGeometryCache::Save(const char *fileName, kexWadFile &wadFile, kexDoomMap &doomMap)
+{
+    static const byte padding[GEOMETRYCACHE_ALIGN] = { 0 };
+    kexBinFile saveFile;
+    kexStr tempName = kexStr(fileName) + ".tmp";
+    geometryCacheHeader_t header;
+    byte *data[GC_NUMSECTIONS];
+    leaf_t *leafs;
+    surface_t *surfs;
+    kexVec3 *surfaceVerts;
+    int numLeafs;
+    int numSurfaceVerts;
+    int offset;
+
+    // BuildLeafs makes a leaf for every seg
+    numLeafs = doomMap.numSegs;
+    numSurfaceVerts = 0;
+
+    for(unsigned int i = 0; i < surfaces.Length(); i++)
+    {
+        numSurfaceVerts += surfaces[i]->numVerts;
+    }
+
+    // pointers are stored as indices, with 0 meaning none for the leafs
+    leafs = new leaf_t[numLeafs];
+
+    for(int i = 0; i < numLeafs; i++)
+    {
+        leaf_t *leaf = &doomMap.leafs[i];
+
+        leafs[i].vertex = (vertex_t*)(intptr_t)(leaf->vertex ? (leaf->vertex - doomMap.vertexes) + 1 : 0);
+        leafs[i].seg = (glSeg_t*)(intptr_t)(leaf->seg ? (leaf->seg - doomMap.mapSegs) + 1 : 0);
+    }
+
+    surfs = new surface_t[surfaces.Length()];
+    surfaceVerts = new kexVec3[numSurfaceVerts];
+    numSurfaceVerts = 0;
+
+    for(unsigned int i = 0; i < surfaces.Length(); i++)
+    {
+        surface_t *surf = surfaces[i];
+
+        surfs[i] = *surf;
+        surfs[i].lightmapCoords = NULL;
+        surfs[i].verts = (kexVec3*)(intptr_t)numSurfaceVerts;
+        surfs[i].subSector = (mapSubSector_t*)(intptr_t)(surf->subSector - doomMap.mapSSects);
+
+        if(surf->type >= ST_MIDDLESEG && surf->type <= ST_LOWERSEG)
+        {
+            surfs[i].data = (void*)(intptr_t)((glSeg_t*)surf->data - doomMap.mapSegs);
+        }
+        else
+        {
+            surfs[i].data = (void*)(intptr_t)((mapSector_t*)surf->data - doomMap.mapSectors);
+        }
+
+        for(int j = 0; j < surf->numVerts; j++)
+        {
+            surfaceVerts[numSurfaceVerts++] = surf->verts[j];
+        }
+    }
+
+    memset(&header, 0, sizeof(geometryCacheHeader_t));
+
+    header.id = GEOMETRYCACHE_ID;
+    header.version = GEOMETRYCACHE_VERSION;
+    header.layout = Layout();
+    header.numSurfaces = surfaces.Length();
+    header.mapKey = MapKey(wadFile, doomMap);
+
+    data[GC_VERTEXES]               = (byte*)doomMap.vertexes;
+    data[GC_NODEBOUNDS]             = (byte*)doomMap.nodeBounds;
+    data[GC_LEAFS]                  = (byte*)leafs;
+    data[GC_SEGLEAFLOOKUP]          = (byte*)doomMap.segLeafLookup;
+    data[GC_SSLEAFLOOKUP]           = (byte*)doomMap.ssLeafLookup;
+    data[GC_SSLEAFCOUNT]            = (byte*)doomMap.ssLeafCount;
+    data[GC_SSLEAFBOUNDS]           = (byte*)doomMap.ssLeafBounds;
+    data[GC_SKYSECTORS]             = (byte*)doomMap.bSkySectors;
+    data[GC_SSECTSVISIBLETOSKY]     = (byte*)doomMap.bSSectsVisibleToSky;
+    data[GC_SURFACES]               = (byte*)surfs;
+    data[GC_SURFACEVERTS]           = (byte*)surfaceVerts;
+
+    header.lengths[GC_VERTEXES]             = sizeof(vertex_t) * doomMap.numVertexes;
+    header.lengths[GC_NODEBOUNDS]           = sizeof(kexBBox) * doomMap.numNodes;
+    header.lengths[GC_LEAFS]                = sizeof(leaf_t) * numLeafs;
+    header.lengths[GC_SEGLEAFLOOKUP]        = sizeof(int) * doomMap.numSegs;
+    header.lengths[GC_SSLEAFLOOKUP]         = sizeof(int) * doomMap.numSSects;
+    header.lengths[GC_SSLEAFCOUNT]          = sizeof(int) * doomMap.numSSects;
+    header.lengths[GC_SSLEAFBOUNDS]         = sizeof(kexBBox) * doomMap.numSSects;
+    header.lengths[GC_SKYSECTORS]           = sizeof(bool) * doomMap.numSectors;
+    header.lengths[GC_SSECTSVISIBLETOSKY]   = sizeof(bool) * doomMap.numSSects;
+    header.lengths[GC_SURFACES]             = sizeof(surface_t) * surfaces.Length();
+    header.lengths[GC_SURFACEVERTS]         = sizeof(kexVec3) * numSurfaceVerts;
+
+    offset = ALIGN_SECTION(sizeof(geometryCacheHeader_t));
+
+    for(int i = 0; i < GC_NUMSECTIONS; i++)
+    {
+        header.offsets[i] = offset;
+        offset = ALIGN_SECTION(offset + header.lengths[i]);
+    }
+
+    if(!saveFile.Create(tempName))
+    {
+        delete[] leafs;
+        delete[] surfs;
+        delete[] surfaceVerts;
+        return false;
+    }
+
+    saveFile.WriteBytes((byte*)&header, sizeof(geometryCacheHeader_t));
+    offset = sizeof(geometryCacheHeader_t);
+
+    for(int i = 0; i < GC_NUMSECTIONS; i++)
+    {
+        saveFile.WriteBytes(padding, header.offsets[i] - offset);
+        saveFile.WriteBytes(data[i], header.lengths[i]);
+        offset = header.offsets[i] + header.lengths[i];
+    }
+
+    saveFile.Close();
+
+    delete[] leafs;
+    delete[] surfs;
+    delete[] surfaceVerts;
+
+#ifdef KEX_WIN32
+    remove(fileName);
+#endif
+
+    return rename(tempName, fileName) == 0;
+}
@@ -0,0 +1,85 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+
+#ifndef __GEOMETRYCACHE_H__
+#define __GEOMETRYCACHE_H__
+
+#include "kexlib/binFile.h"
+
+#define GEOMETRYCACHE_ID        (('C' << 24) | ('G' << 16) | ('M' << 8) | 'L')
+#define GEOMETRYCACHE_VERSION   1
+
+// every section starts on a multiple of this so it can be used in place
+#define GEOMETRYCACHE_ALIGN     16
+
+typedef enum
+{
+    GC_VERTEXES     = 0,
+    GC_NODEBOUNDS,
+    GC_LEAFS,
+    GC_SEGLEAFLOOKUP,
+    GC_SSLEAFLOOKUP,
+    GC_SSLEAFCOUNT,
+    GC_SSLEAFBOUNDS,
+    GC_SKYSECTORS,
+    GC_SSECTSVISIBLETOSKY,
+    GC_SURFACES,
+    GC_SURFACEVERTS,
+    GC_NUMSECTIONS
+} geometryCacheSection_t;
+
+typedef struct
+{
+    int             id;
+    int             version;
+    int             layout;
+    int             numSurfaces;
+    uint64_t        mapKey;
+    int             offsets[GC_NUMSECTIONS];
+    int             lengths[GC_NUMSECTIONS];
+} geometryCacheHeader_t;
+
+class kexWadFile;
+class kexDoomMap;
+
+class kexGeometryCache
+{
+public:
+    kexGeometryCache(void);
+    ~kexGeometryCache(void);
+
+    bool                    Load(const char *fileName, kexWadFile &wadFile, kexDoomMap &doomMap);
+    bool                    Save(const char *fileName, kexWadFile &wadFile, kexDoomMap &doomMap);
+    void                    Close(void);
+
+private:
+    static uint64_t         MapKey(kexWadFile &wadFile, kexDoomMap &doomMap);
+    static int              Layout(void);
+    byte                    *Section(const geometryCacheHeader_t *header, const int section,
+                                     const int length);
+
+    kexBinFile              file;
+};
+
+#endif
@@ -30,6 +30,26 @@
 #include "common.h"
 #include "kexlib/binFile.h"
 
+#ifdef KEX_WIN32
+#include <io.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#endif
+
+// iovecs handed to a single writev call
+#define BINFILE_MAX_BLOCKS  256
+
+// largest piece that a copy writes from the source buffer at once
+#define BINFILE_MAX_COPY    (1 << 30)
+
 //
 // kexBinFile::kexBinFile
 //
@@ -40,6 +60,8 @@ kexBinFile::kexBinFile(void)
     this->buffer = NULL;
     this->bufferOffset = 0;
     this->bOpened = false;
+    this->bMapped = false;
+    this->mappedLength = 0;
 }
 
 //
@@ -85,6 +107,54 @@ bool kexBinFile::Open(const char *file, kexHeapBlock &heapBlock)
     return false;
 }
 
+//
+// kexBinFile::OpenMapped
+//
+// Maps the file instead of reading it into memory, so only the pages
+// that are actually accessed get loaded. The mapping is read-only and
+// writing into the buffer faults. With bWritable the buffer can be
+// patched in place, but the mapping is private so the writes only go
+// to copies of the pages and never reach the file. Falls back to Open
+// if the file can't be mapped
+//
+
+bool kexBinFile::OpenMapped(const char *file, const bool bWritable)
+{
+#ifndef KEX_WIN32
+    struct stat st;
+    void *ptr;
+
+    if(!(handle = fopen(file, "rb")))
+    {
+        return false;
+    }
+
+    if(fstat(fileno(handle), &st) == 0 && st.st_size > 0)
+    {
+        ptr = mmap(NULL, (size_t)st.st_size, bWritable ? (PROT_READ|PROT_WRITE) : PROT_READ,
+                   MAP_PRIVATE, fileno(handle), 0);
+
+        if(ptr != MAP_FAILED)
+        {
+            // lumps are looked up all over the file
+            madvise(ptr, (size_t)st.st_size, MADV_RANDOM);
+
+            buffer = (byte*)ptr;
+            mappedLength = (size_t)st.st_size;
+            bMapped = true;
+            bOpened = true;
+            bufferOffset = 0;
+            return true;
+        }
+    }
+
+    fclose(handle);
+    handle = NULL;
+#endif
+
+    return Open(file);
+}
+
 //
 // kexBinFile::Create
 //
@@ -101,6 +171,88 @@ bool kexBinFile::Create(const char *file)
     return false;
 }
 
+//
+// kexBinFile::OpenForUpdate
+//
+// Opens an existing file for writing without truncating it or
+// reading it into memory
+//
+
+bool kexBinFile::OpenForUpdate(const char *file)
+{
+    if((handle = fopen(file, "r+b")))
+    {
+        bOpened = true;
+        bufferOffset = 0;
+        return true;
+    }
+
+    return false;
+}
+
+//
+// kexBinFile::Seek
+//
+
+void kexBinFile::Seek(const int offset)
+{
+    if(bOpened == false)
+    {
+        return;
+    }
+
+    fflush(handle);
+    fseek(handle, offset, SEEK_SET);
+    bufferOffset = offset;
+}
+
+//
+// kexBinFile::Sync
+//
+// Makes sure everything written so far is on the disk
+//
+
+bool kexBinFile::Sync(void)
+{
+    if(bOpened == false || fflush(handle) != 0)
+    {
+        return false;
+    }
+
+#ifdef KEX_WIN32
+    return _commit(_fileno(handle)) == 0;
+#else
+    return fsync(fileno(handle)) == 0;
+#endif
+}
+
+//
+// kexBinFile::Truncate
+//
+// Cuts the file off at length and moves to the end of it
+//
+
+bool kexBinFile::Truncate(const int length)
+{
+    if(bOpened == false || fflush(handle) != 0)
+    {
+        return false;
+    }
+
+#ifdef KEX_WIN32
+    if(_chsize(_fileno(handle), length) != 0)
+#else
+    if(ftruncate(fileno(handle), length) != 0)
+#endif
+    {
+        return false;
+    }
+
+    fseek(handle, length, SEEK_SET);
+    bufferOffset = length;
+    return true;
+}
+
 //
 // kexBinFile::Close
 //
@@ -115,10 +267,19 @@ void kexBinFile::Close(void)
     {
         fclose(handle);
         handle = NULL;
-        if(buffer)
+        if(bMapped)
+        {
+#ifndef KEX_WIN32
+            munmap(buffer, mappedLength);
+#endif
+            bMapped = false;
+            mappedLength = 0;
+        }
+        else if(buffer)
         {
             Mem_Free(buffer);
         }
+        buffer = NULL;
     }
 
     bOpened = false;
@@ -394,3 +555,187 @@ byte *kexBinFile::GetOffset(int id, byte *subdata, int *count)
 
     return dataOffs;
 }
+
+//
+// kexBinFile::WriteBytes
+//
+
+void kexBinFile::WriteBytes(const byte *data, const int length)
+{
+    if(bOpened)
+    {
+        fwrite(data, 1, length, handle);
+    }
+    else
+    {
+        memcpy(&buffer[bufferOffset], data, length);
+    }
+    bufferOffset += length;
+}
+
+//
+// kexBinFile::WriteBlocks
+//
+// Writes a list of buffers back to back with as few system calls
+// as possible. Returns false if the file couldn't be written
+//
+
+bool kexBinFile::WriteBlocks(byte **blocks, const int *lengths, const int count)
+{
+    if(bOpened == false)
+    {
+        return false;
+    }
+
+#ifndef KEX_WIN32
+    struct iovec iov[BINFILE_MAX_BLOCKS];
+    int fd = fileno(handle);
+    int i = 0;
+
+    fflush(handle);
+
+    while(i < count)
+    {
+        int numBlocks = 0;
+        ssize_t result;
+
+        while(i + numBlocks < count && numBlocks < BINFILE_MAX_BLOCKS)
+        {
+            iov[numBlocks].iov_base = blocks[i + numBlocks];
+            iov[numBlocks].iov_len = lengths[i + numBlocks];
+            numBlocks++;
+        }
+
+        result = writev(fd, iov, numBlocks);
+
+        if(result < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+
+        bufferOffset += result;
+
+        // skip past whatever made it out, a short write leaves the
+        // rest of the batch for the next call
+        while(numBlocks > 0 && result >= (ssize_t)lengths[i])
+        {
+            result -= lengths[i++];
+            numBlocks--;
+        }
+
+        if(numBlocks > 0 && result > 0)
+        {
+            // finish the partially written block on its own
+            int left = lengths[i] - (int)result;
+            byte *ptr = blocks[i] + result;
+
+            while(left > 0)
+            {
+                ssize_t written = write(fd, ptr, left);
+
+                if(written < 0)
+                {
+                    if(errno == EINTR)
+                    {
+                        continue;
+                    }
+                    return false;
+                }
+
+                ptr += written;
+                left -= (int)written;
+                bufferOffset += written;
+            }
+
+            i++;
+        }
+    }
+
+    return true;
+#else
+    for(int i = 0; i < count; i++)
+    {
+        if(fwrite(blocks[i], 1, lengths[i], handle) != (size_t)lengths[i])
+        {
+            return false;
+        }
+        bufferOffset += lengths[i];
+    }
+
+    return true;
+#endif
+}
+
+//
+// kexBinFile::CopyRange
+//
+// Appends part of another open file. Lets the kernel copy the data
+// directly where it can instead of going through the source buffer
+//
+
+bool kexBinFile::CopyRange(kexBinFile &src, const off_t offset, const size_t length)
+{
+    if(bOpened == false || src.Opened() == false)
+    {
+        return false;
+    }
+
+    size_t left = length;
+
+#if defined(__linux__)
+    int outfd = fileno(handle);
+    int infd = fileno(src.Handle());
+    loff_t inOffset = offset;
+
+    fflush(handle);
+
+    while(left > 0)
+    {
+        ssize_t result = copy_file_range(infd, &inOffset, outfd, NULL, left, 0);
+
+        if(result <= 0)
+        {
+            break;
+        }
+
+        left -= (size_t)result;
+    }
+
+    // copy_file_range isn't supported across every filesystem
+    while(left > 0)
+    {
+        off_t sendOffset = (off_t)inOffset;
+        ssize_t result = sendfile(outfd, infd, &sendOffset, left);
+
+        if(result <= 0)
+        {
+            break;
+        }
+
+        inOffset = sendOffset;
+        left -= (size_t)result;
+    }
+
+    bufferOffset += length - left;
+#endif
+
+    // WriteBlocks takes int lengths, so anything left goes in pieces
+    while(left > 0)
+    {
+        byte *ptr = src.Buffer() + offset + (length - left);
+        int size = (int)MIN(left, (size_t)BINFILE_MAX_COPY);
+
+        if(!WriteBlocks(&ptr, &size, 1))
+        {
+            return false;
+        }
+
+        left -= size;
+    }
+
+    return true;
+}
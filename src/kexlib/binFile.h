@@ -25,6 +25,7 @@
 #ifndef __BINFILE_H__
 #define __BINFILE_H__
 
+#include <sys/types.h>
 #include "kexlib/math/mathlib.h"
 
 class kexBinFile
@@ -34,7 +35,12 @@ public:
     ~kexBinFile(void);
 
     bool                Open(const char *file, kexHeapBlock &heapBlock = hb_static);
+    bool                OpenMapped(const char *file, const bool bWritable = false);
     bool                Create(const char *file);
+    bool                OpenForUpdate(const char *file);
+    void                Seek(const int offset);
+    bool                Sync(void);
+    bool                Truncate(const int length);
     void                Close(void);
     bool                Exists(const char *file);
     int                 Length(void);
@@ -53,6 +59,9 @@ public:
     void                WriteFloat(const float val);
     void                WriteVector(const kexVec3 &val);
     void                WriteString(const kexStr &val);
+    void                WriteBytes(const byte *data, const int length);
+    bool                WriteBlocks(byte **blocks, const int *lengths, const int count);
+    bool                CopyRange(kexBinFile &src, const off_t offset, const size_t length);
 
     int                 GetOffsetValue(int id);
     byte                *GetOffset(int id,
@@ -64,6 +73,7 @@ public:
     void                SetBuffer(byte *ptr) { buffer = ptr; }
     byte                *BufferAt(void) const { return &buffer[bufferOffset]; }
     bool                Opened(void) const { return bOpened; }
+    bool                Mapped(void) const { return bMapped; }
     void                SetOffset(const int offset) { bufferOffset = offset; }
 
 private:
@@ -71,6 +81,8 @@ private:
     byte                *buffer;
     unsigned int        bufferOffset;
     bool                bOpened;
+    bool                bMapped;
+    size_t              mappedLength;
 };
 
 #endif
@@ -0,0 +1,475 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION: Blocking stream sockets. Addresses are either host:port
+//              or unix:path for a local socket
+//
+//-----------------------------------------------------------------------------
+
+#include "common.h"
+#include "kexlib/socket.h"
+
+#ifdef KEX_WIN32
+#include <ws2tcpip.h>
+#define INVALID_HANDLE  INVALID_SOCKET
+#define CLOSESOCKET(s)  closesocket(s)
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#define INVALID_HANDLE  -1
+#define CLOSESOCKET(s)  close(s)
+#endif
+
+// don't get killed by SIGPIPE when the other end went away
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS      MSG_NOSIGNAL
+#else
+#define SEND_FLAGS      0
+#endif
+
+//
+// SetConnectionOptions
+//
+// Job messages are small, so don't let them sit in the send buffer.
+// The tcp ones fail harmlessly on local sockets
+//
+
+static void SetConnectionOptions(socketHandle_t handle)
+{
+    int on = 1;
+
+    setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+    setsockopt(handle, SOL_SOCKET, SO_KEEPALIVE, (const char*)&on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(handle, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&on, sizeof(on));
+#endif
+}
+
+//
+// kexSocket::kexSocket
+//
+
+kexSocket::kexSocket(void)
+{
+    this->handle = INVALID_HANDLE;
+    this->bOpened = false;
+}
+
+//
+// kexSocket::~kexSocket
+//
+
+kexSocket::~kexSocket(void)
+{
+    Close();
+}
+
+//
+// kexSocket::Open
+//
+
+bool kexSocket::Open(const char *address, const bool bListen)
+{
+    char host[256];
+    char *port;
+    struct addrinfo hints;
+    struct addrinfo *result;
+    struct addrinfo *ai;
+    int on = 1;
+
+#ifdef KEX_WIN32
+    static bool bWinsockStarted = false;
+
+    if(!bWinsockStarted)
+    {
+        WSADATA wsaData;
+
+        if(WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+        {
+            return false;
+        }
+
+        bWinsockStarted = true;
+    }
+#else
+    if(!strncmp(address, "unix:", 5))
+    {
+        struct sockaddr_un addr;
+        const char *path = address + 5;
+
+        if(strlen(path) >= sizeof(addr.sun_path))
+        {
+            return false;
+        }
+
+        if((handle = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_HANDLE)
+        {
+            return false;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+
+        if(bListen)
+        {
+            // a socket file left behind by an earlier run would make bind fail
+            unlink(path);
+
+            if(bind(handle, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+               listen(handle, SOMAXCONN) != 0)
+            {
+                CLOSESOCKET(handle);
+                handle = INVALID_HANDLE;
+                return false;
+            }
+
+            unixPath = path;
+        }
+        else if(connect(handle, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+        {
+            SetConnectionOptions(handle);
+        }
+        else
+        {
+            CLOSESOCKET(handle);
+            handle = INVALID_HANDLE;
+            return false;
+        }
+
+        bOpened = true;
+        return true;
+    }
+#endif
+
+    strncpy(host, address, sizeof(host) - 1);
+    host[sizeof(host) - 1] = 0;
+
+    if(!(port = strrchr(host, ':')))
+    {
+        return false;
+    }
+
+    *port++ = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = bListen ? AI_PASSIVE : 0;
+
+    if(getaddrinfo((host[0] == 0 || !strcmp(host, "*")) ? NULL : host, port, &hints, &result) != 0)
+    {
+        return false;
+    }
+
+    for(ai = result; ai != NULL; ai = ai->ai_next)
+    {
+        if((handle = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == INVALID_HANDLE)
+        {
+            continue;
+        }
+
+        if(bListen)
+        {
+            setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+
+            if(bind(handle, ai->ai_addr, (int)ai->ai_addrlen) == 0 &&
+               listen(handle, SOMAXCONN) == 0)
+            {
+                break;
+            }
+        }
+        else if(connect(handle, ai->ai_addr, (int)ai->ai_addrlen) == 0)
+        {
+            SetConnectionOptions(handle);
+            break;
+        }
+
+        CLOSESOCKET(handle);
+        handle = INVALID_HANDLE;
+    }
+
+    freeaddrinfo(result);
+
+    if(handle == INVALID_HANDLE)
+    {
+        return false;
+    }
+
+    bOpened = true;
+    return true;
+}
+
+//
+// kexSocket::Listen
+//
+
+bool kexSocket::Listen(const char *address)
+{
+    return Open(address, true);
+}
+
+//
+// kexSocket::Connect
+//
+
+bool kexSocket::Connect(const char *address)
+{
+    return Open(address, false);
+}
+
+//
+// kexSocket::Accept
+//
+
+bool kexSocket::Accept(kexSocket &client)
+{
+    if((client.handle = accept(handle, NULL, NULL)) == INVALID_HANDLE)
+    {
+        return false;
+    }
+
+    SetConnectionOptions(client.handle);
+
+    client.bOpened = true;
+    return true;
+}
+
+//
+// kexSocket::Close
+//
+
+void kexSocket::Close(void)
+{
+    if(!bOpened)
+    {
+        return;
+    }
+
+    CLOSESOCKET(handle);
+    handle = INVALID_HANDLE;
+    bOpened = false;
+
+#ifndef KEX_WIN32
+    if(unixPath.Length() > 0)
+    {
+        unlink(unixPath.c_str());
+        unixPath = "";
+    }
+#endif
+}
+
+//
+// kexSocket::SetTimeout
+//
+// Makes Recv give up if nothing arrives for this long
+//
+
+void kexSocket::SetTimeout(const int ms)
+{
+#ifdef KEX_WIN32
+    DWORD timeout = ms;
+#else
+    struct timeval timeout;
+
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+#endif
+
+    setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+//
+// kexSocket::Send
+//
+// Returns false if the other end is gone
+//
+
+bool kexSocket::Send(const void *data, const int length)
+{
+    const char *bytes = (const char*)data;
+    int sent = 0;
+
+    while(sent < length)
+    {
+        int rc = send(handle, bytes + sent, length - sent, SEND_FLAGS);
+
+        if(rc <= 0)
+        {
+#ifndef KEX_WIN32
+            if(rc < 0 && errno == EINTR)
+            {
+                continue;
+            }
+#endif
+            return false;
+        }
+
+        sent += rc;
+    }
+
+    return true;
+}
+
+//
+// kexSocket::Recv
+//
+// Waits for exactly length bytes. Returns false if the other end
+// is gone or the timeout ran out
+//
+
+bool kexSocket::Recv(void *data, const int length)
+{
+    char *bytes = (char*)data;
+    int received = 0;
+
+    while(received < length)
+    {
+        int rc = recv(handle, bytes + received, length - received, 0);
+
+        if(rc <= 0)
+        {
+#ifndef KEX_WIN32
+            if(rc < 0 && errno == EINTR)
+            {
+                continue;
+            }
+#endif
+            return false;
+        }
+
+        received += rc;
+    }
+
+    return true;
+}
+
+//
+// kexSocket::RecvSome
+//
+// Reads whatever has arrived, up to length bytes, which doesn't block
+// once Select said the socket is readable. Returns how many bytes were
+// read, or -1 if the other end is gone
+//
+
+int kexSocket::RecvSome(void *data, const int length)
+{
+    while(1)
+    {
+        int rc = recv(handle, (char*)data, length, 0);
+
+        if(rc > 0)
+        {
+            return rc;
+        }
+
+#ifndef KEX_WIN32
+        if(rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+#endif
+        return -1;
+    }
+}
+
+//
+// kexSocket::Send32
+//
+
+bool kexSocket::Send32(const int val)
+{
+    return Send(&val, sizeof(int));
+}
+
+//
+// kexSocket::Recv32
+//
+
+bool kexSocket::Recv32(int *val)
+{
+    return Recv(val, sizeof(int));
+}
+
+//
+// kexSocket::Select
+//
+// Waits up to ms milliseconds for any of the sockets to have something
+// to read, or for a listening socket to have a connection waiting.
+// Returns how many are ready
+//
+
+int kexSocket::Select(kexSocket **sockets, const int count, bool *bReadable, const int ms)
+{
+    fd_set readSet;
+    struct timeval timeout;
+    socketHandle_t maxHandle = 0;
+    int rc;
+
+    FD_ZERO(&readSet);
+
+    for(int i = 0; i < count; i++)
+    {
+        bReadable[i] = false;
+
+        if(!sockets[i]->Opened())
+        {
+            continue;
+        }
+
+        FD_SET(sockets[i]->handle, &readSet);
+
+        if(sockets[i]->handle > maxHandle)
+        {
+            maxHandle = sockets[i]->handle;
+        }
+    }
+
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+
+    if((rc = select((int)maxHandle + 1, &readSet, NULL, NULL, &timeout)) <= 0)
+    {
+        return 0;
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        if(sockets[i]->Opened() && FD_ISSET(sockets[i]->handle, &readSet))
+        {
+            bReadable[i] = true;
+        }
+    }
+
+    return rc;
+}
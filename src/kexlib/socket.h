@@ -0,0 +1,65 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+
+#ifndef __SOCKET_H__
+#define __SOCKET_H__
+
+#ifdef KEX_WIN32
+#include <winsock2.h>
+typedef SOCKET socketHandle_t;
+#else
+typedef int socketHandle_t;
+#endif
+
+class kexSocket
+{
+public:
+    kexSocket(void);
+    ~kexSocket(void);
+
+    bool                Listen(const char *address);
+    bool                Accept(kexSocket &client);
+    bool                Connect(const char *address);
+    void                Close(void);
+    bool                Send(const void *data, const int length);
+    bool                Recv(void *data, const int length);
+    int                 RecvSome(void *data, const int length);
+    bool                Send32(const int val);
+    bool                Recv32(int *val);
+    void                SetTimeout(const int ms);
+
+    bool                Opened(void) const { return bOpened; }
+    socketHandle_t      Handle(void) const { return handle; }
+
+    static int          Select(kexSocket **sockets, const int count, bool *bReadable, const int ms);
+
+private:
+    bool                Open(const char *address, const bool bListen);
+
+    socketHandle_t      handle;
+    bool                bOpened;
+    kexStr              unixPath;
+};
+
+#endif
@@ -0,0 +1,356 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION: Keeps the results of a previous run around so charts and
+//              grid cells whose inputs hash the same don't have to be
+//              traced again. Everything is keyed off a hash of the map's
+//              geometry and settings first, so any change there throws
+//              the whole cache out
+//
+//-----------------------------------------------------------------------------
+
+#include "common.h"
+#include "lightCache.h"
+
+//
+// kexLightCache::kexLightCache
+//
+
+kexLightCache::kexLightCache(void)
+{
+    this->chartHits     = 0;
+    this->chartMisses   = 0;
+    this->cellHits      = 0;
+    this->cellMisses    = 0;
+    this->mapKey        = 0;
+    this->keys          = NULL;
+    this->offsets       = NULL;
+    this->tableSize     = 0;
+}
+
+//
+// kexLightCache::~kexLightCache
+//
+
+kexLightCache::~kexLightCache(void)
+{
+    delete[] keys;
+    delete[] offsets;
+}
+
+//
+// kexLightCache::Hash
+//
+
+uint64_t kexLightCache::Hash(const void *data, const int size, const uint64_t hash)
+{
+    const byte *bytes = (const byte*)data;
+    uint64_t h = hash;
+
+    for(int i = 0; i < size; i++)
+    {
+        h ^= bytes[i];
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+//
+// kexLightCache::HashVector
+//
+
+uint64_t kexLightCache::HashVector(const kexVec3 &val, const uint64_t hash)
+{
+    uint64_t h = hash;
+
+    h = HashFloat(val.x, h);
+    h = HashFloat(val.y, h);
+    h = HashFloat(val.z, h);
+
+    return h;
+}
+
+//
+// kexLightCache::Lookup
+//
+// Returns where the entry's data starts in the file or -1
+//
+
+int kexLightCache::Lookup(const uint64_t key) const
+{
+    if(tableSize == 0)
+    {
+        return -1;
+    }
+
+    for(int i = (int)(key & (tableSize-1)); keys[i] != 0; i = (i + 1) & (tableSize-1))
+    {
+        if(keys[i] == key)
+        {
+            return offsets[i];
+        }
+    }
+
+    return -1;
+}
+
+//
+// kexLightCache::Insert
+//
+
+void kexLightCache::Insert(const uint64_t key, const int offset)
+{
+    int i;
+
+    for(i = (int)(key & (tableSize-1)); keys[i] != 0; i = (i + 1) & (tableSize-1))
+    {
+        if(keys[i] == key)
+        {
+            return;
+        }
+    }
+
+    keys[i] = key;
+    offsets[i] = offset;
+}
+
+//
+// kexLightCache::Load
+//
+// Reads a cache that was saved for the same map key. A missing, stale
+// or damaged file just leaves the cache empty
+//
+
+bool kexLightCache::Load(const char *fileName, const uint64_t key)
+{
+    int length;
+    int numCharts;
+    int numCells;
+    uint64_t fileKey;
+
+    mapKey = key;
+
+    if(!file.Exists(fileName) || !file.Open(fileName))
+    {
+        return false;
+    }
+
+    length = file.Length();
+
+    if(length < 24 || file.Read32() != LIGHTCACHE_ID || file.Read32() != LIGHTCACHE_VERSION)
+    {
+        file.Close();
+        return false;
+    }
+
+    fileKey = (uint64_t)(uint32_t)file.Read32();
+    fileKey |= (uint64_t)(uint32_t)file.Read32() << 32;
+
+    if(fileKey != mapKey)
+    {
+        file.Close();
+        return false;
+    }
+
+    numCharts = file.Read32();
+    numCells = file.Read32();
+
+    // every chart record is at least a key and a size and every cell
+    // record a key and its color, so counts that can't fit in the file
+    // are damage and would only make a huge table
+    if(numCharts < 0 || numCells < 0 ||
+       (int64_t)numCharts * 12 + (int64_t)numCells * 21 > length - 24)
+    {
+        file.Close();
+        return false;
+    }
+
+    for(tableSize = 1; tableSize < (numCharts + numCells) * 2; tableSize <<= 1);
+
+    keys = new uint64_t[tableSize];
+    offsets = new int[tableSize];
+    memset(keys, 0, sizeof(uint64_t) * tableSize);
+
+    for(int i = 0; i < numCharts + numCells; i++)
+    {
+        uint64_t entryKey;
+        int offset = (int)(file.BufferAt() - file.Buffer());
+        int size = (i < numCharts) ? 4 : 13;
+
+        if(offset + 8 + size > length)
+        {
+            break;
+        }
+
+        entryKey = (uint64_t)(uint32_t)file.Read32();
+        entryKey |= (uint64_t)(uint32_t)file.Read32() << 32;
+
+        if(i < numCharts)
+        {
+            size = file.Read32();
+
+            if(size < 0 || offset + 12 + size > length)
+            {
+                break;
+            }
+
+            file.SetOffset(offset + 12 + size);
+        }
+        else
+        {
+            file.SetOffset(offset + 8 + size);
+        }
+
+        Insert(entryKey, offset + 8);
+    }
+
+    return true;
+}
+
+//
+// kexLightCache::Save
+//
+// Only what was used or traced this time is written out, so entries
+// for charts and cells that no longer exist are dropped
+//
+
+bool kexLightCache::Save(const char *fileName)
+{
+    kexBinFile saveFile;
+    kexStr tempName = kexStr(fileName) + ".tmp";
+
+    if(!saveFile.Create(tempName))
+    {
+        return false;
+    }
+
+    saveFile.Write32(LIGHTCACHE_ID);
+    saveFile.Write32(LIGHTCACHE_VERSION);
+    saveFile.Write32((int)(mapKey & 0xFFFFFFFF));
+    saveFile.Write32((int)(mapKey >> 32));
+    saveFile.Write32(newCharts.Length());
+    saveFile.Write32(newCells.Length());
+
+    for(unsigned int i = 0; i < newCharts.Length(); i++)
+    {
+        saveFile.Write32((int)(newCharts[i].key & 0xFFFFFFFF));
+        saveFile.Write32((int)(newCharts[i].key >> 32));
+        saveFile.Write32(newCharts[i].size);
+
+        if(newCharts[i].size > 0)
+        {
+            saveFile.WriteBytes(newCharts[i].texels, newCharts[i].size);
+        }
+    }
+
+    for(unsigned int i = 0; i < newCells.Length(); i++)
+    {
+        saveFile.Write32((int)(newCells[i].key & 0xFFFFFFFF));
+        saveFile.Write32((int)(newCells[i].key >> 32));
+        saveFile.Write8(newCells[i].sunShadow);
+        saveFile.WriteVector(newCells[i].color);
+    }
+
+    saveFile.Close();
+
+#ifdef KEX_WIN32
+    remove(fileName);
+#endif
+
+    return rename(tempName, fileName) == 0;
+}
+
+//
+// kexLightCache::FindChart
+//
+// Returns the saved texels of the chart, or NULL if it isn't cached.
+// A size of zero means the chart came out completely black
+//
+
+const byte *kexLightCache::FindChart(const uint64_t key, int *size) const
+{
+    int offset = Lookup(key);
+
+    if(offset == -1)
+    {
+        return NULL;
+    }
+
+    memcpy(size, &file.Buffer()[offset], sizeof(int));
+    return &file.Buffer()[offset + 4];
+}
+
+//
+// kexLightCache::FindCell
+//
+
+bool kexLightCache::FindCell(const uint64_t key, kexVec3 &color, byte *sunShadow) const
+{
+    int offset = Lookup(key);
+
+    if(offset == -1)
+    {
+        return false;
+    }
+
+    *sunShadow = file.Buffer()[offset];
+    memcpy(&color.x, &file.Buffer()[offset + 1], sizeof(float));
+    memcpy(&color.y, &file.Buffer()[offset + 5], sizeof(float));
+    memcpy(&color.z, &file.Buffer()[offset + 9], sizeof(float));
+    return true;
+}
+
+//
+// kexLightCache::AddChart
+//
+// The texels aren't copied, so they have to stay around until Save
+//
+
+void kexLightCache::AddChart(const uint64_t key, const byte *texels, const int size)
+{
+    cacheChart_t chart;
+
+    chart.key = key;
+    chart.texels = texels;
+    chart.size = size;
+
+    newCharts.Push(chart);
+}
+
+//
+// kexLightCache::AddCell
+//
+
+void kexLightCache::AddCell(const uint64_t key, const kexVec3 &color, const byte sunShadow)
+{
+    cacheCell_t cell;
+
+    cell.key = key;
+    cell.color = color;
+    cell.sunShadow = sunShadow;
+
+    newCells.Push(cell);
+}
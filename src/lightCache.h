@@ -0,0 +1,89 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+
+
+#ifndef __LIGHTCACHE_H__
+#define __LIGHTCACHE_H__
+
+#include "kexlib/binFile.h"
+
+#define LIGHTCACHE_ID           (('H' << 24) | ('C' << 16) | ('M' << 8) | 'L')
+#define LIGHTCACHE_VERSION      1
+
+// 64-bit FNV-1a
+#define FNV_OFFSET_BASIS        14695981039346656037ULL
+#define FNV_PRIME               1099511628211ULL
+
+class kexLightCache
+{
+public:
+    kexLightCache(void);
+    ~kexLightCache(void);
+
+    static uint64_t         Hash(const void *data, const int size, const uint64_t hash = FNV_OFFSET_BASIS);
+    static uint64_t         HashInt(const int val, const uint64_t hash) { return Hash(&val, sizeof(int), hash); }
+    static uint64_t         HashFloat(const float val, const uint64_t hash) { return Hash(&val, sizeof(float), hash); }
+    static uint64_t         HashVector(const kexVec3 &val, const uint64_t hash);
+
+    bool                    Load(const char *fileName, const uint64_t key);
+    bool                    Save(const char *fileName);
+
+    const byte              *FindChart(const uint64_t key, int *size) const;
+    bool                    FindCell(const uint64_t key, kexVec3 &color, byte *sunShadow) const;
+    void                    AddChart(const uint64_t key, const byte *texels, const int size);
+    void                    AddCell(const uint64_t key, const kexVec3 &color, const byte sunShadow);
+
+    int                     chartHits;
+    int                     chartMisses;
+    int                     cellHits;
+    int                     cellMisses;
+
+private:
+    typedef struct
+    {
+        uint64_t            key;
+        const byte          *texels;
+        int                 size;
+    } cacheChart_t;
+
+    typedef struct
+    {
+        uint64_t            key;
+        kexVec3             color;
+        byte                sunShadow;
+    } cacheCell_t;
+
+    int                     Lookup(const uint64_t key) const;
+    void                    Insert(const uint64_t key, const int offset);
+
+    kexBinFile              file;
+    uint64_t                mapKey;
+    uint64_t                *keys;
+    int                     *offsets;
+    int                     tableSize;
+    kexArray<cacheChart_t>  newCharts;
+    kexArray<cacheCell_t>   newCells;
+};
+
+#endif
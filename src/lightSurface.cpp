@@ -284,29 +284,49 @@ void kexLightSurface::Subdivide(const float divide)
 //
 // kexLightSurface::TraceSurface
 //
+// Routes to the kernel for this type of light surface. Callers that already
+// know what type of light surfaces they're dealing with can call the
+// kernel directly
+//
 
 bool kexLightSurface::TraceSurface(kexDoomMap *doomMap, kexTrace &trace, const surface_t *surf,
                                    const kexVec3 &origin, float *dist)
 {
-    kexVec3 normal;
-    kexVec3 lnormal;
-    kexVec3 center;
-    bool bInside;
-    float angle;
-    float curDist;
+    if(bWall)
+    {
+        return TraceSurfaceKernel<true>(doomMap, trace, surf, origin, dist);
+    }
 
-    *dist = -M_INFINITY;
+    return TraceSurfaceKernel<false>(doomMap, trace, surf, origin, dist);
+}
 
-    // light surface will always be fullbright
-    if(surf == surface)
+//
+// kexLightSurface::MaxOriginHeight
+//
+
+float kexLightSurface::MaxOriginHeight(void) const
+{
+    float height = -M_INFINITY;
+
+    for(unsigned int i = 0; i < origins.Length(); ++i)
     {
-        *dist = 1;
-        return true;
+        if(origins.IndexOf(i).z > height)
+        {
+            height = origins.IndexOf(i).z;
+        }
     }
 
-    bInside = false;
+    return height;
+}
 
-    // nudge the origin around to see if it's actually in the subsector
+//
+// kexLightSurface::IsInsideSubSector
+//
+// Nudges the origin around to see if it's actually in the subsector
+//
+
+bool kexLightSurface::IsInsideSubSector(kexDoomMap *doomMap, const kexVec3 &origin)
+{
     float nudges[4] = { -2, 2, -4, 4 };
 
     for(int x = 0; x < 4; x++)
@@ -316,17 +336,41 @@ bool kexLightSurface::TraceSurface(kexDoomMap *doomMap, kexTrace &trace, const s
             if(doomMap->PointInsideSubSector(origin.x + nudges[x],
                                              origin.y + nudges[y], surface->subSector))
             {
-                bInside = true;
-                break;
+                return true;
             }
         }
+    }
 
-        if(bInside)
-        {
-            break;
-        }
+    return false;
+}
+
+//
+// kexLightSurface::TraceSurfaceKernel
+//
+
+template<bool bWallLight>
+bool kexLightSurface::TraceSurfaceKernel(kexDoomMap *doomMap, kexTrace &trace, const surface_t *surf,
+        const kexVec3 &origin, float *dist)
+{
+    kexVec3 normal;
+    kexVec3 lnormal;
+    kexVec3 center;
+    int inside;
+    float angle;
+    float curDist;
+
+    *dist = -M_INFINITY;
+
+    // light surface will always be fullbright
+    if(surf == surface)
+    {
+        *dist = 1;
+        return true;
     }
 
+    // only looked up when a sample point falls outside of the cone
+    inside = -1;
+
     lnormal = surface->plane.Normal();
 
     if(surf)
@@ -350,7 +394,7 @@ bool kexLightSurface::TraceSurface(kexDoomMap *doomMap, kexTrace &trace, const s
     {
         center = origins[i];
 
-        if(!bWall && origin.z > center.z)
+        if(!bWallLight && origin.z > center.z)
         {
             // origin is not going to seen or traced by the light surface
             // so don't even bother. this also fixes some bizzare light
@@ -358,7 +402,7 @@ bool kexLightSurface::TraceSurface(kexDoomMap *doomMap, kexTrace &trace, const s
             continue;
         }
 
-        if(bWall)
+        if(bWallLight)
         {
             angle = (origin - center).ToVec2().Normalize().Dot(lnormal.ToVec2());
         }
@@ -383,13 +427,21 @@ bool kexLightSurface::TraceSurface(kexDoomMap *doomMap, kexTrace &trace, const s
             }
         }
 
-        if(!bInside && angle < outerCone)
+        if(angle < outerCone)
         {
-            // out of the cone range
-            continue;
+            if(inside == -1)
+            {
+                inside = IsInsideSubSector(doomMap, origin);
+            }
+
+            if(!inside)
+            {
+                // out of the cone range
+                continue;
+            }
         }
 
-        if(bWall)
+        if(bWallLight)
         {
             if(origin.z >= surface->verts[0].z && origin.z <= surface->verts[2].z)
             {
@@ -429,7 +481,7 @@ bool kexLightSurface::TraceSurface(kexDoomMap *doomMap, kexTrace &trace, const s
 
             // might get large unlit gaps near the surface. this looks a lot worse for
             // non-wall light surfaces so just clamp to full bright and exit out.
-            if(!bWall)
+            if(!bWallLight)
             {
                 *dist = 1;
                 return true;
@@ -459,3 +511,8 @@ bool kexLightSurface::TraceSurface(kexDoomMap *doomMap, kexTrace &trace, const s
 
     return *dist > 0;
 }
+
+template bool kexLightSurface::TraceSurfaceKernel<true>(kexDoomMap*, kexTrace&, const surface_t*,
+        const kexVec3&, float*);
+template bool kexLightSurface::TraceSurfaceKernel<false>(kexDoomMap*, kexTrace&, const surface_t*,
+        const kexVec3&, float*);
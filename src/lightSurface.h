@@ -54,9 +54,14 @@ public:
                                  const bool bWall, const bool bNoCenterPoint);
     void                    Subdivide(const float divide);
     void                    CreateCenterOrigin(void);
+    float                   MaxOriginHeight(void) const;
     bool                    TraceSurface(kexDoomMap *doomMap, kexTrace &trace, const surface_t *surface,
                                          const kexVec3 &origin, float *dist);
 
+    template<bool bWallLight>
+    bool                    TraceSurfaceKernel(kexDoomMap *doomMap, kexTrace &trace, const surface_t *surface,
+                                               const kexVec3 &origin, float *dist);
+
     const float             OuterCone(void) const { return outerCone; }
     const float             InnerCone(void) const { return innerCone; }
     const float             FallOff(void) const { return falloff; }
@@ -69,6 +74,7 @@ public:
     const vertexBatch_t     Origins(void) const { return origins; }
 
 private:
+    bool                    IsInsideSubSector(kexDoomMap *doomMap, const kexVec3 &origin);
     bool                    SubdivideRecursion(vertexBatch_t &surfPoints, float divide,
             kexArray<vertexBatch_t*> &points);
     void                    Clip(vertexBatch_t &points, const kexVec3 &normal, float dist,
@@ -0,0 +1,514 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION: Structure of arrays for thing lights. Keeping the origins
+//              and ranges in flat arrays lets a group of lights be culled
+//              against a texel in one pass, leaving only the survivors
+//              to be traced
+//
+//-----------------------------------------------------------------------------
+
+#include "common.h"
+#include "mapData.h"
+#include "lightTable.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIGHT_TABLE_SSE
+#endif
+
+//
+// kexLightTable::kexLightTable
+//
+
+kexLightTable::kexLightTable(void)
+{
+    this->numLights         = 0;
+    this->maxLights         = 0;
+    this->originX           = NULL;
+    this->originY           = NULL;
+    this->originZ           = NULL;
+    this->cellZ             = NULL;
+    this->radiusSq          = NULL;
+    this->lights            = NULL;
+    this->bFalloff          = false;
+    this->numSurfaceLights  = 0;
+    this->numWallLights     = 0;
+    this->surfaceLights     = NULL;
+}
+
+//
+// kexLightTable::~kexLightTable
+//
+
+kexLightTable::~kexLightTable(void)
+{
+    Clear();
+}
+
+//
+// kexLightTable::Clear
+//
+
+void kexLightTable::Clear(void)
+{
+    // tables are built from inside the worker threads, so stay off
+    // of the zone heap and use the regular allocator
+    delete[] originX;
+    delete[] originY;
+    delete[] originZ;
+    delete[] cellZ;
+    delete[] radiusSq;
+    delete[] lights;
+    delete[] surfaceLights;
+
+    originX         = NULL;
+    originY         = NULL;
+    originZ         = NULL;
+    cellZ           = NULL;
+    radiusSq        = NULL;
+    lights          = NULL;
+    surfaceLights   = NULL;
+
+    numLights           = 0;
+    maxLights           = 0;
+    numSurfaceLights    = 0;
+    numWallLights       = 0;
+    bFalloff            = false;
+}
+
+//
+// kexLightTable::Allocate
+//
+
+void kexLightTable::Allocate(const int count, const int surfaceCount)
+{
+    Clear();
+
+    // round up to the next full batch
+    maxLights = ((count + (LIGHT_BATCH_SIZE-1)) / LIGHT_BATCH_SIZE) * LIGHT_BATCH_SIZE;
+
+    if(maxLights == 0)
+    {
+        maxLights = LIGHT_BATCH_SIZE;
+    }
+
+    originX     = new float[maxLights];
+    originY     = new float[maxLights];
+    originZ     = new float[maxLights];
+    cellZ       = new float[maxLights];
+    radiusSq    = new float[maxLights];
+    lights      = new thingLight_t*[maxLights];
+
+    // padding entries have a negative range so they always fail
+    for(int i = 0; i < maxLights; ++i)
+    {
+        originX[i]  = 0;
+        originY[i]  = 0;
+        originZ[i]  = 0;
+        cellZ[i]    = 0;
+        radiusSq[i] = -1;
+        lights[i]   = NULL;
+    }
+
+    if(surfaceCount > 0)
+    {
+        surfaceLights = new kexLightSurface*[surfaceCount];
+    }
+}
+
+//
+// kexLightTable::AddLight
+//
+
+void kexLightTable::AddLight(thingLight_t *light, const float x, const float y,
+                             const float z, const float cz)
+{
+    assert(numLights < maxLights);
+
+    originX[numLights]  = x;
+    originY[numLights]  = y;
+    originZ[numLights]  = z;
+    cellZ[numLights]    = cz;
+    radiusSq[numLights] = light->radius * light->radius;
+    lights[numLights]   = light;
+
+    if(light->falloff != 1)
+    {
+        bFalloff = true;
+    }
+
+    numLights++;
+}
+
+//
+// kexLightTable::AddSurfaceLight
+//
+
+void kexLightTable::AddSurfaceLight(kexLightSurface *surfaceLight)
+{
+    surfaceLights[numSurfaceLights++] = surfaceLight;
+
+    if(surfaceLight->IsAWall())
+    {
+        numWallLights++;
+    }
+}
+
+//
+// kexLightTable::Origin
+//
+
+const kexVec3 kexLightTable::Origin(const int index) const
+{
+    return kexVec3(originX[index], originY[index], originZ[index]);
+}
+
+//
+// kexLightTable::CellOrigin
+//
+
+const kexVec3 kexLightTable::CellOrigin(const int index) const
+{
+    return kexVec3(originX[index], originY[index], cellZ[index]);
+}
+
+//
+// kexLightTable::Build
+//
+// Flattens all thing lights and light surfaces in the map. The
+// origins are resolved here so the sector heights don't need
+// to be looked up for every texel
+//
+
+void kexLightTable::Build(kexDoomMap &doomMap)
+{
+    Allocate(doomMap.thingLights.Length(), doomMap.lightSurfaces.Length());
+
+    for(unsigned int i = 0; i < doomMap.thingLights.Length(); ++i)
+    {
+        thingLight_t *tl = doomMap.thingLights[i];
+
+        AddLight(tl, tl->origin.x, tl->origin.y,
+                 !tl->bCeiling ?
+                 tl->sector->floorheight + tl->height :
+                 tl->sector->ceilingheight - tl->height,
+                 !tl->bCeiling ?
+                 (float)tl->sector->floorheight + 16 :
+                 (float)tl->sector->ceilingheight - 16);
+    }
+
+    for(unsigned int i = 0; i < doomMap.lightSurfaces.Length(); ++i)
+    {
+        AddSurfaceLight(doomMap.lightSurfaces[i]);
+    }
+
+    printf("Light table: %i thing lights, %i light surfaces\n\n", numLights, numSurfaceLights);
+}
+
+//
+// kexLightTable::BuildFromSurface
+//
+// Copies lights from the map's table that could possibly reach any texel on
+// the surface. Everything tested here is constant across the whole surface, so
+// the per-texel pass is left with only the range and facing tests
+//
+
+void kexLightTable::BuildFromSurface(const kexLightTable &table, kexDoomMap &doomMap,
+                                     const surface_t *surface, const kexBBox &texelBounds,
+                                     const bool bUseReject)
+{
+    kexPlane plane = surface->plane;
+    kexVec3 lightOrigin;
+    kexVec3 closest;
+    mapSector_t *sector;
+
+    Allocate(table.numLights, table.numSurfaceLights);
+
+    sector = doomMap.GetSectorFromSubSector(surface->subSector);
+
+    for(int i = 0; i < table.numLights; ++i)
+    {
+        thingLight_t *tl = table.lights[i];
+
+        // try to early out if PVS data exists
+        if(!doomMap.CheckPVS(surface->subSector, tl->ssect))
+        {
+            continue;
+        }
+
+        if(bUseReject && !doomMap.CheckReject(sector, tl->sector))
+        {
+            continue;
+        }
+
+        lightOrigin = table.Origin(i);
+
+        if(plane.Distance(lightOrigin) - plane.d < 0)
+        {
+            // completely behind the plane
+            continue;
+        }
+
+        // find the closest point on the texel bounds to the light
+        for(int j = 0; j < 3; ++j)
+        {
+            closest[j] = lightOrigin[j];
+            kexMath::Clamp(closest[j], texelBounds.min[j], texelBounds.max[j]);
+        }
+
+        if(closest.DistanceSq(lightOrigin) > table.radiusSq[i])
+        {
+            // no texel can be within range
+            continue;
+        }
+
+        AddLight(tl, table.originX[i], table.originY[i], table.originZ[i], table.cellZ[i]);
+    }
+
+    for(int i = 0; i < table.numSurfaceLights; ++i)
+    {
+        kexLightSurface *surfaceLight = table.surfaceLights[i];
+
+        if(surfaceLight->Surface() == surface)
+        {
+            // always fullbright
+            AddSurfaceLight(surfaceLight);
+            continue;
+        }
+
+        if(!doomMap.CheckPVS(surface->subSector, surfaceLight->Surface()->subSector))
+        {
+            continue;
+        }
+
+        if(bUseReject && !doomMap.CheckReject(sector,
+                doomMap.GetSectorFromSubSector(surfaceLight->Surface()->subSector)))
+        {
+            continue;
+        }
+
+        if(surface->plane.Normal().Dot(surfaceLight->Surface()->plane.Normal()) > 0)
+        {
+            // not facing the light surface
+            continue;
+        }
+
+        if(!surfaceLight->IsAWall() && texelBounds.min.z > surfaceLight->MaxOriginHeight())
+        {
+            // flat light surfaces don't emit to anything above their sample points
+            continue;
+        }
+
+        AddSurfaceLight(surfaceLight);
+    }
+}
+
+//
+// kexLightTable::CullPoint
+//
+// Tests every light against a point on a surface. A light survives if the point
+// is within its radius and is on the front side of the surface, otherwise it
+// would not add anything to the texel. Survivors are written out in table order
+//
+
+int kexLightTable::CullPoint(const kexVec3 &origin, const kexVec3 &normal, int *survivors) const
+{
+    int count = 0;
+
+#if defined(__AVX__)
+    const __m256 px = _mm256_set1_ps(origin.x);
+    const __m256 py = _mm256_set1_ps(origin.y);
+    const __m256 pz = _mm256_set1_ps(origin.z);
+    const __m256 nx = _mm256_set1_ps(normal.x);
+    const __m256 ny = _mm256_set1_ps(normal.y);
+    const __m256 nz = _mm256_set1_ps(normal.z);
+    const __m256 zero = _mm256_setzero_ps();
+
+    for(int i = 0; i < numLights; i += LIGHT_BATCH_SIZE)
+    {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&originX[i]), px);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&originY[i]), py);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&originZ[i]), pz);
+
+        __m256 distSq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                                    _mm256_mul_ps(dy, dy)),
+                                      _mm256_mul_ps(dz, dz));
+        __m256 facing = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, nx),
+                                                    _mm256_mul_ps(dy, ny)),
+                                      _mm256_mul_ps(dz, nz));
+
+        __m256 inRange = _mm256_cmp_ps(distSq, _mm256_loadu_ps(&radiusSq[i]), _CMP_LE_OQ);
+        __m256 inFront = _mm256_cmp_ps(facing, zero, _CMP_GT_OQ);
+
+        int mask = _mm256_movemask_ps(_mm256_and_ps(inRange, inFront));
+
+        for(int bit = 0; mask; ++bit, mask >>= 1)
+        {
+            if(mask & 1)
+            {
+                survivors[count++] = i + bit;
+            }
+        }
+    }
+#elif defined(LIGHT_TABLE_SSE)
+    const __m128 px = _mm_set1_ps(origin.x);
+    const __m128 py = _mm_set1_ps(origin.y);
+    const __m128 pz = _mm_set1_ps(origin.z);
+    const __m128 nx = _mm_set1_ps(normal.x);
+    const __m128 ny = _mm_set1_ps(normal.y);
+    const __m128 nz = _mm_set1_ps(normal.z);
+    const __m128 zero = _mm_setzero_ps();
+
+    for(int i = 0; i < numLights; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&originX[i]), px);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&originY[i]), py);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(&originZ[i]), pz);
+
+        __m128 distSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                                   _mm_mul_ps(dz, dz));
+        __m128 facing = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, nx), _mm_mul_ps(dy, ny)),
+                                   _mm_mul_ps(dz, nz));
+
+        __m128 inRange = _mm_cmple_ps(distSq, _mm_loadu_ps(&radiusSq[i]));
+        __m128 inFront = _mm_cmpgt_ps(facing, zero);
+
+        int mask = _mm_movemask_ps(_mm_and_ps(inRange, inFront));
+
+        for(int bit = 0; mask; ++bit, mask >>= 1)
+        {
+            if(mask & 1)
+            {
+                survivors[count++] = i + bit;
+            }
+        }
+    }
+#else
+    for(int i = 0; i < numLights; ++i)
+    {
+        float dx = originX[i] - origin.x;
+        float dy = originY[i] - origin.y;
+        float dz = originZ[i] - origin.z;
+
+        if(dx * dx + dy * dy + dz * dz > radiusSq[i])
+        {
+            continue;
+        }
+
+        if(dx * normal.x + dy * normal.y + dz * normal.z <= 0)
+        {
+            continue;
+        }
+
+        survivors[count++] = i;
+    }
+#endif
+
+    return count;
+}
+
+//
+// kexLightTable::CullCell
+//
+// Same as CullPoint but for light grid cells, which have no surface to face
+// and sample the lights at a fixed height
+//
+
+int kexLightTable::CullCell(const kexVec3 &origin, int *survivors) const
+{
+    int count = 0;
+
+#if defined(__AVX__)
+    const __m256 px = _mm256_set1_ps(origin.x);
+    const __m256 py = _mm256_set1_ps(origin.y);
+    const __m256 pz = _mm256_set1_ps(origin.z);
+
+    for(int i = 0; i < numLights; i += LIGHT_BATCH_SIZE)
+    {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&originX[i]), px);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&originY[i]), py);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&cellZ[i]), pz);
+
+        __m256 distSq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                                    _mm256_mul_ps(dy, dy)),
+                                      _mm256_mul_ps(dz, dz));
+
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(distSq,
+                                      _mm256_loadu_ps(&radiusSq[i]), _CMP_LE_OQ));
+
+        for(int bit = 0; mask; ++bit, mask >>= 1)
+        {
+            if(mask & 1)
+            {
+                survivors[count++] = i + bit;
+            }
+        }
+    }
+#elif defined(LIGHT_TABLE_SSE)
+    const __m128 px = _mm_set1_ps(origin.x);
+    const __m128 py = _mm_set1_ps(origin.y);
+    const __m128 pz = _mm_set1_ps(origin.z);
+
+    for(int i = 0; i < numLights; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&originX[i]), px);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&originY[i]), py);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(&cellZ[i]), pz);
+
+        __m128 distSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                                   _mm_mul_ps(dz, dz));
+
+        int mask = _mm_movemask_ps(_mm_cmple_ps(distSq, _mm_loadu_ps(&radiusSq[i])));
+
+        for(int bit = 0; mask; ++bit, mask >>= 1)
+        {
+            if(mask & 1)
+            {
+                survivors[count++] = i + bit;
+            }
+        }
+    }
+#else
+    for(int i = 0; i < numLights; ++i)
+    {
+        float dx = originX[i] - origin.x;
+        float dy = originY[i] - origin.y;
+        float dz = cellZ[i] - origin.z;
+
+        if(dx * dx + dy * dy + dz * dz > radiusSq[i])
+        {
+            continue;
+        }
+
+        survivors[count++] = i;
+    }
+#endif
+
+    return count;
+}
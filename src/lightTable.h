@@ -0,0 +1,83 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must not be
+//   misrepresented as being the original software.
+//
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+//
+
+
+#ifndef __LIGHT_TABLE_H__
+#define __LIGHT_TABLE_H__
+
+#include "mapData.h"
+
+// lights are tested in groups of this size. the arrays are always
+// padded out to a multiple of this so the last group can be loaded
+// without going past the end
+#define LIGHT_BATCH_SIZE    8
+
+class kexLightTable
+{
+public:
+    kexLightTable(void);
+    ~kexLightTable(void);
+
+    void                    Build(kexDoomMap &doomMap);
+    void                    BuildFromSurface(const kexLightTable &table, kexDoomMap &doomMap,
+                                             const surface_t *surface, const kexBBox &texelBounds,
+                                             const bool bUseReject);
+    int                     CullPoint(const kexVec3 &origin, const kexVec3 &normal, int *survivors) const;
+    int                     CullCell(const kexVec3 &origin, int *survivors) const;
+    void                    Clear(void);
+
+    const int               NumLights(void) const { return numLights; }
+    thingLight_t            *Light(const int index) const { return lights[index]; }
+    const kexVec3           Origin(const int index) const;
+    const kexVec3           CellOrigin(const int index) const;
+
+    const int               NumSurfaceLights(void) const { return numSurfaceLights; }
+    kexLightSurface         *SurfaceLight(const int index) const { return surfaceLights[index]; }
+    const int               NumWallLights(void) const { return numWallLights; }
+    const int               NumFlatLights(void) const { return numSurfaceLights - numWallLights; }
+    const bool              HasFalloff(void) const { return bFalloff; }
+
+private:
+    void                    Allocate(const int count, const int surfaceCount);
+    void                    AddLight(thingLight_t *light, const float x, const float y,
+                                     const float z, const float cz);
+    void                    AddSurfaceLight(kexLightSurface *surfaceLight);
+
+    int                     numLights;
+    int                     maxLights;
+    float                   *originX;
+    float                   *originY;
+    float                   *originZ;
+    float                   *cellZ;
+    float                   *radiusSq;
+    thingLight_t            **lights;
+
+    bool                    bFalloff;
+
+    int                     numSurfaceLights;
+    int                     numWallLights;
+    kexLightSurface         **surfaceLights;
+};
+
+#endif
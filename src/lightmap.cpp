@@ -33,12 +33,39 @@
 #include "mapData.h"
 #include "lightmap.h"
 #include "worker.h"
+#include "compress.h"
+#include "lightCache.h"
+#include "distribute.h"
+#include "checkpoint.h"
 #include "kexlib/binFile.h"
 
 //#define EXPORT_TEXELS_OBJ
 
+// spacing between the interior texels that are probed when
+// classifying a surface's exposure to the sun
+#define SUN_PROBE_STRIDE    4
+
+// how far a coarse texel can stray from its neighbors before
+// the chart is moved up to the next finer density
+#define ADAPTIVE_GRADIENT_STEP  0.0625f
+
+// blocks whose channels vary by no more than this are
+// stored as one shared block of their average color
+#define UNIFORM_TOLERANCE       2
+#define UNIFORM_BLOCK_SIZE      2
+#define UNIFORM_HASH_SIZE       256
+
+// marks a LM_LMAPS lump that holds BC1 compressed textures
+#define LMAPS_BC1_ID            (('C' << 24) | ('B' << 16) | ('M' << 8) | 'L')
+
+// marks a LM_SURFS lump that starts with a version header
+#define LMSURFS_ID              (('R' << 24) | ('S' << 16) | ('M' << 8) | 'L')
+
 kexWorker lightmapWorker;
 
+// the charts, textures and grid of the builder that is lighting a map
+kexHeapBlock hb_lightmap("lightmap", false, NULL, NULL);
+
 const kexVec3 kexLightmapBuilder::gridSize(64, 64, 128);
 
 //
@@ -48,7 +75,37 @@ const kexVec3 kexLightmapBuilder::gridSize(64, 64, 128);
 static void LightmapWorkerFunc(void *data, int id)
 {
     kexLightmapBuilder *builder = static_cast<kexLightmapBuilder*>(data);
-    builder->LightSurface(id);
+    builder->LightChart(id);
+}
+
+//
+// LightmapDensityWorkerFunc
+//
+
+static void LightmapDensityWorkerFunc(void *data, int id)
+{
+    kexLightmapBuilder *builder = static_cast<kexLightmapBuilder*>(data);
+    builder->MeasureChart(id);
+}
+
+//
+// LightmapCompressWorkerFunc
+//
+
+static void LightmapCompressWorkerFunc(void *data, int id)
+{
+    kexLightmapBuilder *builder = static_cast<kexLightmapBuilder*>(data);
+    builder->CompressTexture(id);
+}
+
+//
+// LightmapPassWorkerFunc
+//
+
+static void LightmapPassWorkerFunc(void *data, int id)
+{
+    kexLightmapBuilder *builder = static_cast<kexLightmapBuilder*>(data);
+    builder->LightJob(id);
 }
 
 //
@@ -61,6 +118,26 @@ static void LightGridWorkerFunc(void *data, int id)
     builder->LightGrid(id);
 }
 
+//
+// LightmapJobWorkerFunc
+//
+
+static void LightmapJobWorkerFunc(void *data, int id)
+{
+    kexLightmapBuilder *builder = static_cast<kexLightmapBuilder*>(data);
+    builder->LightChart(builder->JobFirst() + id);
+}
+
+//
+// LightGridJobWorkerFunc
+//
+
+static void LightGridJobWorkerFunc(void *data, int id)
+{
+    kexLightmapBuilder *builder = static_cast<kexLightmapBuilder*>(data);
+    builder->LightGrid(builder->JobFirst() + id);
+}
+
 //
 // kexLightmapBuilder::kexLightmapBuilder
 //
@@ -70,12 +147,50 @@ kexLightmapBuilder::kexLightmapBuilder(void)
     this->textureWidth  = 128;
     this->textureHeight = 128;
     this->allocBlocks   = NULL;
+    this->bAutoTextureSize = false;
+    this->bCompressTextures = false;
+    this->lumpVersion   = 1;
+    this->bQuantizeUV   = false;
+    this->compressionError = 0;
+    this->maxTextures   = 0;
     this->numTextures   = 0;
     this->samples       = 16;
+    this->minSamples    = 0;
+    this->maxSamples    = 0;
     this->extraSamples  = 2;
     this->ambience      = 0.0f;
     this->tracedTexels  = 0;
+    this->sunlitTexels  = 0;
+    this->bUseReject    = false;
+    this->bSunClassify  = false;
+    this->bGridFromTexels = false;
+    this->gridTexels    = NULL;
+    this->numGatheredCells = 0;
+    memset(this->cellSurvivors, 0, sizeof(this->cellSurvivors));
+    this->numSunClassified = 0;
+    this->numUnlitSurfaces = 0;
+    this->charts        = NULL;
+    this->numCharts     = 0;
+    this->numChartsDone = 0;
+    this->numCellsDone  = 0;
+    this->jobFirst      = 0;
     this->gridMap       = NULL;
+    this->cellKernelFlags = 0;
+    this->cache         = NULL;
+    this->cacheSurfaceLightsKey = 0;
+    this->checkpoint    = NULL;
+    this->chartsResumed = NULL;
+    this->cellsResumed  = NULL;
+    this->jobOrder      = NULL;
+    this->chartsLit     = NULL;
+    this->numCellsLit   = 0;
+    this->uniformHash   = NULL;
+    this->numUniformCharts = 0;
+    this->numChartsPacked = 0;
+    this->bPacking = false;
+    this->bPackWhileTracing = false;
+    this->gridLump      = NULL;
+    this->gridLumpSize  = 0;
 }
 
 //
@@ -84,25 +199,62 @@ kexLightmapBuilder::kexLightmapBuilder(void)
 
 kexLightmapBuilder::~kexLightmapBuilder(void)
 {
+    Mem_Purge(hb_lightmap);
+}
+
+//
+// kexLightmapBuilder::CopySettings
+//
+// Copies the options that were given on the command line
+//
+
+void kexLightmapBuilder::CopySettings(const kexLightmapBuilder &builder)
+{
+    textureWidth        = builder.textureWidth;
+    textureHeight       = builder.textureHeight;
+    bAutoTextureSize    = builder.bAutoTextureSize;
+    maxTextures         = builder.maxTextures;
+    bCompressTextures   = builder.bCompressTextures;
+    lumpVersion         = builder.lumpVersion;
+    bQuantizeUV         = builder.bQuantizeUV;
+    samples             = builder.samples;
+    minSamples          = builder.minSamples;
+    maxSamples          = builder.maxSamples;
+    ambience            = builder.ambience;
+    bUseReject          = builder.bUseReject;
+    bSunClassify        = builder.bSunClassify;
+    bGridFromTexels     = builder.bGridFromTexels;
+    coordinatorAddress  = builder.coordinatorAddress;
+    workerAddress       = builder.workerAddress;
 }
 
 //
 // kexLightmapBuilder::NewTexture
 //
-// Allocates a new texture pointer
+// Allocates a new texture pointer. Takes the worker mutex since
+// the heap isn't thread safe and PackLitCharts runs alongside
+// the tracing threads. A dry run only needs the rows that
+// track where blocks go, so it skips the pixels
 //
 
-void kexLightmapBuilder::NewTexture(void)
+void kexLightmapBuilder::NewTexture(const bool bDryRun)
 {
+    lightmapWorker.LockMutex();
+
     numTextures++;
 
-    allocBlocks = (int**)Mem_Realloc(allocBlocks, sizeof(int*) * numTextures, hb_static);
-    allocBlocks[numTextures-1] = (int*)Mem_Calloc(sizeof(int) * textureWidth, hb_static);
+    allocBlocks = (int**)Mem_Realloc(allocBlocks, sizeof(int*) * numTextures, hb_lightmap);
+    allocBlocks[numTextures-1] = (int*)Mem_Calloc(sizeof(int) * textureWidth, hb_lightmap);
 
     memset(allocBlocks[numTextures-1], 0, sizeof(int) * textureWidth);
 
-    byte *texture = (byte*)Mem_Calloc((textureWidth * textureHeight) * 3, hb_static);
-    textures.Push(texture);
+    if(!bDryRun)
+    {
+        byte *texture = (byte*)Mem_Calloc((textureWidth * textureHeight) * 3, hb_lightmap);
+        textures.Push(texture);
+    }
+
+    lightmapWorker.UnlockMutex();
 }
 
 //
@@ -244,6 +396,30 @@ bool kexLightmapBuilder::EmitFromCeiling(kexTrace &trace, const surface_t *surfa
     return true;
 }
 
+//
+// TraceLightSurface
+//
+// Picks the light surface kernel at compile time unless the
+// kernel is dealing with both wall and flat light surfaces
+//
+
+template<int kernelFlags>
+static d_inline bool TraceLightSurface(kexLightSurface *surfaceLight, kexDoomMap *map, kexTrace &trace,
+                                       const surface_t *surface, const kexVec3 &origin, float *dist)
+{
+    if((kernelFlags & LK_WALLLIGHTS) && (kernelFlags & LK_FLATLIGHTS))
+    {
+        return surfaceLight->TraceSurface(map, trace, surface, origin, dist);
+    }
+
+    if(kernelFlags & LK_WALLLIGHTS)
+    {
+        return surfaceLight->TraceSurfaceKernel<true>(map, trace, surface, origin, dist);
+    }
+
+    return surfaceLight->TraceSurfaceKernel<false>(map, trace, surface, origin, dist);
+}
+
 //
 // kexLightmapBuilder::LightTexelSample
 //
@@ -251,7 +427,9 @@ bool kexLightmapBuilder::EmitFromCeiling(kexTrace &trace, const surface_t *surfa
 // and against all nearby thing lights
 //
 
-kexVec3 kexLightmapBuilder::LightTexelSample(kexTrace &trace, const kexVec3 &origin, surface_t *surface)
+template<int kernelFlags>
+kexVec3 kexLightmapBuilder::LightTexelSample(kexTrace &trace, const kexVec3 &origin, surface_t *surface,
+        const kexLightTable &surfaceLights, int *survivors)
 {
     kexVec3 lightOrigin;
     kexVec3 dir;
@@ -261,42 +439,25 @@ kexVec3 kexLightmapBuilder::LightTexelSample(kexTrace &trace, const kexVec3 &ori
     float radius;
     float intensity;
     float colorAdd;
+    int numSurvivors;
 
     plane = surface->plane;
     color.Clear();
 
+    // only lights that are in range and in front of the texel are left
+    numSurvivors = (kernelFlags & LK_THINGLIGHTS) ?
+                   surfaceLights.CullPoint(origin, plane.Normal(), survivors) : 0;
+
     // check all thing lights
-    for(unsigned int i = 0; i < map->thingLights.Length(); i++)
+    for(int i = 0; i < numSurvivors; i++)
     {
-        thingLight_t *tl = map->thingLights[i];
-
-        // try to early out if PVS data exists
-        if(!map->CheckPVS(surface->subSector, tl->ssect))
-        {
-            continue;
-        }
+        thingLight_t *tl = surfaceLights.Light(survivors[i]);
 
-        lightOrigin.Set(tl->origin.x,
-                        tl->origin.y,
-                        !tl->bCeiling ?
-                        tl->sector->floorheight + tl->height :
-                        tl->sector->ceilingheight - tl->height);
-
-        if(plane.Distance(lightOrigin) - plane.d < 0)
-        {
-            // completely behind the plane
-            continue;
-        }
+        lightOrigin = surfaceLights.Origin(survivors[i]);
 
         radius = tl->radius;
         intensity = tl->intensity;
 
-        if(origin.DistanceSq(lightOrigin) > (radius*radius))
-        {
-            // not within range
-            continue;
-        }
-
         trace.Trace(lightOrigin, origin);
 
         if(trace.fraction != 1)
@@ -315,7 +476,8 @@ kexVec3 kexLightmapBuilder::LightTexelSample(kexTrace &trace, const kexVec3 &ori
         colorAdd = ((r * plane.Normal().Dot(dir)) / radius) * intensity;
         kexMath::Clamp(colorAdd, 0, 1);
 
-        if(tl->falloff != 1)
+        // pow(x, 1) is exact, so lights without a falloff can go through here too
+        if(kernelFlags & LK_FALLOFF)
         {
             colorAdd = kexMath::Pow(colorAdd, tl->falloff);
         }
@@ -327,7 +489,19 @@ kexVec3 kexLightmapBuilder::LightTexelSample(kexTrace &trace, const kexVec3 &ori
         tracedTexels++;
     }
 
-    if(surface->type != ST_CEILING && map->bSSectsVisibleToSky[surface->subSector - map->mapSSects])
+    if(kernelFlags & LK_SUNLIT)
+    {
+        // every texel on this surface is known to see the sky
+        dist = plane.Normal().Dot(map->GetSunDirection()) * 4;
+        kexMath::Clamp(dist, 0, 1);
+
+        color = color.Lerp(map->GetSunColor(), dist);
+        kexMath::Clamp(color, 0, 1);
+
+        // nothing was traced for it, so it's counted apart
+        sunlitTexels++;
+    }
+    else if(kernelFlags & LK_SUN)
     {
         // see if it's exposed to sunlight
         if(EmitFromCeiling(trace, surface, origin, plane.Normal(), &dist))
@@ -342,18 +516,17 @@ kexVec3 kexLightmapBuilder::LightTexelSample(kexTrace &trace, const kexVec3 &ori
         }
     }
 
-    // trace against surface lights
-    for(unsigned int i = 0; i < map->lightSurfaces.Length(); ++i)
+    if(!(kernelFlags & (LK_WALLLIGHTS|LK_FLATLIGHTS)))
     {
-        kexLightSurface *surfaceLight = map->lightSurfaces[i];
+        return color;
+    }
 
-        // try to early out if PVS data exists
-        if(!map->CheckPVS(surface->subSector, surfaceLight->Surface()->subSector))
-        {
-            continue;
-        }
+    // trace against surface lights
+    for(int i = 0; i < surfaceLights.NumSurfaceLights(); ++i)
+    {
+        kexLightSurface *surfaceLight = surfaceLights.SurfaceLight(i);
 
-        if(surfaceLight->TraceSurface(map, trace, surface, origin, &dist))
+        if(TraceLightSurface<kernelFlags>(surfaceLight, map, trace, surface, origin, &dist))
         {
             dist = (dist * surfaceLight->Intensity());
             kexMath::Clamp(dist, 0, 1);
@@ -368,6 +541,30 @@ kexVec3 kexLightmapBuilder::LightTexelSample(kexTrace &trace, const kexVec3 &ori
     return color;
 }
 
+#define TEXEL_KERNEL(n)     &kexLightmapBuilder::LightTexelSample<n>
+
+const kexLightmapBuilder::texelKernel_t kexLightmapBuilder::texelKernels[LK_NUMKERNELS] =
+{
+    TEXEL_KERNEL(0),  TEXEL_KERNEL(1),  TEXEL_KERNEL(2),  TEXEL_KERNEL(3),
+    TEXEL_KERNEL(4),  TEXEL_KERNEL(5),  TEXEL_KERNEL(6),  TEXEL_KERNEL(7),
+    TEXEL_KERNEL(8),  TEXEL_KERNEL(9),  TEXEL_KERNEL(10), TEXEL_KERNEL(11),
+    TEXEL_KERNEL(12), TEXEL_KERNEL(13), TEXEL_KERNEL(14), TEXEL_KERNEL(15),
+    TEXEL_KERNEL(16), TEXEL_KERNEL(17), TEXEL_KERNEL(18), TEXEL_KERNEL(19),
+    TEXEL_KERNEL(20), TEXEL_KERNEL(21), TEXEL_KERNEL(22), TEXEL_KERNEL(23),
+    TEXEL_KERNEL(24), TEXEL_KERNEL(25), TEXEL_KERNEL(26), TEXEL_KERNEL(27),
+    TEXEL_KERNEL(28), TEXEL_KERNEL(29), TEXEL_KERNEL(30), TEXEL_KERNEL(31),
+    TEXEL_KERNEL(32), TEXEL_KERNEL(33), TEXEL_KERNEL(34), TEXEL_KERNEL(35),
+    TEXEL_KERNEL(36), TEXEL_KERNEL(37), TEXEL_KERNEL(38), TEXEL_KERNEL(39),
+    TEXEL_KERNEL(40), TEXEL_KERNEL(41), TEXEL_KERNEL(42), TEXEL_KERNEL(43),
+    TEXEL_KERNEL(44), TEXEL_KERNEL(45), TEXEL_KERNEL(46), TEXEL_KERNEL(47),
+    TEXEL_KERNEL(48), TEXEL_KERNEL(49), TEXEL_KERNEL(50), TEXEL_KERNEL(51),
+    TEXEL_KERNEL(52), TEXEL_KERNEL(53), TEXEL_KERNEL(54), TEXEL_KERNEL(55),
+    TEXEL_KERNEL(56), TEXEL_KERNEL(57), TEXEL_KERNEL(58), TEXEL_KERNEL(59),
+    TEXEL_KERNEL(60), TEXEL_KERNEL(61), TEXEL_KERNEL(62), TEXEL_KERNEL(63)
+};
+
+#undef TEXEL_KERNEL
+
 //
 // kexLightmapBuilder::BuildSurfaceParams
 //
@@ -377,10 +574,9 @@ kexVec3 kexLightmapBuilder::LightTexelSample(kexTrace &trace, const kexVec3 &ori
 // each texel will be positioned on the surface
 //
 
-void kexLightmapBuilder::BuildSurfaceParams(surface_t *surface)
+void kexLightmapBuilder::BuildSurfaceParams(surface_t *surface, kexBBox bounds, const int samples)
 {
     kexPlane *plane;
-    kexBBox bounds;
     kexVec3 roundedSize;
     int i;
     kexPlane::planeAxis_t axis;
@@ -391,7 +587,6 @@ void kexLightmapBuilder::BuildSurfaceParams(surface_t *surface)
     float d;
 
     plane = &surface->plane;
-    bounds = GetBoundsFromSurface(surface);
 
     // round off dimentions
     for(i = 0; i < 3; i++)
@@ -445,8 +640,11 @@ void kexLightmapBuilder::BuildSurfaceParams(surface_t *surface)
         height = textureHeight;
     }
 
-    surface->lightmapCoords = (float*)Mem_Calloc(sizeof(float) *
-                              surface->numVerts * 2, hb_static);
+    if(surface->lightmapCoords == NULL)
+    {
+        surface->lightmapCoords = (float*)Mem_Calloc(sizeof(float) *
+                                  surface->numVerts * 2, hb_map);
+    }
 
     surface->textureCoords[0] = tCoords[0];
     surface->textureCoords[1] = tCoords[1];
@@ -473,465 +671,3443 @@ void kexLightmapBuilder::BuildSurfaceParams(surface_t *surface)
 }
 
 //
-// kexLightmapBuilder::TraceSurface
+// kexLightmapBuilder::ClassifySurface
 //
-// Steps through each texel and traces a line to the world.
-// For each non-occluded trace, color is accumulated and saved off
-// into the lightmap texture based on what block is mapped to
+// Culls the map's lights down to the ones that could reach any
+// texel on the surface and returns the flags of the kernel that
+// should light it. Zero means nothing can ever reach the surface
 //
 
-void kexLightmapBuilder::TraceSurface(surface_t *surface)
+int kexLightmapBuilder::ClassifySurface(surface_t *surface, kexLightTable &surfaceLights)
 {
-    kexVec3 colorSamples[256][256];
+    kexBBox texelBounds;
+    kexVec3 normal;
     int sampleWidth;
     int sampleHeight;
-    kexVec3 normal;
-    kexVec3 pos;
-    kexVec3 tDelta;
-    int i;
-    int j;
-    kexTrace trace;
-    byte *currentTexture;
-    byte rgb[3];
-    bool bShouldLookupTexture = false;
-
-    trace.Init(*map);
-    memset(colorSamples, 0, sizeof(colorSamples));
+    int kernelFlags;
 
     sampleWidth = surface->lightmapDims[0];
     sampleHeight = surface->lightmapDims[1];
 
     normal = surface->plane.Normal();
 
-    // debugging stuff - used to help visualize where texels are positioned in the level
-#ifdef EXPORT_TEXELS_OBJ
-    static int cnt = 0;
-    FILE *f = fopen(Va("texels_%02d.obj", cnt++), "w");
-    int indices = 0;
-#endif
+    // get the bounds of all texel origins so lights that can't
+    // reach any of them can be thrown out early
+    texelBounds.Clear();
+    texelBounds.AddPoint(surface->lightmapOrigin + normal);
+    texelBounds.AddPoint(surface->lightmapOrigin + normal +
+                         (surface->lightmapSteps[0] * (float)(sampleWidth-1)));
+    texelBounds.AddPoint(surface->lightmapOrigin + normal +
+                         (surface->lightmapSteps[1] * (float)(sampleHeight-1)));
+    texelBounds.AddPoint(surface->lightmapOrigin + normal +
+                         (surface->lightmapSteps[0] * (float)(sampleWidth-1)) +
+                         (surface->lightmapSteps[1] * (float)(sampleHeight-1)));
 
-    // start walking through each texel
-    for(i = 0; i < sampleHeight; i++)
-    {
-        for(j = 0; j < sampleWidth; j++)
-        {
-            // convert the texel into world-space coordinates.
-            // this will be the origin in which a line will be traced from
-            pos = surface->lightmapOrigin + normal +
-                  (surface->lightmapSteps[0] * (float)j) +
-                  (surface->lightmapSteps[1] * (float)i);
+    surfaceLights.BuildFromSurface(lightTable, *map, surface, texelBounds, bUseReject);
 
-            // debugging stuff
-#ifdef EXPORT_TEXELS_OBJ
-            ExportTexelsToObjFile(f, pos, indices);
-            indices += 8;
-#endif
+    // pick the kernel that only handles what can reach this surface
+    kernelFlags = 0;
 
-            // accumulate color samples
-            colorSamples[i][j] += LightTexelSample(trace, pos, surface);
+    if(surfaceLights.NumLights() > 0)
+    {
+        kernelFlags |= LK_THINGLIGHTS;
 
-            // if nothing at all was traced and color is completely black
-            // then this surface will not go through the extra rendering
-            // step in rendering the lightmap
-            if(colorSamples[i][j].UnitSq() != 0)
-            {
-                bShouldLookupTexture = true;
-            }
+        if(surfaceLights.HasFalloff())
+        {
+            kernelFlags |= LK_FALLOFF;
         }
     }
 
-#ifdef EXPORT_TEXELS_OBJ
-    fclose(f);
-#endif
+    // the sun can't reach surfaces that face away from it
+    if(surface->type != ST_CEILING && map->bSSectsVisibleToSky[surface->subSector - map->mapSSects] &&
+        normal.Dot(map->GetSunDirection()) > 0)
+    {
+        kernelFlags |= LK_SUN;
+    }
 
-    // SVE redraws the scene for lightmaps, so for optimizations,
-    // tell the engine to ignore this surface if completely black
-    if(bShouldLookupTexture == false)
+    if(surfaceLights.NumWallLights() > 0)
     {
-        surface->lightmapNum = -1;
-        return;
+        kernelFlags |= LK_WALLLIGHTS;
     }
-    else
+
+    if(surfaceLights.NumFlatLights() > 0)
     {
-        int x = 0, y = 0;
-        int width = surface->lightmapDims[0];
-        int height = surface->lightmapDims[1];
+        kernelFlags |= LK_FLATLIGHTS;
+    }
 
-        // now that we know the width and height of this block, see if we got
-        // room for it in the light map texture. if not, then we must allocate
-        // a new texture
-        if(!MakeRoomForBlock(width, height, &x, &y, &surface->lightmapNum))
-        {
-            // allocate a new texture for this block
-            lightmapWorker.LockMutex();
-            NewTexture();
-            lightmapWorker.UnlockMutex();
+    return kernelFlags;
+}
 
-            if(!MakeRoomForBlock(width, height, &x, &y, &surface->lightmapNum))
-            {
-                Error("Lightmap allocation failed\n");
-                return;
-            }
-        }
+//
+// kexLightmapBuilder::ClassifySunlight
+//
+// Probes the chart's sunlit texels against the sun, corners of the
+// covered area first, then its edges and then a sparse grid inside it.
+// Only covered texels owned by a surface the sun can reach are
+// probed. Returns 1 if they all see the sky, 0 if none of them do and
+// -1 if the texels will need to be traced individually. Charts too
+// small for the probes to save anything are always traced
+//
+
+int kexLightmapBuilder::ClassifySunlight(kexTrace &trace, const lightChart_t *chart,
+        const int *kernelFlags, byte coverage[256][256], short owners[256][256])
+{
+    byte (*sunlit)[256];
+    surface_t *surface;
+    kexVec3 normal;
+    kexVec3 pos;
+    float dist;
+    int sampleWidth;
+    int sampleHeight;
+    int numTexels;
+    int numLit;
+    int numProbes;
+
+    surface = chart->surfaces[0];
+
+    sampleWidth = surface->lightmapDims[0];
+    sampleHeight = surface->lightmapDims[1];
+
+    sunlit = new byte[256][256];
 
-        // calculate texture coordinates
-        for(i = 0; i < surface->numVerts; i++)
+    numTexels = 0;
+
+    for(int i = 0; i < sampleHeight; i++)
+    {
+        for(int j = 0; j < sampleWidth; j++)
         {
-            tDelta = surface->verts[i] - surface->bounds.min;
-            surface->lightmapCoords[i * 2 + 0] =
-                (tDelta.Dot(surface->textureCoords[0]) + x + 0.5f) / (float)textureWidth;
-            surface->lightmapCoords[i * 2 + 1] =
-                (tDelta.Dot(surface->textureCoords[1]) + y + 0.5f) / (float)textureHeight;
+            sunlit[i][j] = (coverage[i][j] && (kernelFlags[owners[i][j]] & LK_SUN));
+            numTexels += sunlit[i][j];
         }
-
-        surface->lightmapOffs[0] = x;
-        surface->lightmapOffs[1] = y;
     }
 
-    lightmapWorker.LockMutex();
-    currentTexture = textures[surface->lightmapNum];
-    lightmapWorker.UnlockMutex();
+    normal = surface->plane.Normal();
 
-    // store results to lightmap texture
-    for(i = 0; i < sampleHeight; i++)
+    numLit = 0;
+    numProbes = 0;
+
+    // 0 = count the probes, 1 = corners, 2 = edges, 3 = inside
+    for(int pass = 0; pass < 4; pass++)
     {
-        for(j = 0; j < sampleWidth; j++)
+        for(int i = 0; i < sampleHeight; i++)
         {
-            // get texture offset
-            int offs = (((textureWidth * (i + surface->lightmapOffs[1])) +
-                         surface->lightmapOffs[0]) * 3);
+            for(int j = 0; j < sampleWidth; j++)
+            {
+                if(!sunlit[i][j])
+                {
+                    continue;
+                }
 
-            // convert RGB to bytes
-            rgb[0] = (byte)(colorSamples[i][j][0] * 255);
-            rgb[1] = (byte)(colorSamples[i][j][1] * 255);
-            rgb[2] = (byte)(colorSamples[i][j][2] * 255);
+                bool bEdgeX = (j == 0 || j == sampleWidth-1 || !sunlit[i][j-1] || !sunlit[i][j+1]);
+                bool bEdgeY = (i == 0 || i == sampleHeight-1 || !sunlit[i-1][j] || !sunlit[i+1][j]);
+                bool bInside = !(bEdgeX || bEdgeY);
 
-            currentTexture[offs + j * 3 + 0] = rgb[0];
-            currentTexture[offs + j * 3 + 1] = rgb[1];
-            currentTexture[offs + j * 3 + 2] = rgb[2];
-        }
-    }
-}
+                if(bInside && ((i % SUN_PROBE_STRIDE) != 0 || (j % SUN_PROBE_STRIDE) != 0))
+                {
+                    continue;
+                }
 
-//
-// kexLightmapBuilder::LightSurface
-//
+                switch(pass)
+                {
+                case 0:
+                    numProbes++;
+                    continue;
+
+                case 1:
+                    if(!(bEdgeX && bEdgeY))
+                    {
+                        continue;
+                    }
+                    break;
 
-void kexLightmapBuilder::LightSurface(const int surfid)
-{
-    static int processed = 0;
-    float remaining;
-    int numsurfs = surfaces.Length();
+                case 2:
+                    if(bEdgeX == bEdgeY)
+                    {
+                        continue;
+                    }
+                    break;
 
-    // TODO: this should NOT happen, but apparently, it can randomly occur
-    if(surfaces.Length() == 0)
-    {
-        return;
-    }
+                default:
+                    if(!bInside)
+                    {
+                        continue;
+                    }
+                    break;
+                }
 
-    BuildSurfaceParams(surfaces[surfid]);
-    TraceSurface(surfaces[surfid]);
+                pos = surface->lightmapOrigin + normal +
+                      (surface->lightmapSteps[0] * (float)j) +
+                      (surface->lightmapSteps[1] * (float)i);
 
-    lightmapWorker.LockMutex();
-    remaining = (float)processed / (float)numsurfs;
-    processed++;
+                if(EmitFromCeiling(trace, surface, pos, normal, &dist))
+                {
+                    numLit++;
+                }
 
-    printf("%i%c surfaces done\r", (int)(remaining * 100.0f), '%');
-    lightmapWorker.UnlockMutex();
+                numProbes++;
+
+                if(numLit != 0 && numLit != numProbes)
+                {
+                    // some see the sky and some don't
+                    delete[] sunlit;
+                    return -1;
+                }
+            }
+        }
+
+        if(pass == 0)
+        {
+            if(numProbes == 0 || numProbes * 2 > numTexels)
+            {
+                delete[] sunlit;
+                return -1;
+            }
+
+            numProbes = 0;
+        }
+    }
+
+    delete[] sunlit;
+    return numLit != 0 ? 1 : 0;
 }
 
 //
-// kexLightmapBuilder::LightCellSample
+// kexLightmapBuilder::RasterizeSurface
 //
-// Traces a line from the cell's origin to the sunlight direction
-// and against all nearby thing lights
+// Marks the texels in a block whose square, grown by the given
+// border, overlaps the surface polygon. Only texels that haven't been
+// claimed yet are marked unless bOverwrite is set
 //
 
-kexVec3 kexLightmapBuilder::LightCellSample(const int gridid, kexTrace &trace,
-        const kexVec3 &origin, const mapSubSector_t *sub)
+int kexLightmapBuilder::RasterizeSurface(const surface_t *surface, short owners[256][256],
+        const short owner, const float border, const bool bOverwrite)
 {
-    kexVec3 color;
-    kexVec3 dir;
-    mapSector_t *mapSector;
-    float intensity;
-    float radius;
-    float dist;
-    float colorAdd;
-    thingLight_t *tl;
-    kexVec3 lightOrigin;
-    bool bInSkySector;
-    kexVec3 org;
+    kexVec2 *uv;
+    kexVec2 *axes;
+    float *axisMin;
+    float *axisMax;
+    kexVec3 tDelta;
+    kexVec2 polyMin;
+    kexVec2 polyMax;
+    kexVec2 texelMin;
+    kexVec2 texelMax;
+    float smin, smax;
+    float d;
+    int count;
+    int x1, x2, y1, y2;
+    int numVerts;
+    bool bOverlap;
 
-    mapSector = map->GetSectorFromSubSector(sub);
-    bInSkySector = map->bSkySectors[mapSector - map->mapSectors];
+    numVerts = surface->numVerts;
 
-    trace.Trace(origin, origin + (map->GetSunDirection() * 32768));
+    uv = new kexVec2[numVerts];
+    axes = new kexVec2[numVerts];
+    axisMin = new float[numVerts];
+    axisMax = new float[numVerts];
 
-    // did we traced a ceiling surface with a sky texture?
-    if(trace.fraction != 1 && trace.hitSurface != NULL)
+    // project the polygon into texel space. a texel at (j, i) is centered on (j, i)
+    for(int k = 0; k < numVerts; k++)
     {
-        if(trace.hitSurface->bSky && origin.z + gridSize[2] > mapSector->floorheight)
+        tDelta = surface->verts[k] - surface->bounds.min;
+        uv[k].Set(tDelta.Dot(surface->textureCoords[0]), tDelta.Dot(surface->textureCoords[1]));
+
+        if(k == 0)
         {
-            color = map->GetSunColor();
-            // this cell is inside a sector with a sky texture and is also exposed to sunlight.
-            // mark this cell as a sun type. cells of this type will simply sample the
+            polyMin = polyMax = uv[k];
+            continue;
+        }
+
+        if(uv[k].x < polyMin.x) polyMin.x = uv[k].x;
+        if(uv[k].y < polyMin.y) polyMin.y = uv[k].y;
+        if(uv[k].x > polyMax.x) polyMax.x = uv[k].x;
+        if(uv[k].y > polyMax.y) polyMax.y = uv[k].y;
+    }
+
+    // the polygon's edge normals are the other separating axes. the winding
+    // isn't known so the polygon is projected onto each one
+    for(int k = 0; k < numVerts; k++)
+    {
+        kexVec2 edge = uv[(k + 1) % numVerts] - uv[k];
+        axes[k].Set(-edge.y, edge.x);
+
+        axisMin[k] = axisMax[k] = axes[k].Dot(uv[0]);
+
+        for(int n = 1; n < numVerts; n++)
+        {
+            d = axes[k].Dot(uv[n]);
+
+            if(d < axisMin[k]) axisMin[k] = d;
+            if(d > axisMax[k]) axisMax[k] = d;
+        }
+    }
+
+    // only the texels around the polygon need to be tested
+    x1 = MAX((int)kexMath::Floor(polyMin.x - border), 0);
+    y1 = MAX((int)kexMath::Floor(polyMin.y - border), 0);
+    x2 = MIN((int)kexMath::Ceil(polyMax.x + border), surface->lightmapDims[0]-1);
+    y2 = MIN((int)kexMath::Ceil(polyMax.y + border), surface->lightmapDims[1]-1);
+
+    count = 0;
+
+    for(int i = y1; i <= y2; i++)
+    {
+        for(int j = x1; j <= x2; j++)
+        {
+            if(!bOverwrite && owners[i][j] != -1)
+            {
+                continue;
+            }
+
+            texelMin.Set((float)j - border, (float)i - border);
+            texelMax.Set((float)j + border, (float)i + border);
+
+            bOverlap = !(texelMax.x < polyMin.x || texelMin.x > polyMax.x ||
+                         texelMax.y < polyMin.y || texelMin.y > polyMax.y);
+
+            for(int k = 0; k < numVerts && bOverlap; k++)
+            {
+                // project the square's corners
+                smin = smax = axes[k].x * texelMin.x + axes[k].y * texelMin.y;
+
+                d = axes[k].x * texelMax.x + axes[k].y * texelMin.y;
+                if(d < smin) smin = d;
+                if(d > smax) smax = d;
+
+                d = axes[k].x * texelMin.x + axes[k].y * texelMax.y;
+                if(d < smin) smin = d;
+                if(d > smax) smax = d;
+
+                d = axes[k].x * texelMax.x + axes[k].y * texelMax.y;
+                if(d < smin) smin = d;
+                if(d > smax) smax = d;
+
+                if(smax < axisMin[k] || smin > axisMax[k])
+                {
+                    bOverlap = false;
+                }
+            }
+
+            if(bOverlap)
+            {
+                owners[i][j] = owner;
+                count++;
+            }
+        }
+    }
+
+    delete[] uv;
+    delete[] axes;
+    delete[] axisMin;
+    delete[] axisMax;
+
+    return count;
+}
+
+//
+// kexLightmapBuilder::BuildCoverageMask
+//
+// Finds which texels of a chart need to be traced and which surface
+// each one belongs to. A texel is covered if it is within one texel
+// of any surface and is owned by the surface that contains its center.
+// Texels outside of that can never be filtered into anything visible
+// so they don't need to be traced
+//
+
+void kexLightmapBuilder::BuildCoverageMask(const lightChart_t *chart, byte coverage[256][256],
+        short owners[256][256])
+{
+    int sampleWidth;
+    int sampleHeight;
+    int numCovered;
+
+    sampleWidth = chart->surfaces[0]->lightmapDims[0];
+    sampleHeight = chart->surfaces[0]->lightmapDims[1];
+
+    for(int i = 0; i < sampleHeight; i++)
+    {
+        for(int j = 0; j < sampleWidth; j++)
+        {
+            owners[i][j] = -1;
+        }
+    }
+
+    numCovered = 0;
+
+    for(int i = 0; i < chart->numSurfaces; i++)
+    {
+        numCovered += RasterizeSurface(chart->surfaces[i], owners, i, 1.5f, false);
+    }
+
+    if(chart->numSurfaces > 1)
+    {
+        for(int i = 0; i < chart->numSurfaces; i++)
+        {
+            RasterizeSurface(chart->surfaces[i], owners, i, 0, true);
+        }
+    }
+
+    for(int i = 0; i < sampleHeight; i++)
+    {
+        for(int j = 0; j < sampleWidth; j++)
+        {
+            if(numCovered == 0)
+            {
+                // degenerate polygons. just trace everything
+                owners[i][j] = 0;
+            }
+
+            coverage[i][j] = (owners[i][j] != -1);
+        }
+    }
+}
+
+//
+// kexLightmapBuilder::DilateSamples
+//
+// Fills in texels that weren't traced by spreading out
+// the neighboring texels that were
+//
+
+void kexLightmapBuilder::DilateSamples(const surface_t *surface, kexVec3 colorSamples[256][256],
+                                       byte coverage[256][256])
+{
+    static const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+    int sampleWidth;
+    int sampleHeight;
+    bool bFilled;
+
+    sampleWidth = surface->lightmapDims[0];
+    sampleHeight = surface->lightmapDims[1];
+
+    // 0 = empty, 1 = traced or filled, 2 = filled on this pass
+    do
+    {
+        bFilled = false;
+
+        for(int i = 0; i < sampleHeight; i++)
+        {
+            for(int j = 0; j < sampleWidth; j++)
+            {
+                kexVec3 color;
+                int count = 0;
+
+                if(coverage[i][j] != 0)
+                {
+                    continue;
+                }
+
+                for(int k = 0; k < 4; k++)
+                {
+                    int x = j + offsets[k][0];
+                    int y = i + offsets[k][1];
+
+                    if(x < 0 || y < 0 || x >= sampleWidth || y >= sampleHeight ||
+                        coverage[y][x] != 1)
+                    {
+                        continue;
+                    }
+
+                    color += colorSamples[y][x];
+                    count++;
+                }
+
+                if(count == 0)
+                {
+                    continue;
+                }
+
+                colorSamples[i][j] = color / (float)count;
+                coverage[i][j] = 2;
+                bFilled = true;
+            }
+        }
+
+        for(int i = 0; i < sampleHeight; i++)
+        {
+            for(int j = 0; j < sampleWidth; j++)
+            {
+                if(coverage[i][j] == 2)
+                {
+                    coverage[i][j] = 1;
+                }
+            }
+        }
+    } while(bFilled);
+}
+
+//
+// kexLightmapBuilder::ClassifyChart
+//
+// Classifies every surface of the chart so both the cache key and
+// the texel kernels can use the same lights and flags
+//
+
+void kexLightmapBuilder::ClassifyChart(lightChart_t *chart, kexLightTable *surfaceLights,
+                                       int *kernelFlags)
+{
+    for(int i = 0; i < chart->numSurfaces; i++)
+    {
+        kernelFlags[i] = ClassifySurface(chart->surfaces[i], surfaceLights[i]);
+    }
+}
+
+//
+// kexLightmapBuilder::SampleChart
+//
+// Steps through each texel and traces a line to the world.
+// For each non-occluded trace, color is accumulated into
+// colorSamples. Every texel is lit as part of the surface that
+// owns it, with the lights and flags ClassifyChart gave it.
+// Returns false if nothing at all reached the chart
+//
+
+bool kexLightmapBuilder::SampleChart(lightChart_t *chart, kexLightTable *surfaceLights,
+        int *kernelFlags, kexVec3 colorSamples[256][256],
+        byte coverage[256][256], const bool bClassifySun)
+{
+    short (*owners)[256];
+    surface_t *surface;
+    int sampleWidth;
+    int sampleHeight;
+    kexVec3 normal;
+    kexVec3 pos;
+    int i;
+    int j;
+    kexTrace trace;
+    bool bShouldLookupTexture = false;
+    texelKernel_t *kernels;
+    int *survivors;
+    int maxLights;
+    int sunFlags;
+
+    trace.Init(*map);
+
+    owners = new short[256][256];
+
+    // all surfaces in a chart share the same lightmap block
+    surface = chart->surfaces[0];
+
+    sampleWidth = surface->lightmapDims[0];
+    sampleHeight = surface->lightmapDims[1];
+
+    normal = surface->plane.Normal();
+
+    kernels = new texelKernel_t[chart->numSurfaces];
+
+    maxLights = 0;
+    sunFlags = 0;
+
+    for(i = 0; i < chart->numSurfaces; i++)
+    {
+        sunFlags |= kernelFlags[i];
+
+        if(surfaceLights[i].NumLights() > maxLights)
+        {
+            maxLights = surfaceLights[i].NumLights();
+        }
+    }
+
+    BuildCoverageMask(chart, coverage, owners);
+
+    if(bClassifySun && (sunFlags & LK_SUN))
+    {
+        int sunlight = ClassifySunlight(trace, chart, kernelFlags, coverage, owners);
+
+        for(i = 0; i < chart->numSurfaces && sunlight != -1; i++)
+        {
+            if(!(kernelFlags[i] & LK_SUN))
+            {
+                continue;
+            }
+
+            kernelFlags[i] &= ~LK_SUN;
+
+            if(sunlight == 1)
+            {
+                kernelFlags[i] |= LK_SUNLIT;
+            }
+        }
+
+        if(sunlight != -1)
+        {
+            lightmapWorker.LockMutex();
+            numSunClassified++;
+            lightmapWorker.UnlockMutex();
+        }
+    }
+
+    for(i = 0; i < chart->numSurfaces; i++)
+    {
+        kernels[i] = texelKernels[kernelFlags[i]];
+    }
+
+    survivors = new int[maxLights + LIGHT_BATCH_SIZE];
+
+    // debugging stuff - used to help visualize where texels are positioned in the level
+#ifdef EXPORT_TEXELS_OBJ
+    static int cnt = 0;
+    FILE *f = fopen(Va("texels_%02d.obj", cnt++), "w");
+    int indices = 0;
+#endif
+
+    // start walking through each texel
+    for(i = 0; i < sampleHeight; i++)
+    {
+        for(j = 0; j < sampleWidth; j++)
+        {
+            int owner = owners[i][j];
+
+            colorSamples[i][j].Clear();
+
+            if(!coverage[i][j])
+            {
+                continue;
+            }
+
+            // convert the texel into world-space coordinates.
+            // this will be the origin in which a line will be traced from
+            pos = surface->lightmapOrigin + normal +
+                  (surface->lightmapSteps[0] * (float)j) +
+                  (surface->lightmapSteps[1] * (float)i);
+
+            // debugging stuff
+#ifdef EXPORT_TEXELS_OBJ
+            ExportTexelsToObjFile(f, pos, indices);
+            indices += 8;
+#endif
+
+            // accumulate color samples
+            colorSamples[i][j] += (this->*kernels[owner])(trace, pos, chart->surfaces[owner],
+                                  surfaceLights[owner], survivors);
+
+            // if nothing at all was traced and color is completely black
+            // then this surface will not go through the extra rendering
+            // step in rendering the lightmap
+            if(colorSamples[i][j].UnitSq() != 0)
+            {
+                bShouldLookupTexture = true;
+            }
+        }
+    }
+
+#ifdef EXPORT_TEXELS_OBJ
+    fclose(f);
+#endif
+
+    delete[] survivors;
+    delete[] kernels;
+    delete[] owners;
+
+    return bShouldLookupTexture;
+}
+
+//
+// kexLightmapBuilder::TraceChart
+//
+// Lights every texel in the chart and saves them off
+// so the chart's block can be packed later on
+//
+
+void kexLightmapBuilder::TraceChart(lightChart_t *chart, kexLightTable *surfaceLights,
+                                    int *kernelFlags)
+{
+    kexVec3 (*colorSamples)[256];
+    byte (*coverage)[256];
+    surface_t *surface;
+    int sampleWidth;
+    int sampleHeight;
+    int i;
+    int j;
+    byte *texels;
+    bool bShouldLookupTexture;
+
+    colorSamples = new kexVec3[256][256];
+    coverage = new byte[256][256];
+
+    // all surfaces in a chart share the same lightmap block
+    surface = chart->surfaces[0];
+
+    sampleWidth = surface->lightmapDims[0];
+    sampleHeight = surface->lightmapDims[1];
+
+    bShouldLookupTexture = SampleChart(chart, surfaceLights, kernelFlags,
+                                       colorSamples, coverage, bSunClassify);
+
+    if(gridTexels != NULL)
+    {
+        AddTexelsToGrid(surface, colorSamples, coverage);
+    }
+
+    DilateSamples(surface, colorSamples, coverage);
+    delete[] coverage;
+
+    // SVE redraws the scene for lightmaps, so for optimizations,
+    // tell the engine to ignore this surface if completely black
+    if(bShouldLookupTexture == false)
+    {
+        for(i = 0; i < chart->numSurfaces; i++)
+        {
+            chart->surfaces[i]->lightmapNum = -1;
+        }
+
+        delete[] colorSamples;
+        return;
+    }
+
+    // the block is packed into a lightmap texture once all charts are traced
+    lightmapWorker.LockMutex();
+    texels = (byte*)Mem_Malloc((sampleWidth * sampleHeight) * 3, hb_lightmap);
+    lightmapWorker.UnlockMutex();
+
+    for(i = 0; i < sampleHeight; i++)
+    {
+        for(j = 0; j < sampleWidth; j++)
+        {
+            int offs = ((i * sampleWidth) + j) * 3;
+
+            // convert RGB to bytes
+            texels[offs + 0] = (byte)(colorSamples[i][j][0] * 255);
+            texels[offs + 1] = (byte)(colorSamples[i][j][1] * 255);
+            texels[offs + 2] = (byte)(colorSamples[i][j][2] * 255);
+        }
+    }
+
+    chart->texels = texels;
+    delete[] colorSamples;
+}
+
+//
+// kexLightmapBuilder::SetChartCoords
+//
+// Maps every surface of the chart to the block
+// that was placed at x, y in a lightmap texture
+//
+
+void kexLightmapBuilder::SetChartCoords(lightChart_t *chart, const int num, const int x, const int y,
+        const bool bUniform)
+{
+    kexVec3 tDelta;
+
+    for(int k = 0; k < chart->numSurfaces; k++)
+    {
+        surface_t *surf = chart->surfaces[k];
+
+        for(int i = 0; i < surf->numVerts; i++)
+        {
+            // uniform blocks are sampled right at their center
+            if(bUniform)
+            {
+                surf->lightmapCoords[i * 2 + 0] =
+                    (x + UNIFORM_BLOCK_SIZE * 0.5f) / (float)textureWidth;
+                surf->lightmapCoords[i * 2 + 1] =
+                    (y + UNIFORM_BLOCK_SIZE * 0.5f) / (float)textureHeight;
+                continue;
+            }
+
+            tDelta = surf->verts[i] - surf->bounds.min;
+            surf->lightmapCoords[i * 2 + 0] =
+                (tDelta.Dot(surf->textureCoords[0]) + x + 0.5f) / (float)textureWidth;
+            surf->lightmapCoords[i * 2 + 1] =
+                (tDelta.Dot(surf->textureCoords[1]) + y + 0.5f) / (float)textureHeight;
+        }
+
+        surf->lightmapNum = num;
+        surf->lightmapOffs[0] = x;
+        surf->lightmapOffs[1] = y;
+    }
+}
+
+//
+// kexLightmapBuilder::PlaceBlock
+//
+// Finds room for a block in the lightmap textures, allocating
+// a new texture if none of the existing ones can fit it
+//
+
+void kexLightmapBuilder::PlaceBlock(const int width, const int height, int *x, int *y, int *num,
+                                    const bool bDryRun)
+{
+    // now that we know the width and height of this block, see if we got
+    // room for it in the light map texture. if not, then we must allocate
+    // a new texture
+    if(!MakeRoomForBlock(width, height, x, y, num))
+    {
+        // allocate a new texture for this block
+        NewTexture(bDryRun);
+
+        if(!MakeRoomForBlock(width, height, x, y, num))
+        {
+            Error("Lightmap allocation failed\n");
+            return;
+        }
+    }
+}
+
+//
+// kexLightmapBuilder::IsUniformChart
+//
+// Checks if every texel of the chart is within UNIFORM_TOLERANCE
+// of each other. If so, rgb is set to the color in the middle
+//
+
+bool kexLightmapBuilder::IsUniformChart(const lightChart_t *chart, byte *rgb)
+{
+    int count = chart->surfaces[0]->lightmapDims[0] * chart->surfaces[0]->lightmapDims[1];
+    byte *texels = chart->texels;
+    byte rgbMin[3];
+    byte rgbMax[3];
+
+    for(int k = 0; k < 3; k++)
+    {
+        rgbMin[k] = rgbMax[k] = texels[k];
+    }
+
+    for(int i = 1; i < count; i++)
+    {
+        for(int k = 0; k < 3; k++)
+        {
+            byte c = texels[i * 3 + k];
+
+            if(c < rgbMin[k]) rgbMin[k] = c;
+            if(c > rgbMax[k]) rgbMax[k] = c;
+
+            if(rgbMax[k] - rgbMin[k] > UNIFORM_TOLERANCE)
+            {
+                return false;
+            }
+        }
+    }
+
+    for(int k = 0; k < 3; k++)
+    {
+        rgb[k] = (byte)((rgbMin[k] + rgbMax[k] + 1) >> 1);
+    }
+
+    return true;
+}
+
+//
+// kexLightmapBuilder::PackCharts
+//
+// Places the blocks of all traced charts into the lightmap textures.
+// This is done in chart order so the layout doesn't depend on which
+// thread finishes first. Charts that came out as a single color all
+// share one tiny block per color
+//
+
+void kexLightmapBuilder::PackCharts(const bool bDryRun)
+{
+    BeginPacking();
+
+    for(int i = 0; i < numCharts; i++)
+    {
+        PackChart(i, bDryRun);
+    }
+
+    FinishPacking(bDryRun);
+}
+
+//
+// kexLightmapBuilder::BeginPacking
+//
+
+void kexLightmapBuilder::BeginPacking(void)
+{
+    uniformHash = new int[UNIFORM_HASH_SIZE];
+
+    for(int i = 0; i < UNIFORM_HASH_SIZE; i++)
+    {
+        uniformHash[i] = -1;
+    }
+
+    uniformBlocks.Empty();
+    numUniformCharts = 0;
+    numChartsPacked = 0;
+    bPacking = false;
+}
+
+//
+// kexLightmapBuilder::PackChart
+//
+
+void kexLightmapBuilder::PackChart(const int chartid, const bool bDryRun)
+{
+    lightChart_t *chart = &charts[chartid];
+    int width, height;
+    int x, y, num;
+    byte rgb[3];
+    byte *currentTexture;
+
+    if(chart->texels == NULL)
+    {
+        return;
+    }
+
+    if(IsUniformChart(chart, rgb))
+    {
+        int hash = ((rgb[0] * 31 + rgb[1]) * 31 + rgb[2]) & (UNIFORM_HASH_SIZE-1);
+        int block;
+
+        for(block = uniformHash[hash]; block != -1; block = uniformBlocks[block].next)
+        {
+            if(!memcmp(uniformBlocks[block].rgb, rgb, 3))
+            {
+                break;
+            }
+        }
+
+        if(block == -1)
+        {
+            uniformBlock_t uniformBlock;
+
+            PlaceBlock(UNIFORM_BLOCK_SIZE, UNIFORM_BLOCK_SIZE, &x, &y, &num, bDryRun);
+
+            if(!bDryRun)
+            {
+                currentTexture = textures[num];
+
+                for(int j = 0; j < UNIFORM_BLOCK_SIZE; j++)
+                {
+                    for(int k = 0; k < UNIFORM_BLOCK_SIZE; k++)
+                    {
+                        int offs = ((textureWidth * (y + j)) + x + k) * 3;
+
+                        currentTexture[offs + 0] = rgb[0];
+                        currentTexture[offs + 1] = rgb[1];
+                        currentTexture[offs + 2] = rgb[2];
+                    }
+                }
+            }
+
+            memcpy(uniformBlock.rgb, rgb, 3);
+            uniformBlock.lightmapNum = num;
+            uniformBlock.x = x;
+            uniformBlock.y = y;
+            uniformBlock.next = uniformHash[hash];
+
+            block = uniformBlocks.Length();
+            uniformHash[hash] = block;
+            uniformBlocks.Push(uniformBlock);
+        }
+
+        if(!bDryRun)
+        {
+            SetChartCoords(chart, uniformBlocks[block].lightmapNum,
+                           uniformBlocks[block].x, uniformBlocks[block].y, true);
+        }
+
+        numUniformCharts++;
+        return;
+    }
+
+    width = chart->surfaces[0]->lightmapDims[0];
+    height = chart->surfaces[0]->lightmapDims[1];
+
+    PlaceBlock(width, height, &x, &y, &num, bDryRun);
+
+    if(bDryRun)
+    {
+        return;
+    }
+
+    SetChartCoords(chart, num, x, y, false);
+
+    currentTexture = textures[num];
+
+    // store results to lightmap texture
+    for(int j = 0; j < height; j++)
+    {
+        memcpy(&currentTexture[((textureWidth * (y + j)) + x) * 3],
+               &chart->texels[(j * width) * 3], width * 3);
+    }
+}
+
+//
+// kexLightmapBuilder::PackLitCharts
+//
+// Packs the lit charts that are next in chart order. Called with the
+// worker mutex held, but it's only held while claiming the charts so
+// the other threads aren't kept waiting on the copies. Only one
+// thread packs at a time, so the layout comes out the same as
+// packing every chart in order
+//
+
+void kexLightmapBuilder::PackLitCharts(void)
+{
+    int first;
+    int last;
+
+    bPacking = true;
+
+    while(numChartsPacked < numCharts && chartsLit[numChartsPacked])
+    {
+        first = numChartsPacked;
+
+        for(last = first; last < numCharts && chartsLit[last]; last++);
+
+        lightmapWorker.UnlockMutex();
+
+        for(int i = first; i < last; i++)
+        {
+            PackChart(i, false);
+        }
+
+        lightmapWorker.LockMutex();
+
+        numChartsPacked = last;
+    }
+
+    bPacking = false;
+}
+
+//
+// kexLightmapBuilder::FinishPacking
+//
+
+void kexLightmapBuilder::FinishPacking(const bool bDryRun)
+{
+    delete[] uniformHash;
+    uniformHash = NULL;
+
+    if(!bDryRun)
+    {
+        printf("Uniform charts: %i (%i blocks)\n", numUniformCharts, uniformBlocks.Length());
+    }
+}
+
+//
+// kexLightmapBuilder::ResetTextures
+//
+// Throws away all lightmap textures so the blocks can be packed again
+//
+
+void kexLightmapBuilder::ResetTextures(void)
+{
+    // dry runs don't make the pixels
+    for(int i = 0; i < numTextures; i++)
+    {
+        Mem_Free(allocBlocks[i]);
+    }
+
+    for(unsigned int i = 0; i < textures.Length(); i++)
+    {
+        Mem_Free(textures[i]);
+    }
+
+    if(allocBlocks != NULL)
+    {
+        Mem_Free(allocBlocks);
+    }
+
+    allocBlocks = NULL;
+    numTextures = 0;
+    textures.Empty();
+}
+
+//
+// kexLightmapBuilder::ChooseTextureSize
+//
+// Packs the traced blocks into every texture size that can hold
+// the biggest one and keeps the size that takes the least memory,
+// favoring fewer textures on ties. If maxTextures is set, sizes that
+// need more textures than that are only used if nothing else fits
+//
+
+void kexLightmapBuilder::ChooseTextureSize(void)
+{
+    int minSize = 1;
+    int bestSize = -1;
+    int bestCount = 0;
+    bool bBestFits = false;
+
+    for(int i = 0; i < numCharts; i++)
+    {
+        if(charts[i].texels == NULL)
+        {
+            continue;
+        }
+
+        minSize = MAX(minSize, charts[i].surfaces[0]->lightmapDims[0]);
+        minSize = MAX(minSize, charts[i].surfaces[0]->lightmapDims[1]);
+    }
+
+    minSize = MAX(kexMath::RoundPowerOfTwo(minSize), UNIFORM_BLOCK_SIZE);
+
+    for(int size = minSize; size <= LIGHTMAP_MAX_SIZE; size <<= 1)
+    {
+        bool bFits;
+
+        textureWidth = size;
+        textureHeight = size;
+
+        PackCharts(true);
+
+        bFits = (maxTextures <= 0 || numTextures <= maxTextures);
+        printf("%ix%i: %i textures (%ikb)\n", size, size, numTextures,
+               (int)(((int64_t)numTextures * size * size * 3) >> 10));
+
+        if(bestSize == -1 || (bFits && !bBestFits) ||
+           (bFits == bBestFits && (bFits ? (int64_t)numTextures * size * size <=
+                                           (int64_t)bestCount * bestSize * bestSize :
+                                   numTextures < bestCount)))
+        {
+            bestSize = size;
+            bestCount = numTextures;
+            bBestFits = bFits;
+        }
+
+        ResetTextures();
+    }
+
+    textureWidth = bestSize;
+    textureHeight = bestSize;
+
+    printf("Lightmap texture size: %ix%i\n", bestSize, bestSize);
+}
+
+//
+// kexLightmapBuilder::LightChart
+//
+
+void kexLightmapBuilder::LightChart(const int chartid)
+{
+    lightChart_t *chart;
+    kexLightTable *surfaceLights;
+    int *kernelFlags;
+    bool bResumed;
+    float remaining;
+
+    // TODO: this should NOT happen, but apparently, it can randomly occur
+    if(numCharts == 0)
+    {
+        return;
+    }
+
+    chart = &charts[chartid];
+    bResumed = (chartsResumed != NULL && chartsResumed[chartid]);
+
+    // the cache key and the trace both need the surfaces classified,
+    // which culls every light in the map, so it's only done once
+    surfaceLights = new kexLightTable[chart->numSurfaces];
+    kernelFlags = new int[chart->numSurfaces];
+
+    if(bResumed)
+    {
+        // it was lit before the last run stopped, but still belongs in the cache
+        if(cache != NULL)
+        {
+            uint64_t key;
+
+            ClassifyChart(chart, surfaceLights, kernelFlags);
+            key = CacheChartKey(chart, surfaceLights, kernelFlags);
+
+            lightmapWorker.LockMutex();
+            cache->AddChart(key, chart->texels, ChartSize(chart));
+            lightmapWorker.UnlockMutex();
+        }
+    }
+    else if(!chart->bUnlit)
+    {
+        ClassifyChart(chart, surfaceLights, kernelFlags);
+
+        if(cache == NULL)
+        {
+            TraceChart(chart, surfaceLights, kernelFlags);
+        }
+        else
+        {
+            uint64_t key = CacheChartKey(chart, surfaceLights, kernelFlags);
+
+            if(!RestoreChart(chart, key))
+            {
+                TraceChart(chart, surfaceLights, kernelFlags);
+
+                lightmapWorker.LockMutex();
+                cache->AddChart(key, chart->texels, ChartSize(chart));
+                cache->chartMisses++;
+                lightmapWorker.UnlockMutex();
+            }
+        }
+    }
+
+    delete[] surfaceLights;
+    delete[] kernelFlags;
+
+    lightmapWorker.LockMutex();
+
+    if(checkpoint != NULL && !bResumed && !chart->bUnlit)
+    {
+        checkpoint->AddChart(chartid, chart->texels, ChartSize(chart));
+    }
+
+    remaining = (float)numChartsDone / (float)numCharts;
+    numChartsDone++;
+
+    // LightJob prints the progress of both passes together
+    if(jobOrder == NULL)
+    {
+        printf("%i%c surfaces done\r", (int)(remaining * 100.0f), '%');
+    }
+
+    lightmapWorker.UnlockMutex();
+
+    if(checkpoint != NULL)
+    {
+        checkpoint->Flush(false);
+    }
+}
+
+//
+// kexLightmapBuilder::ChartSize
+//
+// Size of the chart's texels in bytes, or 0 if it came out black
+//
+
+int kexLightmapBuilder::ChartSize(const lightChart_t *chart)
+{
+    const surface_t *surface = chart->surfaces[0];
+
+    if(chart->texels == NULL)
+    {
+        return 0;
+    }
+
+    return (surface->lightmapDims[0] * surface->lightmapDims[1]) * 3;
+}
+
+//
+// kexLightmapBuilder::MeasureChart
+//
+// Lights the chart at the coarsest density and picks a finer one
+// the sharper the lighting changes between neighboring texels
+//
+
+void kexLightmapBuilder::MeasureChart(const int chartid)
+{
+    lightChart_t *chart = &charts[chartid];
+    kexVec3 (*colorSamples)[256];
+    byte (*coverage)[256];
+    kexLightTable *surfaceLights;
+    int *kernelFlags;
+    float gradient;
+    int width;
+    int height;
+    int chartSamples;
+    kexBBox bounds;
+
+    if(chart->bUnlit || chart->bFixedSamples)
+    {
+        return;
+    }
+
+    colorSamples = new kexVec3[256][256];
+    coverage = new byte[256][256];
+    surfaceLights = new kexLightTable[chart->numSurfaces];
+    kernelFlags = new int[chart->numSurfaces];
+
+    width = chart->surfaces[0]->lightmapDims[0];
+    height = chart->surfaces[0]->lightmapDims[1];
+
+    ClassifyChart(chart, surfaceLights, kernelFlags);
+    SampleChart(chart, surfaceLights, kernelFlags, colorSamples, coverage, false);
+
+    // smooth ramps are reconstructed fine by filtering, so only look at how
+    // far each texel is from the average of the neighbors on either side
+    gradient = 0;
+
+    for(int i = 0; i < height; i++)
+    {
+        for(int j = 0; j < width; j++)
+        {
+            if(!coverage[i][j])
+            {
+                continue;
+            }
+
+            for(int k = 0; k < 3; k++)
+            {
+                float c = colorSamples[i][j][k] * 2;
+
+                if(j > 0 && j + 1 < width && coverage[i][j-1] && coverage[i][j+1])
+                {
+                    gradient = MAX(gradient, kexMath::Fabs(colorSamples[i][j-1][k] +
+                                                           colorSamples[i][j+1][k] - c));
+                }
+
+                if(i > 0 && i + 1 < height && coverage[i-1][j] && coverage[i+1][j])
+                {
+                    gradient = MAX(gradient, kexMath::Fabs(colorSamples[i-1][j][k] +
+                                                           colorSamples[i+1][j][k] - c));
+                }
+            }
+        }
+    }
+
+    delete[] colorSamples;
+    delete[] coverage;
+    delete[] surfaceLights;
+    delete[] kernelFlags;
+
+    // every step halves the texel size. a surface that is too big for a
+    // texture on its own stays at the finest size that still fits, since
+    // anything finer would just be squashed back down
+    chartSamples = maxSamples;
+    bounds = GetChartBounds(chart);
+
+    while(gradient >= ADAPTIVE_GRADIENT_STEP && chartSamples > minSamples &&
+          ChartFitsTexture(chart->surfaces[0], bounds, chartSamples >> 1))
+    {
+        chartSamples >>= 1;
+        gradient -= ADAPTIVE_GRADIENT_STEP;
+    }
+
+    chart->samples = chartSamples;
+}
+
+//
+// kexLightmapBuilder::AdaptChartDensity
+//
+// Runs a coarse pass over every chart and then rebuilds
+// their lightmap blocks at the density they ended up with
+//
+
+void kexLightmapBuilder::AdaptChartDensity(void)
+{
+    int counts[8];
+
+    for(int i = 0; i < numCharts; i++)
+    {
+        if(charts[i].bUnlit || charts[i].bFixedSamples)
+        {
+            continue;
+        }
+
+        charts[i].samples = maxSamples;
+        BuildChartParams(&charts[i]);
+    }
+
+    lightmapWorker.RunThreads(numCharts, this, LightmapDensityWorkerFunc);
+
+    memset(counts, 0, sizeof(counts));
+
+    for(int i = 0; i < numCharts; i++)
+    {
+        int level = 0;
+
+        if(charts[i].bUnlit)
+        {
+            continue;
+        }
+
+        BuildChartParams(&charts[i]);
+
+        while((1 << level) < charts[i].samples && level < 7)
+        {
+            level++;
+        }
+
+        counts[level]++;
+    }
+
+    printf("Chart densities:");
+
+    for(int i = 0; i < 8; i++)
+    {
+        if(counts[i] != 0)
+        {
+            printf(" %i@%i", counts[i], 1 << i);
+        }
+    }
+
+    printf("\n");
+}
+
+//
+// kexLightmapBuilder::ChartFitsTexture
+//
+// Checks if a block covering the bounds would
+// fit in a lightmap texture without being scaled
+//
+
+bool kexLightmapBuilder::ChartFitsTexture(const surface_t *surface, const kexBBox &bounds,
+                                          const int chartSamples)
+{
+    kexVec3 roundedSize;
+
+    for(int i = 0; i < 3; i++)
+    {
+        roundedSize[i] = kexMath::Ceil(bounds.max[i] / chartSamples) -
+                         kexMath::Floor(bounds.min[i] / chartSamples) + 1;
+    }
+
+    switch(surface->plane.BestAxis())
+    {
+    case kexPlane::AXIS_YZ:
+        return roundedSize.y <= textureWidth && roundedSize.z <= textureHeight;
+
+    case kexPlane::AXIS_XZ:
+        return roundedSize.x <= textureWidth && roundedSize.z <= textureHeight;
+
+    default:
+        return roundedSize.x <= textureWidth && roundedSize.y <= textureHeight;
+    }
+}
+
+//
+// kexLightmapBuilder::FinestSamples
+//
+// The smallest sample size a chart rooted at this surface can be
+// given, either by its densitydef or by -adaptive
+//
+
+int kexLightmapBuilder::FinestSamples(const surface_t *surface)
+{
+    int fixedSamples = map->GetSurfaceSamples(surface);
+
+    if(fixedSamples > 0)
+    {
+        return fixedSamples;
+    }
+
+    return minSamples > 0 ? minSamples : samples;
+}
+
+//
+// kexLightmapBuilder::MergeCharts
+//
+// Joins the charts that the two surfaces belong to as long as
+// the result still fits in a lightmap texture. The chart is always
+// rooted at the lowest surface index so the order stays stable
+//
+
+void kexLightmapBuilder::MergeCharts(int *chartRoots, kexBBox *chartBounds, int s1, int s2)
+{
+    kexBBox bounds;
+
+    while(chartRoots[s1] != s1)
+    {
+        s1 = chartRoots[s1];
+    }
+
+    while(chartRoots[s2] != s2)
+    {
+        s2 = chartRoots[s2];
+    }
+
+    if(s1 == s2)
+    {
+        return;
+    }
+
+    if(s2 < s1)
+    {
+        int tmp = s1;
+        s1 = s2;
+        s2 = tmp;
+    }
+
+    bounds = chartBounds[s1];
+    bounds.AddPoint(chartBounds[s2].min);
+    bounds.AddPoint(chartBounds[s2].max);
+
+    // -adaptive or a densitydef can make the chart finer later on,
+    // so it has to fit at the finest density it can end up with
+    if(!ChartFitsTexture(surfaces[s1], bounds, FinestSamples(surfaces[s1])))
+    {
+        return;
+    }
+
+    chartRoots[s2] = s1;
+    chartBounds[s1] = bounds;
+}
+
+//
+// kexLightmapBuilder::MergeLeafCharts
+//
+// Floors and ceilings of neighboring subsectors in the same
+// sector lie on the same plane. Merge them across segs that
+// have a partner in the same sector, which covers both
+// minisegs and two sided lines inside of a sector
+//
+
+void kexLightmapBuilder::MergeLeafCharts(int *chartRoots, kexBBox *chartBounds)
+{
+    int *leafIndex[2];
+
+    leafIndex[0] = new int[map->numSSects];
+    leafIndex[1] = new int[map->numSSects];
+
+    for(int i = 0; i < map->numSSects; i++)
+    {
+        leafIndex[0][i] = -1;
+        leafIndex[1][i] = -1;
+    }
+
+    for(unsigned int i = 0; i < surfaces.Length(); i++)
+    {
+        if(surfaces[i]->type == ST_FLOOR)
+        {
+            leafIndex[0][surfaces[i]->typeIndex] = i;
+        }
+        else if(surfaces[i]->type == ST_CEILING)
+        {
+            leafIndex[1][surfaces[i]->typeIndex] = i;
+        }
+    }
+
+    for(int i = 0; i < map->numSSects; i++)
+    {
+        mapSubSector_t *ss = &map->mapSSects[i];
+        mapSector_t *sector = map->GetSectorFromSubSector(ss);
+
+        if(sector == NULL)
+        {
+            continue;
+        }
+
+        for(int j = 0; j < ss->numsegs; j++)
+        {
+            glSeg_t *seg = &map->mapSegs[ss->firstseg + j];
+            int other;
+
+            if(seg->partner == NO_LINE_INDEX || seg->partner >= map->numSegs)
+            {
+                continue;
+            }
+
+            other = map->segLeafLookup[seg->partner];
+
+            if(other <= i || map->GetSectorFromSubSector(&map->mapSSects[other]) != sector)
+            {
+                continue;
+            }
+
+            for(int k = 0; k < 2; k++)
+            {
+                if(leafIndex[k][i] != -1 && leafIndex[k][other] != -1)
+                {
+                    MergeCharts(chartRoots, chartBounds, leafIndex[k][i], leafIndex[k][other]);
+                }
+            }
+        }
+    }
+
+    delete[] leafIndex[0];
+    delete[] leafIndex[1];
+}
+
+//
+// kexLightmapBuilder::MergeSegCharts
+//
+// The node builder splits linedefs into many segs. Walls
+// built from the same side and part of a linedef that touch
+// end to end are merged back into one chart
+//
+
+void kexLightmapBuilder::MergeSegCharts(int *chartRoots, kexBBox *chartBounds)
+{
+    int numsurfs = surfaces.Length();
+    int numLists = map->numLines * 2 * 3;
+    int *lineHeads;
+    int *lineNext;
+
+    lineHeads = new int[numLists];
+    lineNext = new int[numsurfs];
+
+    for(int i = 0; i < numLists; i++)
+    {
+        lineHeads[i] = -1;
+    }
+
+    // link together the walls that belong to each linedef side and part
+    for(int i = numsurfs-1; i >= 0; i--)
+    {
+        surface_t *surf = surfaces[i];
+        glSeg_t *seg;
+        int list;
+
+        lineNext[i] = -1;
+
+        if(surf->type != ST_MIDDLESEG && surf->type != ST_UPPERSEG && surf->type != ST_LOWERSEG)
+        {
+            continue;
+        }
+
+        seg = (glSeg_t*)surf->data;
+
+        if(seg->linedef == NO_LINE_INDEX || seg->linedef >= map->numLines)
+        {
+            continue;
+        }
+
+        list = ((seg->linedef * 2) + (seg->side != 0)) * 3 + (surf->type - ST_MIDDLESEG);
+
+        lineNext[i] = lineHeads[list];
+        lineHeads[list] = i;
+    }
+
+    // linedefs are only split a few times so just check every pair
+    for(int i = 0; i < numLists; i++)
+    {
+        for(int s1 = lineHeads[i]; s1 != -1; s1 = lineNext[s1])
+        {
+            for(int s2 = lineNext[s1]; s2 != -1; s2 = lineNext[s2])
+            {
+                surface_t *surf1 = surfaces[s1];
+                surface_t *surf2 = surfaces[s2];
+
+                if(surf1->bSky != surf2->bSky)
+                {
+                    continue;
+                }
+
+                // segs are contiguous if one starts where the other ends
+                if(!(surf1->verts[1].x == surf2->verts[0].x && surf1->verts[1].y == surf2->verts[0].y) &&
+                   !(surf2->verts[1].x == surf1->verts[0].x && surf2->verts[1].y == surf1->verts[0].y))
+                {
+                    continue;
+                }
+
+                MergeCharts(chartRoots, chartBounds, s1, s2);
+            }
+        }
+    }
+
+    delete[] lineHeads;
+    delete[] lineNext;
+}
+
+//
+// kexLightmapBuilder::BuildCharts
+//
+// Groups surfaces that can share a lightmap block
+//
+
+void kexLightmapBuilder::BuildCharts(void)
+{
+    int numsurfs = surfaces.Length();
+    int *chartRoots;
+    int *chartIndex;
+    kexBBox *chartBounds;
+
+    chartRoots = new int[numsurfs];
+    chartIndex = new int[numsurfs];
+    chartBounds = new kexBBox[numsurfs];
+
+    for(int i = 0; i < numsurfs; i++)
+    {
+        chartRoots[i] = i;
+        chartBounds[i] = GetBoundsFromSurface(surfaces[i]);
+    }
+
+    MergeLeafCharts(chartRoots, chartBounds);
+    MergeSegCharts(chartRoots, chartBounds);
+
+    // count up the charts
+    numCharts = 0;
+
+    for(int i = 0; i < numsurfs; i++)
+    {
+        int root = i;
+
+        while(chartRoots[root] != root)
+        {
+            root = chartRoots[root];
+        }
+
+        chartRoots[i] = root;
+
+        if(root == i)
+        {
+            chartIndex[i] = numCharts++;
+        }
+    }
+
+    charts = (lightChart_t*)Mem_Calloc(sizeof(lightChart_t) * numCharts, hb_lightmap);
+
+    for(int i = 0; i < numsurfs; i++)
+    {
+        charts[chartIndex[chartRoots[i]]].numSurfaces++;
+    }
+
+    for(int i = 0; i < numCharts; i++)
+    {
+        charts[i].surfaces = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
+                             charts[i].numSurfaces, hb_lightmap);
+        charts[i].numSurfaces = 0;
+    }
+
+    // surfaces stay in the same order inside of the charts
+    for(int i = 0; i < numsurfs; i++)
+    {
+        lightChart_t *chart = &charts[chartIndex[chartRoots[i]]];
+        chart->surfaces[chart->numSurfaces++] = surfaces[i];
+    }
+
+    // the config can force a density for a sector or line
+    for(int i = 0; i < numCharts; i++)
+    {
+        int fixedSamples = map->GetSurfaceSamples(charts[i].surfaces[0]);
+
+        charts[i].samples = samples;
+        charts[i].bFixedSamples = false;
+
+        if(fixedSamples > 0)
+        {
+            charts[i].samples = fixedSamples;
+            charts[i].bFixedSamples = true;
+        }
+    }
+
+    delete[] chartRoots;
+    delete[] chartIndex;
+    delete[] chartBounds;
+
+    printf("Charts: %i (%i surfaces)\n", numCharts, numsurfs);
+}
+
+//
+// kexLightmapBuilder::GetChartBounds
+//
+
+kexBBox kexLightmapBuilder::GetChartBounds(const lightChart_t *chart)
+{
+    kexBBox bounds = GetBoundsFromSurface(chart->surfaces[0]);
+
+    for(int i = 1; i < chart->numSurfaces; i++)
+    {
+        kexBBox surfBounds = GetBoundsFromSurface(chart->surfaces[i]);
+
+        bounds.AddPoint(surfBounds.min);
+        bounds.AddPoint(surfBounds.max);
+    }
+
+    return bounds;
+}
+
+//
+// kexLightmapBuilder::BuildChartParams
+//
+// Sets up one lightmap block that covers every surface in
+// the chart and shares it with all of them
+//
+
+void kexLightmapBuilder::BuildChartParams(lightChart_t *chart)
+{
+    surface_t *surface = chart->surfaces[0];
+
+    BuildSurfaceParams(surface, GetChartBounds(chart), chart->samples);
+
+    for(int i = 1; i < chart->numSurfaces; i++)
+    {
+        surface_t *surf = chart->surfaces[i];
+
+        if(surf->lightmapCoords == NULL)
+        {
+            surf->lightmapCoords = (float*)Mem_Calloc(sizeof(float) *
+                                   surf->numVerts * 2, hb_map);
+        }
+
+        surf->textureCoords[0] = surface->textureCoords[0];
+        surf->textureCoords[1] = surface->textureCoords[1];
+        surf->bounds = surface->bounds;
+        surf->lightmapDims[0] = surface->lightmapDims[0];
+        surf->lightmapDims[1] = surface->lightmapDims[1];
+        surf->lightmapOrigin = surface->lightmapOrigin;
+        surf->lightmapSteps[0] = surface->lightmapSteps[0];
+        surf->lightmapSteps[1] = surface->lightmapSteps[1];
+    }
+}
+
+//
+// kexLightmapBuilder::SkipUnlitSurfaces
+//
+// Sets up the lightmap blocks for all charts and then looks
+// for ones that no light can reach. These would just end up
+// completely black, so they are never traced
+//
+
+void kexLightmapBuilder::SkipUnlitSurfaces(void)
+{
+    kexLightTable surfaceLights;
+
+    numUnlitSurfaces = 0;
+
+    for(int i = 0; i < numCharts; ++i)
+    {
+        lightChart_t *chart = &charts[i];
+
+        BuildChartParams(chart);
+
+        chart->bUnlit = true;
+
+        for(int j = 0; j < chart->numSurfaces; j++)
+        {
+            if(ClassifySurface(chart->surfaces[j], surfaceLights) != 0)
+            {
+                chart->bUnlit = false;
+                break;
+            }
+        }
+
+        if(!chart->bUnlit)
+        {
+            continue;
+        }
+
+        // SVE will ignore these surfaces
+        for(int j = 0; j < chart->numSurfaces; j++)
+        {
+            chart->surfaces[j]->lightmapNum = -1;
+        }
+
+        numUnlitSurfaces += chart->numSurfaces;
+    }
+
+    printf("Unlit surfaces skipped: %i/%i\n\n", numUnlitSurfaces, surfaces.Length());
+}
+
+//
+// kexLightmapBuilder::LightCellSun
+//
+// Traces the cell towards the sun and marks how it's shaded.
+// Returns true if the cell is fully exposed to sunlight
+//
+
+bool kexLightmapBuilder::LightCellSun(const int gridid, kexTrace &trace,
+                                      const kexVec3 &origin, const mapSubSector_t *sub)
+{
+    mapSector_t *mapSector;
+    bool bInSkySector;
+
+    mapSector = map->GetSectorFromSubSector(sub);
+    bInSkySector = map->bSkySectors[mapSector - map->mapSectors];
+
+    trace.Trace(origin, origin + (map->GetSunDirection() * 32768));
+
+    // did we traced a ceiling surface with a sky texture?
+    if(trace.fraction != 1 && trace.hitSurface != NULL)
+    {
+        if(trace.hitSurface->bSky && origin.z + gridSize[2] > mapSector->floorheight)
+        {
+            // this cell is inside a sector with a sky texture and is also exposed to sunlight.
+            // mark this cell as a sun type. cells of this type will simply sample the
             // sector's light level
             gridMap[gridid].sunShadow = 2;
-            return color;
+            return true;
+        }
+
+        // if this cell is inside a sector with a sky texture but is NOT exposed to sunlight, then
+        // mark this cell as a sun shade type. cells of this type will halve the sector's light level
+        if(bInSkySector)
+        {
+            gridMap[gridid].sunShadow = 1;
+        }
+    }
+    // if the cell is technically inside a sector with a sky but is not actually on an actual surface
+    // then this cell is considered occluded
+    else if(bInSkySector && !map->PointInsideSubSector(origin.x, origin.y, sub))
+    {
+        gridMap[gridid].sunShadow = 1;
+    }
+
+    return false;
+}
+
+//
+// kexLightmapBuilder::LightCellSample
+//
+// Traces a line from the cell's origin to the sunlight direction
+// and against all nearby thing lights. survivors has room for
+// every light in the map
+//
+
+template<int kernelFlags>
+kexVec3 kexLightmapBuilder::LightCellSample(const int gridid, kexTrace &trace,
+        const kexVec3 &origin, const mapSubSector_t *sub, int *survivors)
+{
+    kexVec3 color;
+    kexVec3 dir;
+    mapSector_t *mapSector;
+    float intensity;
+    float radius;
+    float dist;
+    float colorAdd;
+    thingLight_t *tl;
+    kexVec3 lightOrigin;
+    kexVec3 org;
+    int numSurvivors;
+
+    if(LightCellSun(gridid, trace, origin, sub))
+    {
+        color = map->GetSunColor();
+        return color;
+    }
+
+    mapSector = map->GetSectorFromSubSector(sub);
+
+    if(kernelFlags & LK_THINGLIGHTS)
+    {
+        numSurvivors = lightTable.CullCell(origin, survivors);
+    }
+    else
+    {
+        numSurvivors = 0;
+    }
+
+    // trace against all thing lights that are within range
+    for(int i = 0; i < numSurvivors; i++)
+    {
+        tl = lightTable.Light(survivors[i]);
+        lightOrigin = lightTable.CellOrigin(survivors[i]);
+
+        radius = tl->radius;
+        intensity = tl->intensity * 4;
+
+        if(intensity < 1.0f)
+        {
+            intensity = 1.0f;
+        }
+
+        trace.Trace(origin, lightOrigin);
+
+        if(trace.fraction != 1)
+        {
+            // something is occluding it
+            continue;
+        }
+
+        dir = (lightOrigin - origin);
+        dist = dir.Unit();
+
+        dir.Normalize();
+
+        colorAdd = (radius / (dist * dist)) * intensity;
+        kexMath::Clamp(colorAdd, 0, 1);
+
+        // accumulate results
+        color = color.Lerp(tl->rgb, colorAdd);
+        kexMath::Clamp(color, 0, 1);
+    }
+
+    if(!(kernelFlags & (LK_WALLLIGHTS|LK_FLATLIGHTS)))
+    {
+        return color;
+    }
+
+    org = origin;
+
+    // if the cell is sticking out from the ground then at least
+    // clamp the origin to the ground level so it can at least
+    // have a chance to be sampled by the light
+    if(origin.z + gridSize[2] > mapSector->floorheight)
+    {
+        org.z = (float)mapSector->floorheight + 2;
+    }
+
+    // trace against all light surfaces
+    for(int i = 0; i < lightTable.NumSurfaceLights(); ++i)
+    {
+        kexLightSurface *surfaceLight = lightTable.SurfaceLight(i);
+
+        if(TraceLightSurface<kernelFlags>(surfaceLight, map, trace, NULL, org, &dist))
+        {
+            dist = (dist * (surfaceLight->Intensity() * 0.5f)) * 0.5f;
+            kexMath::Clamp(dist, 0, 1);
+
+            // accumulate results
+            color = color.Lerp(surfaceLight->GetRGB(), dist);
+            kexMath::Clamp(color, 0, 1);
+        }
+    }
+
+    return color;
+}
+
+#define CELL_KERNEL(n)      &kexLightmapBuilder::LightCellSample<n>
+
+const kexLightmapBuilder::cellKernel_t kexLightmapBuilder::cellKernels[LK_NUMKERNELS] =
+{
+    CELL_KERNEL(0),  CELL_KERNEL(1),  CELL_KERNEL(2),  CELL_KERNEL(3),
+    CELL_KERNEL(4),  CELL_KERNEL(5),  CELL_KERNEL(6),  CELL_KERNEL(7),
+    CELL_KERNEL(8),  CELL_KERNEL(9),  CELL_KERNEL(10), CELL_KERNEL(11),
+    CELL_KERNEL(12), CELL_KERNEL(13), CELL_KERNEL(14), CELL_KERNEL(15),
+    CELL_KERNEL(16), CELL_KERNEL(17), CELL_KERNEL(18), CELL_KERNEL(19),
+    CELL_KERNEL(20), CELL_KERNEL(21), CELL_KERNEL(22), CELL_KERNEL(23),
+    CELL_KERNEL(24), CELL_KERNEL(25), CELL_KERNEL(26), CELL_KERNEL(27),
+    CELL_KERNEL(28), CELL_KERNEL(29), CELL_KERNEL(30), CELL_KERNEL(31),
+    CELL_KERNEL(32), CELL_KERNEL(33), CELL_KERNEL(34), CELL_KERNEL(35),
+    CELL_KERNEL(36), CELL_KERNEL(37), CELL_KERNEL(38), CELL_KERNEL(39),
+    CELL_KERNEL(40), CELL_KERNEL(41), CELL_KERNEL(42), CELL_KERNEL(43),
+    CELL_KERNEL(44), CELL_KERNEL(45), CELL_KERNEL(46), CELL_KERNEL(47),
+    CELL_KERNEL(48), CELL_KERNEL(49), CELL_KERNEL(50), CELL_KERNEL(51),
+    CELL_KERNEL(52), CELL_KERNEL(53), CELL_KERNEL(54), CELL_KERNEL(55),
+    CELL_KERNEL(56), CELL_KERNEL(57), CELL_KERNEL(58), CELL_KERNEL(59),
+    CELL_KERNEL(60), CELL_KERNEL(61), CELL_KERNEL(62), CELL_KERNEL(63)
+};
+
+#undef CELL_KERNEL
+
+//
+// kexLightmapBuilder::GatherCellTexels
+//
+// Filters the lightmap texels around the cell instead of tracing
+// the lights again. Sunlight is still traced since the cell needs to
+// know how it's shaded. This is an approximation: the texels hold the
+// light arriving at their surfaces, so a cell out in the open gets
+// the light of the floors, ceilings and walls near it rather than
+// the light passing through its own point
+//
+
+kexVec3 kexLightmapBuilder::GatherCellTexels(const int gridid, kexTrace &trace,
+        const kexVec3 &origin, const mapSubSector_t *sub)
+{
+    kexVec3 color;
+
+    if(LightCellSun(gridid, trace, origin, sub))
+    {
+        color = map->GetSunColor();
+        return color;
+    }
+
+    color = gridTexels[gridid].color / gridTexels[gridid].weight;
+    kexMath::Clamp(color, 0, 1);
+
+    return color;
+}
+
+//
+// kexLightmapBuilder::AddTexelsToGrid
+//
+// Spreads the traced texels of a surface over the eight grid cells
+// around each one, weighted by how close the texel is to each cell.
+// The sums are gathered into a buffer of the cells the surface can
+// reach first, so the worker mutex is only held to add them in
+//
+
+void kexLightmapBuilder::AddTexelsToGrid(const surface_t *surface, kexVec3 colorSamples[256][256],
+        byte coverage[256][256])
+{
+    gridTexel_t *texels;
+    kexVec3 normal;
+    kexVec3 pos;
+    float cellPos[3];
+    float frac[3];
+    int base[3];
+    int lo[3];
+    int hi[3];
+    int size[3];
+    int sampleWidth;
+    int sampleHeight;
+
+    normal = surface->plane.Normal();
+
+    sampleWidth = surface->lightmapDims[0];
+    sampleHeight = surface->lightmapDims[1];
+
+    for(int k = 0; k < 3; k++)
+    {
+        lo[k] = D_MAXINT;
+        hi[k] = -D_MAXINT;
+    }
+
+    // texel positions are linear across the block, so its
+    // corners bound the cells that any texel can reach
+    for(int c = 0; c < 4; c++)
+    {
+        pos = surface->lightmapOrigin + normal +
+              (surface->lightmapSteps[0] * (float)((c & 1) ? sampleWidth-1 : 0)) +
+              (surface->lightmapSteps[1] * (float)((c & 2) ? sampleHeight-1 : 0));
+
+        for(int k = 0; k < 3; k++)
+        {
+            int cell = (int)kexMath::Floor((pos[k] - worldGrid.min[k]) / gridSize[k]);
+
+            lo[k] = MIN(lo[k], cell);
+            hi[k] = MAX(hi[k], cell + 1);
+        }
+    }
+
+    for(int k = 0; k < 3; k++)
+    {
+        lo[k] = MAX(lo[k], 0);
+        hi[k] = MIN(hi[k], (int)gridBlock[k] - 1);
+
+        if(lo[k] > hi[k])
+        {
+            return;
+        }
+
+        size[k] = hi[k] - lo[k] + 1;
+    }
+
+    texels = new gridTexel_t[size[0] * size[1] * size[2]];
+
+    for(int i = 0; i < size[0] * size[1] * size[2]; i++)
+    {
+        texels[i].weight = 0;
+    }
+
+    for(int i = 0; i < sampleHeight; i++)
+    {
+        for(int j = 0; j < sampleWidth; j++)
+        {
+            if(!coverage[i][j])
+            {
+                continue;
+            }
+
+            pos = surface->lightmapOrigin + normal +
+                  (surface->lightmapSteps[0] * (float)j) +
+                  (surface->lightmapSteps[1] * (float)i);
+
+            for(int k = 0; k < 3; k++)
+            {
+                cellPos[k] = (pos[k] - worldGrid.min[k]) / gridSize[k];
+                base[k] = (int)kexMath::Floor(cellPos[k]);
+                frac[k] = cellPos[k] - (float)base[k];
+            }
+
+            // trilinear weights, so a texel counts fully for a cell it
+            // sits on and not at all a whole cell away from it
+            for(int n = 0; n < 8; n++)
+            {
+                float weight = 1;
+                int index = 0;
+                int k;
+
+                for(k = 2; k >= 0; k--)
+                {
+                    int bit = (n >> k) & 1;
+                    int cell = base[k] + bit;
+
+                    if(cell < lo[k] || cell > hi[k])
+                    {
+                        break;
+                    }
+
+                    weight *= bit ? frac[k] : 1 - frac[k];
+                    index = (index * size[k]) + (cell - lo[k]);
+                }
+
+                if(k >= 0 || weight <= 0)
+                {
+                    continue;
+                }
+
+                texels[index].color += colorSamples[i][j] * weight;
+                texels[index].weight += weight;
+            }
+        }
+    }
+
+    lightmapWorker.LockMutex();
+
+    for(int z = 0; z < size[2]; z++)
+    {
+        for(int y = 0; y < size[1]; y++)
+        {
+            for(int x = 0; x < size[0]; x++)
+            {
+                gridTexel_t *texel = &texels[(((z * size[1]) + y) * size[0]) + x];
+                int gridid;
+
+                if(texel->weight <= 0)
+                {
+                    continue;
+                }
+
+                gridid = (lo[0] + x) + ((lo[1] + y) * (int)gridBlock.x) +
+                         ((lo[2] + z) * (int)(gridBlock.x * gridBlock.y));
+
+                gridTexels[gridid].color += texel->color;
+                gridTexels[gridid].weight += texel->weight;
+            }
+        }
+    }
+
+    lightmapWorker.UnlockMutex();
+
+    delete[] texels;
+}
+
+//
+// kexLightmapBuilder::CellSurvivors
+//
+// Every thread culls the lights of its cells into its own buffer,
+// which is made the first time it lights a cell and has room for
+// every light in the map
+//
+
+int *kexLightmapBuilder::CellSurvivors(void)
+{
+    int slot = kexWorker::CurrentThread() + 1;
+
+    if(cellSurvivors[slot] == NULL)
+    {
+        lightmapWorker.LockMutex();
+        cellSurvivors[slot] = (int*)Mem_Malloc(sizeof(int) *
+                              (lightTable.NumLights() + LIGHT_BATCH_SIZE), hb_lightmap);
+        lightmapWorker.UnlockMutex();
+    }
+
+    return cellSurvivors[slot];
+}
+
+//
+// kexLightmapBuilder::LightGrid
+//
+
+void kexLightmapBuilder::LightGrid(const int gridid)
+{
+    float remaining;
+    int x, y, z;
+    int mod;
+    int secnum;
+    bool bInRange;
+    int gx = (int)gridBlock.x;
+    int gy = (int)gridBlock.y;
+    kexTrace trace;
+    mapSubSector_t *ss;
+    int *survivors = CellSurvivors();
+
+    // convert grid id to xyz coordinates
+    mod = gridid;
+    z = mod / (gx * gy);
+    mod -= z * (gx * gy);
+
+    y = mod / gx;
+    mod -= y * gx;
+
+    x = mod;
+
+    // get world-coordinates
+    kexVec3 org(worldGrid.min[0] + x * gridSize[0],
+                worldGrid.min[1] + y * gridSize[1],
+                worldGrid.min[2] + z * gridSize[2]);
+
+    if(cellsResumed != NULL && cellsResumed[gridid])
+    {
+        // it was lit before the last run stopped, but still belongs in the cache
+        if(cache != NULL && gridMap[gridid].marked)
+        {
+            uint64_t key = CacheCellKey(gridid, org, survivors);
+
+            lightmapWorker.LockMutex();
+            cache->AddCell(key, gridMap[gridid].color, gridMap[gridid].sunShadow);
+            lightmapWorker.UnlockMutex();
+        }
+
+        numCellsDone++;
+        return;
+    }
+
+    ss = NULL;
+    secnum = ((int)gridBlock.x * y) + x;
+
+    // determine what sector this cell is in
+    if(gridSectors[secnum] == NULL)
+    {
+        ss = map->PointInSubSector((int)org.x, (int)org.y);
+        gridSectors[secnum] = ss;
+    }
+    else
+    {
+        ss = gridSectors[secnum];
+    }
+
+    trace.Init(*map);
+    kexBBox bounds = gridBound + org;
+
+    bInRange = false;
+
+    // is this cell even inside the world?
+    for(int i = 0; i < map->numSSects; ++i)
+    {
+        if(bounds.IntersectingBox(map->ssLeafBounds[i]))
+        {
+            bInRange = true;
+            break;
+        }
+    }
+
+    numCellsDone++;
+
+    if(!bInRange)
+    {
+        // ignore if not in the world
+        if(checkpoint != NULL)
+        {
+            lightmapWorker.LockMutex();
+            checkpoint->AddCell(gridid, 0, 0, gridMap[gridid].color);
+            lightmapWorker.UnlockMutex();
+
+            checkpoint->Flush(false);
+        }
+        return;
+    }
+
+    // mark grid cell and accumulate color results
+    gridMap[gridid].marked = 1;
+    if(gridTexels != NULL && gridTexels[gridid].weight > 0)
+    {
+        gridMap[gridid].color += GatherCellTexels(gridid, trace, org, ss);
+
+        lightmapWorker.LockMutex();
+        numGatheredCells++;
+        lightmapWorker.UnlockMutex();
+    }
+    else if(cache != NULL)
+    {
+        uint64_t key = CacheCellKey(gridid, org, survivors);
+        kexVec3 color;
+        byte sunShadow;
+        bool bCached = cache->FindCell(key, color, &sunShadow);
+
+        if(bCached)
+        {
+            gridMap[gridid].sunShadow = sunShadow;
+        }
+        else
+        {
+            color = (this->*cellKernels[cellKernelFlags])(gridid, trace, org, ss, survivors);
+        }
+
+        gridMap[gridid].color += color;
+
+        lightmapWorker.LockMutex();
+        cache->AddCell(key, color, gridMap[gridid].sunShadow);
+
+        if(bCached)
+        {
+            cache->cellHits++;
+        }
+        else
+        {
+            cache->cellMisses++;
+        }
+        lightmapWorker.UnlockMutex();
+    }
+    else
+    {
+        gridMap[gridid].color += (this->*cellKernels[cellKernelFlags])(gridid, trace, org, ss, survivors);
+    }
+
+    kexMath::Clamp(gridMap[gridid].color, 0, 1);
+
+    lightmapWorker.LockMutex();
+
+    if(checkpoint != NULL)
+    {
+        checkpoint->AddCell(gridid, gridMap[gridid].marked, gridMap[gridid].sunShadow,
+                            gridMap[gridid].color);
+    }
+
+    remaining = (float)numCellsDone / (float)numLightGrids;
+
+    if(jobOrder == NULL)
+    {
+        printf("%i%c cells done\r", (int)(remaining * 100.0f), '%');
+    }
+
+    lightmapWorker.UnlockMutex();
+
+    if(checkpoint != NULL)
+    {
+        checkpoint->Flush(false);
+    }
+}
+
+//
+// kexLightmapBuilder::CacheMapKey
+//
+// Hashes everything that could change the lighting of any texel. Shadows
+// can be cast from anywhere, so this covers all of the level's geometry,
+// along with the sun and the options that change how surfaces are sampled
+//
+
+uint64_t kexLightmapBuilder::CacheMapKey(void)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    hash = kexLightCache::Hash(map->mapVerts, sizeof(mapVertex_t) * map->numVerts, hash);
+    hash = kexLightCache::Hash(map->mapLines, sizeof(mapLineDef_t) * map->numLines, hash);
+    hash = kexLightCache::Hash(map->mapSides, sizeof(mapSideDef_t) * map->numSides, hash);
+    hash = kexLightCache::Hash(map->mapSectors, sizeof(mapSector_t) * map->numSectors, hash);
+    hash = kexLightCache::Hash(map->mapSegs, sizeof(glSeg_t) * map->numSegs, hash);
+    hash = kexLightCache::Hash(map->mapSSects, sizeof(mapSubSector_t) * map->numSSects, hash);
+    hash = kexLightCache::Hash(map->nodes, sizeof(mapNode_t) * map->numNodes, hash);
+    hash = kexLightCache::Hash(map->vertexes, sizeof(vertex_t) * map->numVertexes, hash);
+    hash = kexLightCache::Hash(map->bSkySectors, sizeof(bool) * map->numSectors, hash);
+    hash = kexLightCache::Hash(map->bSSectsVisibleToSky, sizeof(bool) * map->numSSects, hash);
+
+    if(bUseReject && map->mapReject)
+    {
+        hash = kexLightCache::Hash(map->mapReject, map->rejectSize, hash);
+    }
+
+    hash = kexLightCache::HashVector(map->GetSunDirection(), hash);
+    hash = kexLightCache::HashVector(map->GetSunColor(), hash);
+
+    hash = kexLightCache::HashInt(samples, hash);
+    hash = kexLightCache::HashInt(minSamples, hash);
+    hash = kexLightCache::HashInt(maxSamples, hash);
+    hash = kexLightCache::HashInt(extraSamples, hash);
+    hash = kexLightCache::HashInt(textureWidth, hash);
+    hash = kexLightCache::HashInt(textureHeight, hash);
+    hash = kexLightCache::HashInt(bUseReject, hash);
+    hash = kexLightCache::HashInt(bSunClassify, hash);
+
+    return hash;
+}
+
+//
+// kexLightmapBuilder::CacheLightKey
+//
+
+uint64_t kexLightmapBuilder::CacheLightKey(const kexLightSurface *surfaceLight, const uint64_t hash)
+{
+    uint64_t h = hash;
+
+    h = kexLightCache::HashInt(surfaceLight->Surface()->type, h);
+    h = kexLightCache::HashInt(surfaceLight->Surface()->typeIndex, h);
+    h = kexLightCache::HashFloat(surfaceLight->OuterCone(), h);
+    h = kexLightCache::HashFloat(surfaceLight->InnerCone(), h);
+    h = kexLightCache::HashFloat(surfaceLight->FallOff(), h);
+    h = kexLightCache::HashFloat(surfaceLight->Distance(), h);
+    h = kexLightCache::HashFloat(surfaceLight->Intensity(), h);
+    h = kexLightCache::HashVector(surfaceLight->GetRGB(), h);
+    h = kexLightCache::HashInt(surfaceLight->NoCenterPoint(), h);
+
+    return h;
+}
+
+//
+// kexLightmapBuilder::CacheChartKey
+//
+// Hashes the chart's surfaces, its block and every light that
+// can reach it, in the order the texel kernels will see them.
+// The lights and flags are the ones ClassifyChart gave each surface
+//
+
+uint64_t kexLightmapBuilder::CacheChartKey(lightChart_t *chart, const kexLightTable *surfaceLights,
+                                           const int *kernelFlags)
+{
+    const surface_t *surface = chart->surfaces[0];
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    hash = kexLightCache::HashInt(chart->samples, hash);
+    hash = kexLightCache::HashInt(surface->lightmapDims[0], hash);
+    hash = kexLightCache::HashInt(surface->lightmapDims[1], hash);
+    hash = kexLightCache::HashVector(surface->lightmapOrigin, hash);
+    hash = kexLightCache::HashVector(surface->lightmapSteps[0], hash);
+    hash = kexLightCache::HashVector(surface->lightmapSteps[1], hash);
+
+    for(int i = 0; i < chart->numSurfaces; i++)
+    {
+        const kexLightTable &lights = surfaceLights[i];
+        surface_t *s = chart->surfaces[i];
+
+        hash = kexLightCache::HashInt(s->type, hash);
+        hash = kexLightCache::HashInt(s->typeIndex, hash);
+        hash = kexLightCache::Hash(s->verts, sizeof(kexVec3) * s->numVerts, hash);
+        hash = kexLightCache::HashInt(kernelFlags[i], hash);
+
+        for(int j = 0; j < lights.NumLights(); j++)
+        {
+            thingLight_t *tl = lights.Light(j);
+
+            hash = kexLightCache::HashVector(lights.Origin(j), hash);
+            hash = kexLightCache::HashVector(tl->rgb, hash);
+            hash = kexLightCache::HashFloat(tl->intensity, hash);
+            hash = kexLightCache::HashFloat(tl->falloff, hash);
+            hash = kexLightCache::HashFloat(tl->radius, hash);
+        }
+
+        for(int j = 0; j < lights.NumSurfaceLights(); j++)
+        {
+            hash = CacheLightKey(lights.SurfaceLight(j), hash);
+        }
+    }
+
+    return hash;
+}
+
+//
+// kexLightmapBuilder::CacheCellKey
+//
+
+uint64_t kexLightmapBuilder::CacheCellKey(const int gridid, const kexVec3 &origin, int *survivors)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    int numSurvivors;
+
+    hash = kexLightCache::HashInt(gridid, hash);
+    hash = kexLightCache::HashVector(origin, hash);
+    hash = kexLightCache::HashInt(cellKernelFlags, hash);
+
+    if(cellKernelFlags & LK_THINGLIGHTS)
+    {
+        numSurvivors = lightTable.CullCell(origin, survivors);
+
+        for(int i = 0; i < numSurvivors; i++)
+        {
+            thingLight_t *tl = lightTable.Light(survivors[i]);
+
+            hash = kexLightCache::HashVector(lightTable.CellOrigin(survivors[i]), hash);
+            hash = kexLightCache::HashVector(tl->rgb, hash);
+            hash = kexLightCache::HashFloat(tl->intensity, hash);
+            hash = kexLightCache::HashFloat(tl->radius, hash);
+        }
+    }
+
+    if(cellKernelFlags & (LK_WALLLIGHTS|LK_FLATLIGHTS))
+    {
+        hash ^= cacheSurfaceLightsKey;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+//
+// kexLightmapBuilder::RestoreChart
+//
+// Takes the chart's texels from the cache. Returns false if
+// the chart has to be traced
+//
+
+bool kexLightmapBuilder::RestoreChart(lightChart_t *chart, const uint64_t key)
+{
+    const surface_t *surface = chart->surfaces[0];
+    const byte *cached;
+    int size;
+
+    if(!(cached = cache->FindChart(key, &size)))
+    {
+        return false;
+    }
+
+    if(size != 0 && size != (surface->lightmapDims[0] * surface->lightmapDims[1]) * 3)
+    {
+        return false;
+    }
+
+    lightmapWorker.LockMutex();
+
+    if(size == 0)
+    {
+        for(int i = 0; i < chart->numSurfaces; i++)
+        {
+            chart->surfaces[i]->lightmapNum = -1;
+        }
+    }
+    else
+    {
+        chart->texels = (byte*)Mem_Malloc(size, hb_lightmap);
+        memcpy(chart->texels, cached, size);
+    }
+
+    cache->AddChart(key, chart->texels, size);
+    cache->chartHits++;
+    lightmapWorker.UnlockMutex();
+
+    return true;
+}
+
+//
+// kexLightmapBuilder::CreateLightmaps
+//
+
+void kexLightmapBuilder::CreateLightmaps(kexDoomMap &doomMap)
+{
+    map = &doomMap;
+    map->BuildTraceData();
+
+    lightTable.Build(doomMap);
+
+    // grid cells aren't culled against the lights ahead of time
+    // so they all share the same kernel
+    cellKernelFlags = 0;
+
+    if(lightTable.NumLights() > 0)
+    {
+        cellKernelFlags |= LK_THINGLIGHTS;
+    }
+
+    if(lightTable.NumWallLights() > 0)
+    {
+        cellKernelFlags |= LK_WALLLIGHTS;
+    }
+
+    if(lightTable.NumFlatLights() > 0)
+    {
+        cellKernelFlags |= LK_FLATLIGHTS;
+    }
+
+    AllocateLightGrid();
+
+    if(cacheFile.Length() > 0)
+    {
+        // cached charts have no samples left to build the grid from
+        if(bGridFromTexels)
+        {
+            printf("Warning: -cache can't be used with -gridfromtexels\n");
+        }
+        else
+        {
+            cache = new kexLightCache;
+            cacheSurfaceLightsKey = FNV_OFFSET_BASIS;
+
+            for(int i = 0; i < lightTable.NumSurfaceLights(); i++)
+            {
+                cacheSurfaceLightsKey = CacheLightKey(lightTable.SurfaceLight(i), cacheSurfaceLightsKey);
+            }
+
+            if(cache->Load(cacheFile, CacheMapKey()))
+            {
+                printf("Using cache %s\n\n", cacheFile.c_str());
+            }
+        }
+    }
+
+    if(workerAddress.Length() > 0)
+    {
+        // the coordinator packs and writes everything
+        ServeLightmaps();
+        lightmapWorker.Destroy();
+        map->FreeTraceData();
+        return;
+    }
+
+    printf("------------- Building charts -------------\n");
+    PrepareCharts();
+
+    // the checkpoint is keyed off the charts, so they have to be built first
+    if(checkpointFile.Length() > 0)
+    {
+        OpenCheckpoint();
+    }
+
+    if(coordinatorAddress.Length() > 0)
+    {
+        DistributeLightmaps();
+    }
+    else
+    {
+        // the grid can only gather from the texels once they've been traced
+        if(bGridFromTexels)
+        {
+            printf("------------- Tracing surfaces -------------\n");
+            lightmapWorker.RunThreads(numCharts, this, LightmapWorkerFunc);
+        }
+        else
+        {
+            printf("------------- Tracing surfaces and light grid -------------\n");
+            LightSurfacesAndGrid();
+        }
+    }
+
+    if(checkpoint != NULL)
+    {
+        CloseCheckpoint();
+    }
+
+    if(cache != NULL)
+    {
+        printf("\nCache: %i of %i surface blocks and %i of %i grid cells reused\n",
+               cache->chartHits, cache->chartHits + cache->chartMisses,
+               cache->cellHits, cache->cellHits + cache->cellMisses);
+
+        // the cache points at the texels of the charts, so save it while they are still around
+        if(!cache->Save(cacheFile))
+        {
+            printf("Warning: couldn't write %s\n", cacheFile.c_str());
+        }
+
+        delete cache;
+        cache = NULL;
+    }
+
+    if(bPackWhileTracing)
+    {
+        FinishPacking(false);
+    }
+    else
+    {
+        if(bAutoTextureSize)
+        {
+            ChooseTextureSize();
         }
 
-        // if this cell is inside a sector with a sky texture but is NOT exposed to sunlight, then
-        // mark this cell as a sun shade type. cells of this type will halve the sector's light level
-        if(bInSkySector)
+        PackCharts(false);
+    }
+
+    if(bCompressTextures)
+    {
+        CompressTextures();
+    }
+
+    if(bSunClassify)
+    {
+        printf("Surfaces with uniform sunlight: %i\n", numSunClassified);
+        printf("Texels lit without tracing the sun: %i\n", sunlitTexels);
+    }
+
+    printf("Texels traced: %i\n\n", tracedTexels);
+
+    if(bGridFromTexels)
+    {
+        printf("------------- Building light grid -------------\n");
+        CreateLightGrid();
+        printf("Cells gathered from texels: %i\n\n", numGatheredCells);
+    }
+
+    lightmapWorker.Destroy();
+    map->FreeTraceData();
+}
+
+//
+// kexLightmapBuilder::CompressTexture
+//
+// Compresses a lightmap texture and decodes it back
+// to measure how much the compression changed it
+//
+
+void kexLightmapBuilder::CompressTexture(const int texid)
+{
+    int size = (textureWidth * textureHeight) * 3;
+    byte *decoded = new byte[size];
+    double error = 0;
+
+    Compress_EncodeBC1(textures[texid], textureWidth, textureHeight, compressedTextures[texid]);
+    Compress_DecodeBC1(compressedTextures[texid], textureWidth, textureHeight, decoded);
+
+    for(int i = 0; i < size; i++)
+    {
+        int d = decoded[i] - textures[texid][i];
+        error += d * d;
+    }
+
+    delete[] decoded;
+
+    lightmapWorker.LockMutex();
+    compressionError += error;
+    lightmapWorker.UnlockMutex();
+}
+
+//
+// kexLightmapBuilder::CompressTextures
+//
+
+void kexLightmapBuilder::CompressTextures(void)
+{
+    int size;
+
+    if(textureWidth < BC1_BLOCK_SIZE || textureHeight < BC1_BLOCK_SIZE)
+    {
+        printf("Lightmaps are too small to compress\n");
+        bCompressTextures = false;
+        return;
+    }
+
+    size = Compress_BC1Size(textureWidth, textureHeight);
+
+    for(unsigned int i = 0; i < textures.Length(); i++)
+    {
+        compressedTextures.Push((byte*)Mem_Malloc(size, hb_lightmap));
+    }
+
+    compressionError = 0;
+
+    lightmapWorker.RunThreads(textures.Length(), this, LightmapCompressWorkerFunc);
+
+    if(textures.Length() != 0)
+    {
+        printf("Compressed lightmaps: %ikb -> %ikb (rms error %.2f)\n",
+               (((textureWidth * textureHeight) * 3 * textures.Length()) >> 10),
+               ((size * textures.Length()) >> 10),
+               kexMath::Sqrt((float)(compressionError / ((textureWidth * textureHeight) * 3 * textures.Length()))));
+    }
+}
+
+//
+// kexLightmapBuilder::AllocateLightGrid
+//
+
+void kexLightmapBuilder::AllocateLightGrid(void)
+{
+    int count;
+    int numNodes;
+    kexVec3 mins, maxs;
+
+    // get the bounding box of the root BSP node
+    numNodes = map->numNodes-1;
+    if(numNodes < 0)
+    {
+        numNodes = 0;
+    }
+
+    worldGrid = map->nodeBounds[numNodes];
+
+    // determine the size of the grid block
+    for(int i = 0; i < 3; ++i)
+    {
+        mins[i] = gridSize[i] * kexMath::Ceil(worldGrid.min[i] / gridSize[i]);
+        maxs[i] = gridSize[i] * kexMath::Floor(worldGrid.max[i] / gridSize[i]);
+        gridBlock[i] = (maxs[i] - mins[i]) / gridSize[i] + 1;
+    }
+
+    worldGrid.min = mins;
+    worldGrid.max = maxs;
+
+    gridBound.min = -(gridSize * 0.5f);
+    gridBound.max = (gridSize * 0.5f);
+
+    // get the total number of grid cells
+    count = (int)(gridBlock.x * gridBlock.y * gridBlock.z);
+    numLightGrids = count;
+
+    // allocate data
+    gridMap = (gridMap_t*)Mem_Calloc(sizeof(gridMap_t) * count, hb_lightmap);
+    gridSectors = (mapSubSector_t**)Mem_Calloc(sizeof(mapSubSector_t*) *
+                  (int)(gridBlock.x * gridBlock.y), hb_lightmap);
+
+    if(bGridFromTexels)
+    {
+        gridTexels = (gridTexel_t*)Mem_Calloc(sizeof(gridTexel_t) * count, hb_lightmap);
+    }
+}
+
+//
+// kexLightmapBuilder::PrepareCharts
+//
+// Groups the surfaces into charts and picks their density. Workers
+// do this on their own, so it has to come out the same every time
+//
+
+void kexLightmapBuilder::PrepareCharts(void)
+{
+    BuildCharts();
+    SkipUnlitSurfaces();
+
+    if(minSamples > 0)
+    {
+        AdaptChartDensity();
+    }
+}
+
+//
+// kexLightmapBuilder::OpenCheckpoint
+//
+// Takes back everything that was lit before the last run stopped
+// and starts writing out whatever gets lit from here on
+//
+
+void kexLightmapBuilder::OpenCheckpoint(void)
+{
+    int numResumedCharts = 0;
+    int numResumedCells = 0;
+
+    checkpoint = new kexCheckpoint;
+
+    if(!checkpoint->Open(checkpointFile, JobKey()))
+    {
+        printf("Warning: couldn't write %s\n\n", checkpointFile.c_str());
+        delete checkpoint;
+        checkpoint = NULL;
+        return;
+    }
+
+    chartsResumed = new bool[numCharts];
+    cellsResumed = new bool[numLightGrids];
+
+    memset(chartsResumed, 0, sizeof(bool) * numCharts);
+    memset(cellsResumed, 0, sizeof(bool) * numLightGrids);
+
+    for(int i = 0; i < checkpoint->NumRecords(); i++)
+    {
+        const checkpointRecord_t &record = checkpoint->Record(i);
+
+        if(record.type == CR_CHART && record.index >= 0 && record.index < numCharts)
         {
-            gridMap[gridid].sunShadow = 1;
+            lightChart_t *chart = &charts[record.index];
+            const surface_t *surface = chart->surfaces[0];
+
+            if(chartsResumed[record.index] || chart->bUnlit ||
+               (record.size != 0 && record.size != (surface->lightmapDims[0] * surface->lightmapDims[1]) * 3))
+            {
+                continue;
+            }
+
+            if(record.size == 0)
+            {
+                for(int j = 0; j < chart->numSurfaces; j++)
+                {
+                    chart->surfaces[j]->lightmapNum = -1;
+                }
+            }
+            else
+            {
+                chart->texels = (byte*)Mem_Malloc(record.size, hb_lightmap);
+                memcpy(chart->texels, record.data, record.size);
+            }
+
+            chartsResumed[record.index] = true;
+            numResumedCharts++;
+        }
+        else if(record.type == CR_CELL && record.index >= 0 && record.index < numLightGrids &&
+                record.size == 14)
+        {
+            gridMap_t *cell = &gridMap[record.index];
+
+            cell->marked = record.data[0];
+            cell->sunShadow = record.data[1];
+            memcpy(&cell->color.x, &record.data[2], sizeof(float));
+            memcpy(&cell->color.y, &record.data[6], sizeof(float));
+            memcpy(&cell->color.z, &record.data[10], sizeof(float));
+
+            if(!cellsResumed[record.index])
+            {
+                cellsResumed[record.index] = true;
+                numResumedCells++;
+            }
         }
     }
-    // if the cell is technically inside a sector with a sky but is not actually on an actual surface
-    // then this cell is considered occluded
-    else if(bInSkySector && !map->PointInsideSubSector(origin.x, origin.y, sub))
+
+    checkpoint->FreeRecords();
+
+    if(numResumedCharts > 0 || numResumedCells > 0)
     {
-        gridMap[gridid].sunShadow = 1;
+        printf("Resuming from %s: %i surface blocks and %i of %i grid cells already lit\n\n",
+               checkpointFile.c_str(), numResumedCharts, numResumedCells, numLightGrids);
+    }
+}
+
+//
+// kexLightmapBuilder::CloseCheckpoint
+//
+
+void kexLightmapBuilder::CloseCheckpoint(void)
+{
+    checkpoint->Close();
+    delete checkpoint;
+    checkpoint = NULL;
+
+    delete[] chartsResumed;
+    delete[] cellsResumed;
+
+    chartsResumed = NULL;
+    cellsResumed = NULL;
+}
+
+//
+// kexLightmapBuilder::JobResumed
+//
+// Returns true if there's nothing left to light in the job
+//
+
+bool kexLightmapBuilder::JobResumed(const int pass, const int first, const int count)
+{
+    for(int i = first; i < first + count; i++)
+    {
+        if(pass == DP_GRID)
+        {
+            if(cellsResumed == NULL || !cellsResumed[i])
+            {
+                return false;
+            }
+        }
+        else if(!charts[i].bUnlit && (chartsResumed == NULL || !chartsResumed[i]))
+        {
+            return false;
+        }
     }
 
-    // trace against all thing lights
+    return true;
+}
+
+//
+// kexLightmapBuilder::JobKey
+//
+// Hashes everything a worker needs to agree on with the coordinator
+// for their results to be interchangeable. The charts have to be
+// built before this is called
+//
+
+uint64_t kexLightmapBuilder::JobKey(void)
+{
+    uint64_t hash = CacheMapKey();
+
     for(unsigned int i = 0; i < map->thingLights.Length(); i++)
     {
-        tl = map->thingLights[i];
+        thingLight_t *tl = map->thingLights[i];
+
+        hash = kexLightCache::Hash(&tl->origin, sizeof(kexVec2), hash);
+        hash = kexLightCache::HashVector(tl->rgb, hash);
+        hash = kexLightCache::HashFloat(tl->intensity, hash);
+        hash = kexLightCache::HashFloat(tl->falloff, hash);
+        hash = kexLightCache::HashFloat(tl->height, hash);
+        hash = kexLightCache::HashFloat(tl->radius, hash);
+        hash = kexLightCache::HashInt(tl->bCeiling, hash);
+    }
+
+    for(int i = 0; i < lightTable.NumSurfaceLights(); i++)
+    {
+        hash = CacheLightKey(lightTable.SurfaceLight(i), hash);
+    }
+
+    hash = kexLightCache::HashInt(cellKernelFlags, hash);
+    hash = kexLightCache::HashInt(numLightGrids, hash);
+    hash = kexLightCache::HashInt(numCharts, hash);
+
+    for(int i = 0; i < numCharts; i++)
+    {
+        const surface_t *surface = charts[i].surfaces[0];
+
+        hash = kexLightCache::HashInt(charts[i].numSurfaces, hash);
+        hash = kexLightCache::HashInt(charts[i].samples, hash);
+        hash = kexLightCache::HashInt(charts[i].bUnlit, hash);
+        hash = kexLightCache::HashInt(surface->lightmapDims[0], hash);
+        hash = kexLightCache::HashInt(surface->lightmapDims[1], hash);
+    }
+
+    return hash;
+}
+
+//
+// kexLightmapBuilder::RunJob
+//
+// Lights count grid cells or charts starting at first
+//
+
+void kexLightmapBuilder::RunJob(const int pass, const int first, const int count)
+{
+    jobFirst = first;
+
+    lightmapWorker.RunThreads(count, this, pass == DP_GRID ? LightGridJobWorkerFunc : LightmapJobWorkerFunc);
+}
+
+//
+// kexLightmapBuilder::SendJobResults
+//
+// Sends what RunJob lit back to the coordinator in one go. A chart
+// is sent as its size in bytes followed by its texels, where -1 means
+// it was skipped as unlit and 0 means it came out black. The texels
+// aren't needed here once they are sent
+//
+
+bool kexLightmapBuilder::SendJobResults(kexSocket &socket, const int pass, const int first,
+                                        const int count)
+{
+    int header[6];
+    int size = 0;
+    byte *buffer;
+    byte *out;
+    bool bSent;
+
+    header[0] = pass;
+    header[1] = first;
+    header[2] = count;
+    header[3] = tracedTexels;
+    header[4] = numSunClassified;
+    header[5] = sunlitTexels;
+
+    // only report what was lit since the last job
+    tracedTexels = 0;
+    numSunClassified = 0;
+    sunlitTexels = 0;
+
+    if(pass == DP_GRID)
+    {
+        size = count * (2 + sizeof(float) * 3);
+    }
+    else
+    {
+        for(int i = first; i < first + count; i++)
+        {
+            const surface_t *surface = charts[i].surfaces[0];
+
+            size += sizeof(int);
+
+            if(charts[i].texels != NULL)
+            {
+                size += (surface->lightmapDims[0] * surface->lightmapDims[1]) * 3;
+            }
+        }
+    }
+
+    buffer = new byte[sizeof(header) + size];
+    memcpy(buffer, header, sizeof(header));
+    out = buffer + sizeof(header);
+
+    for(int i = first; i < first + count; i++)
+    {
+        if(pass == DP_GRID)
+        {
+            *out++ = gridMap[i].marked;
+            *out++ = gridMap[i].sunShadow;
+
+            for(int j = 0; j < 3; j++)
+            {
+                memcpy(out, &gridMap[i].color[j], sizeof(float));
+                out += sizeof(float);
+            }
+        }
+        else
+        {
+            const surface_t *surface = charts[i].surfaces[0];
+            int chartSize = 0;
+
+            if(charts[i].bUnlit)
+            {
+                chartSize = -1;
+            }
+            else if(charts[i].texels != NULL)
+            {
+                chartSize = (surface->lightmapDims[0] * surface->lightmapDims[1]) * 3;
+            }
+
+            memcpy(out, &chartSize, sizeof(int));
+            out += sizeof(int);
+
+            if(chartSize > 0)
+            {
+                memcpy(out, charts[i].texels, chartSize);
+                out += chartSize;
+
+                Mem_Free(charts[i].texels);
+                charts[i].texels = NULL;
+            }
+        }
+    }
+
+    bSent = socket.Send(buffer, sizeof(header) + size);
+    delete[] buffer;
+
+    return bSent;
+}
+
+//
+// kexLightmapBuilder::ReceiveJobResults
+//
+// Reads back what a worker lit for the job. The results of a job that
+// already came back from another worker are read and thrown away.
+// Returns false if the worker hung up or sent something that doesn't
+// match the job
+//
+
+bool kexLightmapBuilder::ReceiveJobResults(kexSocket &socket, const int pass, const int first,
+        const int count, const bool bApply)
+{
+    int header[6];
+
+    if(!socket.Recv(header, sizeof(header)))
+    {
+        return false;
+    }
 
-        lightOrigin.Set(tl->origin.x,
-                        tl->origin.y,
-                        !tl->bCeiling ?
-                        (float)tl->sector->floorheight + 16 :
-                        (float)tl->sector->ceilingheight - 16);
+    if(header[0] != pass || header[1] != first || header[2] != count)
+    {
+        return false;
+    }
 
-        radius = tl->radius;
-        intensity = tl->intensity * 4;
+    if(pass == DP_GRID)
+    {
+        int cellSize = 2 + sizeof(float) * 3;
+        byte *buffer = new byte[count * cellSize];
+        byte *in = buffer;
 
-        if(intensity < 1.0f)
+        if(!socket.Recv(buffer, count * cellSize))
         {
-            intensity = 1.0f;
+            delete[] buffer;
+            return false;
         }
 
-        if(origin.DistanceSq(lightOrigin) > (radius*radius))
+        for(int i = first; i < first + count && bApply; i++)
         {
-            // not within range
-            continue;
-        }
+            gridMap[i].marked = *in++;
+            gridMap[i].sunShadow = *in++;
 
-        trace.Trace(origin, lightOrigin);
+            for(int j = 0; j < 3; j++)
+            {
+                memcpy(&gridMap[i].color[j], in, sizeof(float));
+                in += sizeof(float);
+            }
 
-        if(trace.fraction != 1)
-        {
-            // something is occluding it
-            continue;
+            if(checkpoint != NULL)
+            {
+                checkpoint->AddCell(i, gridMap[i].marked, gridMap[i].sunShadow, gridMap[i].color);
+            }
         }
 
-        dir = (lightOrigin - origin);
-        dist = dir.Unit();
+        delete[] buffer;
+    }
+    else
+    {
+        for(int i = first; i < first + count; i++)
+        {
+            const surface_t *surface = charts[i].surfaces[0];
+            int expected = (surface->lightmapDims[0] * surface->lightmapDims[1]) * 3;
+            int chartSize;
+            byte *texels;
 
-        dir.Normalize();
+            if(!socket.Recv32(&chartSize))
+            {
+                return false;
+            }
 
-        colorAdd = (radius / (dist * dist)) * intensity;
-        kexMath::Clamp(colorAdd, 0, 1);
+            if(chartSize == -1 || chartSize == 0)
+            {
+                if((chartSize == -1) != charts[i].bUnlit)
+                {
+                    return false;
+                }
 
-        // accumulate results
-        color = color.Lerp(tl->rgb, colorAdd);
-        kexMath::Clamp(color, 0, 1);
-    }
+                if(chartSize == 0 && bApply)
+                {
+                    for(int j = 0; j < charts[i].numSurfaces; j++)
+                    {
+                        charts[i].surfaces[j]->lightmapNum = -1;
+                    }
+
+                    if(checkpoint != NULL)
+                    {
+                        checkpoint->AddChart(i, NULL, 0);
+                    }
+                }
 
-    org = origin;
+                continue;
+            }
 
-    // if the cell is sticking out from the ground then at least
-    // clamp the origin to the ground level so it can at least
-    // have a chance to be sampled by the light
-    if(origin.z + gridSize[2] > mapSector->floorheight)
-    {
-        org.z = (float)mapSector->floorheight + 2;
+            if(chartSize != expected || charts[i].bUnlit)
+            {
+                return false;
+            }
+
+            texels = bApply ? (byte*)Mem_Malloc(chartSize, hb_lightmap) : new byte[chartSize];
+
+            if(!socket.Recv(texels, chartSize))
+            {
+                if(bApply)
+                {
+                    Mem_Free(texels);
+                }
+                else
+                {
+                    delete[] texels;
+                }
+
+                return false;
+            }
+
+            if(bApply)
+            {
+                charts[i].texels = texels;
+
+                if(checkpoint != NULL)
+                {
+                    checkpoint->AddChart(i, texels, chartSize);
+                }
+            }
+            else
+            {
+                delete[] texels;
+            }
+        }
     }
 
-    // trace against all light surfaces
-    for(unsigned int i = 0; i < map->lightSurfaces.Length(); ++i)
+    if(bApply)
     {
-        kexLightSurface *surfaceLight = map->lightSurfaces[i];
+        tracedTexels += header[3];
+        numSunClassified += header[4];
+        sunlitTexels += header[5];
 
-        if(surfaceLight->TraceSurface(map, trace, NULL, org, &dist))
+        if(checkpoint != NULL)
         {
-            dist = (dist * (surfaceLight->Intensity() * 0.5f)) * 0.5f;
-            kexMath::Clamp(dist, 0, 1);
-
-            // accumulate results
-            color = color.Lerp(surfaceLight->GetRGB(), dist);
-            kexMath::Clamp(color, 0, 1);
+            checkpoint->Flush(false);
         }
+
+        PrintJobProgress(pass, count);
     }
 
-    return color;
+    return true;
 }
 
 //
-// kexLightmapBuilder::LightGrid
+// kexLightmapBuilder::PrintJobProgress
 //
 
-void kexLightmapBuilder::LightGrid(const int gridid)
+void kexLightmapBuilder::PrintJobProgress(const int pass, const int count)
 {
-    static int processed = 0;
-    float remaining;
-    int x, y, z;
-    int mod;
-    int secnum;
-    bool bInRange;
-    int gx = (int)gridBlock.x;
-    int gy = (int)gridBlock.y;
-    kexTrace trace;
-    mapSubSector_t *ss;
-
-    // convert grid id to xyz coordinates
-    mod = gridid;
-    z = mod / (gx * gy);
-    mod -= z * (gx * gy);
-
-    y = mod / gx;
-    mod -= y * gx;
-
-    x = mod;
-
-    // get world-coordinates
-    kexVec3 org(worldGrid.min[0] + x * gridSize[0],
-                worldGrid.min[1] + y * gridSize[1],
-                worldGrid.min[2] + z * gridSize[2]);
-
-    ss = NULL;
-    secnum = ((int)gridBlock.x * y) + x;
-
-    // determine what sector this cell is in
-    if(gridSectors[secnum] == NULL)
+    if(pass == DP_GRID)
     {
-        ss = map->PointInSubSector((int)org.x, (int)org.y);
-        gridSectors[secnum] = ss;
+        numCellsDone += count;
+        printf("%i%c cells done\r", (int)(((float)numCellsDone / (float)numLightGrids) * 100.0f), '%');
     }
     else
     {
-        ss = gridSectors[secnum];
+        numChartsDone += count;
+        printf("%i%c surfaces done\r", (int)(((float)numChartsDone / (float)numCharts) * 100.0f), '%');
     }
+}
 
-    trace.Init(*map);
-    kexBBox bounds = gridBound + org;
+//
+// kexLightmapBuilder::DistributeLightmaps
+//
+// Hands the grid cells and then the charts out to worker processes.
+// The charts have to be built first so the workers can check they
+// came out the same on their end
+//
 
-    bInRange = false;
+void kexLightmapBuilder::DistributeLightmaps(void)
+{
+    kexCoordinator coordinator(*this);
 
-    // is this cell even inside the world?
-    for(int i = 0; i < map->numSSects; ++i)
-    {
-        if(bounds.IntersectingBox(map->ssLeafBounds[i]))
-        {
-            bInRange = true;
-            break;
-        }
-    }
+    coordinator.Start(coordinatorAddress, map->GetMapNum(), JobKey());
 
-    processed++;
+    printf("------------- Building light grid -------------\n");
+    coordinator.RunPass(DP_GRID, numLightGrids, DISTRIBUTE_CELLS_PER_JOB);
+    printf("\nGrid cells: %i\n\n", numLightGrids);
 
-    if(!bInRange)
-    {
-        // ignore if not in the world
-        return;
-    }
+    printf("------------- Tracing surfaces -------------\n");
+    coordinator.RunPass(DP_CHARTS, numCharts, DISTRIBUTE_CHARTS_PER_JOB);
+    printf("\n");
 
-    // mark grid cell and accumulate color results
-    gridMap[gridid].marked = 1;
-    gridMap[gridid].color += LightCellSample(gridid, trace, org, ss);
+    coordinator.Finish();
+}
 
-    kexMath::Clamp(gridMap[gridid].color, 0, 1);
+//
+// kexLightmapBuilder::ServeLightmaps
+//
+// Lights whatever the coordinator sends for this map
+//
 
-    lightmapWorker.LockMutex();
-    remaining = (float)processed / (float)numLightGrids;
+void kexLightmapBuilder::ServeLightmaps(void)
+{
+    kexDistributedWorker worker(*this);
 
-    printf("%i%c cells done\r", (int)(remaining * 100.0f), '%');
-    lightmapWorker.UnlockMutex();
+    printf("------------- Building charts -------------\n");
+    PrepareCharts();
+
+    tracedTexels = 0;
+    numSunClassified = 0;
+    sunlitTexels = 0;
+
+    worker.Serve(workerAddress, map->GetMapNum(), JobKey());
 }
 
 //
-// kexLightmapBuilder::CreateLightmaps
+// kexLightmapBuilder::LightSurfacesAndGrid
+//
+// Lights the charts and grid cells in a single pass so threads that
+// run out of one never sit idle waiting on the other. The charts are
+// spread evenly through the queue with cells in between, so the jobs
+// left over at the end are the cheap ones. Charts are packed as soon
+// as every chart before them is done, and the grid lump is put
+// together as soon as the last cell is
 //
 
-void kexLightmapBuilder::CreateLightmaps(kexDoomMap &doomMap)
+void kexLightmapBuilder::LightSurfacesAndGrid(void)
 {
-    map = &doomMap;
+    int numJobs = numCharts + numLightGrids;
+    int nextChart = 0;
 
-    printf("------------- Building light grid -------------\n");
-    CreateLightGrid();
+    jobOrder = new int[numJobs];
+    chartsLit = new bool[numCharts];
+    numCellsLit = 0;
 
-    printf("------------- Tracing surfaces -------------\n");
-    lightmapWorker.RunThreads(surfaces.Length(), this, LightmapWorkerFunc);
+    memset(chartsLit, 0, sizeof(bool) * numCharts);
 
-    while(!lightmapWorker.FinishedAllJobs())
+    for(int i = 0; i < numJobs; i++)
     {
-        Delay(1000);
+        if(nextChart < numCharts && i == (int)(((int64_t)nextChart * numJobs) / numCharts))
+        {
+            jobOrder[i] = nextChart++;
+        }
+        else
+        {
+            jobOrder[i] = numCharts + (i - nextChart);
+        }
     }
 
-    printf("Texels traced: %i\n\n", tracedTexels);
-    lightmapWorker.Destroy();
+    // the texture size can't be picked until every chart is done
+    bPackWhileTracing = !bAutoTextureSize;
+
+    if(bPackWhileTracing)
+    {
+        BeginPacking();
+    }
+
+    lightmapWorker.RunThreads(numJobs, this, LightmapPassWorkerFunc);
+
+    delete[] jobOrder;
+    delete[] chartsLit;
+
+    jobOrder = NULL;
+    chartsLit = NULL;
+
+    printf("\nGrid cells: %i\n\n", numLightGrids);
 }
 
 //
-// kexLightmapBuilder::CreateLightGrid
+// kexLightmapBuilder::LightJob
 //
 
-void kexLightmapBuilder::CreateLightGrid(void)
+void kexLightmapBuilder::LightJob(const int jobid)
 {
-    int count;
-    int numNodes;
-    kexVec3 mins, maxs;
+    int id = jobOrder[jobid];
 
-    // get the bounding box of the root BSP node
-    numNodes = map->numNodes-1;
-    if(numNodes < 0)
+    if(id < numCharts)
     {
-        numNodes = 0;
-    }
+        LightChart(id);
 
-    worldGrid = map->nodeBounds[numNodes];
+        lightmapWorker.LockMutex();
+        chartsLit[id] = true;
 
-    // determine the size of the grid block
-    for(int i = 0; i < 3; ++i)
-    {
-        mins[i] = gridSize[i] * kexMath::Ceil(worldGrid.min[i] / gridSize[i]);
-        maxs[i] = gridSize[i] * kexMath::Floor(worldGrid.max[i] / gridSize[i]);
-        gridBlock[i] = (maxs[i] - mins[i]) / gridSize[i] + 1;
+        // another thread may already be packing, and it
+        // picks up this chart if it's next in line
+        if(bPackWhileTracing && !bPacking)
+        {
+            PackLitCharts();
+        }
     }
+    else
+    {
+        LightGrid(id - numCharts);
 
-    worldGrid.min = mins;
-    worldGrid.max = maxs;
+        lightmapWorker.LockMutex();
 
-    gridBound.min = -(gridSize * 0.5f);
-    gridBound.max = (gridSize * 0.5f);
+        if(++numCellsLit == numLightGrids)
+        {
+            BuildLightGridLump();
+        }
+    }
 
-    // get the total number of grid cells
-    count = (int)(gridBlock.x * gridBlock.y * gridBlock.z);
-    numLightGrids = count;
+    printf("%i%c surfaces done, %i%c cells done\r",
+           numCharts > 0 ? (numChartsDone * 100) / numCharts : 100, '%',
+           numLightGrids > 0 ? (numCellsLit * 100) / numLightGrids : 100, '%');
 
-    // allocate data
-    gridMap = (gridMap_t*)Mem_Calloc(sizeof(gridMap_t) * count, hb_static);
-    gridSectors = (mapSubSector_t**)Mem_Calloc(sizeof(mapSubSector_t*) *
-                  (int)(gridBlock.x * gridBlock.y), hb_static);
+    lightmapWorker.UnlockMutex();
+}
 
-    // process all grid cells
-    lightmapWorker.RunThreads(count, this, LightGridWorkerFunc);
+//
+// kexLightmapBuilder::CreateLightGrid
+//
 
-    while(!lightmapWorker.FinishedAllJobs())
-    {
-        Delay(1000);
-    }
+void kexLightmapBuilder::CreateLightGrid(void)
+{
+    // process all grid cells
+    lightmapWorker.RunThreads(numLightGrids, this, LightGridWorkerFunc);
 
-    printf("\nGrid cells: %i\n\n", count);
+    printf("\nGrid cells: %i\n\n", numLightGrids);
 }
 
 //
-// kexLightmapBuilder::AddLightGridLump
+// kexLightmapBuilder::BuildLightGridLump
 //
 
-void kexLightmapBuilder::AddLightGridLump(kexWadFile &wadFile)
+void kexLightmapBuilder::BuildLightGridLump(void)
 {
     kexBinFile lumpFile;
     int lumpSize = 0;
@@ -949,9 +4125,7 @@ void kexLightmapBuilder::AddLightGridLump(kexWadFile &wadFile)
         }
     }
 
-    lumpSize += 512; // add some extra slop
-
-    data = (byte*)Mem_Calloc(lumpSize, hb_static);
+    data = (byte*)Mem_Calloc(lumpSize, hb_lumps);
     lumpFile.SetBuffer(data);
 
     lumpFile.Write32(numLightGrids);
@@ -1034,7 +4208,22 @@ void kexLightmapBuilder::AddLightGridLump(kexWadFile &wadFile)
     }
 #endif
 
-    wadFile.AddLump("LM_CELLS", lumpFile.BufferAt() - lumpFile.Buffer(), data);
+    gridLump = data;
+    gridLumpSize = lumpFile.BufferAt() - lumpFile.Buffer();
+}
+
+//
+// kexLightmapBuilder::AddLightGridLump
+//
+
+void kexLightmapBuilder::AddLightGridLump(kexWadFile &wadFile)
+{
+    if(gridLump == NULL)
+    {
+        BuildLightGridLump();
+    }
+
+    wadFile.AddLump("LM_CELLS", gridLumpSize, gridLump);
 }
 
 //
@@ -1050,20 +4239,24 @@ void kexLightmapBuilder::AddLightmapLumps(kexWadFile &wadFile)
     int size;
     int j;
     int coordOffsets;
+    int texSize;
     kexBinFile lumpFile;
 
-    // try to guess the actual lump size
-    lumpSize += ((textureWidth * textureHeight) * 3) * textures.Length();
-    lumpSize += (12 * surfaces.Length());
+    // work out the exact size of every lump up front
+    texSize = bCompressTextures ? Compress_BC1Size(textureWidth, textureHeight) :
+                                  (textureWidth * textureHeight) * 3;
+
     lumpSize += sizeof(kexVec3);
-    lumpSize += 2048; // add some extra slop
+    lumpSize += lumpVersion >= 2 ? (20 * surfaces.Length()) + 16 : 12 * surfaces.Length();
+    lumpSize += bCompressTextures ? 16 : 12;
+    lumpSize += texSize * textures.Length();
 
     for(i = 0; i < surfaces.Length(); i++)
     {
-        lumpSize += (surfaces[i]->numVerts * 2) * sizeof(float);
+        lumpSize += (surfaces[i]->numVerts * 2) * (bQuantizeUV ? sizeof(word) : sizeof(float));
     }
 
-    data = (byte*)Mem_Calloc(lumpSize, hb_static);
+    data = (byte*)Mem_Calloc(lumpSize, hb_lumps);
     lumpFile.SetBuffer(data);
 
     lumpFile.WriteVector(map->GetSunDirection());
@@ -1076,20 +4269,51 @@ void kexLightmapBuilder::AddLightmapLumps(kexWadFile &wadFile)
     size = 0;
 
     // begin writing LM_SURFS lump
+    if(lumpVersion >= 2)
+    {
+        lumpFile.Write32(LMSURFS_ID);
+        lumpFile.Write32(lumpVersion);
+        lumpFile.Write32(surfaces.Length());
+        lumpFile.Write32(bQuantizeUV ? LMF_QUANTIZEDUV : 0);
+
+        size += 16;
+    }
+
+    if(lumpVersion < 2 && (surfaces.Length() > 0x7FFF || textures.Length() > 0x7FFF))
+    {
+        printf("Warning: too many surfaces or lightmaps for 16-bit indices. Use -lmversion 2\n");
+    }
+
     for(i = 0; i < surfaces.Length(); i++)
     {
-        lumpFile.Write16(surfaces[i]->type);
-        lumpFile.Write16(surfaces[i]->typeIndex);
-        lumpFile.Write16(surfaces[i]->lightmapNum);
-        lumpFile.Write16(surfaces[i]->numVerts * 2);
-        lumpFile.Write32(coordOffsets);
+        if(lumpVersion >= 2)
+        {
+            lumpFile.Write32(surfaces[i]->type);
+            lumpFile.Write32(surfaces[i]->typeIndex);
+            lumpFile.Write32(surfaces[i]->lightmapNum);
+            lumpFile.Write32(surfaces[i]->numVerts * 2);
+            lumpFile.Write32(coordOffsets);
+
+            size += 20;
+        }
+        else
+        {
+            lumpFile.Write16(surfaces[i]->type);
+            lumpFile.Write16(surfaces[i]->typeIndex);
+            lumpFile.Write16(surfaces[i]->lightmapNum);
+            lumpFile.Write16(surfaces[i]->numVerts * 2);
+            lumpFile.Write32(coordOffsets);
+
+            size += 12;
+        }
 
-        size += 12;
         coordOffsets += (surfaces[i]->numVerts * 2);
     }
 
     offs = lumpFile.BufferAt() - lumpFile.Buffer();
-    wadFile.AddLump("LM_SURFS", size, data);
+    // version 1 lumps have always been written from the start of the buffer,
+    // so they begin with the sun vector. keep it that way for old engines
+    wadFile.AddLump("LM_SURFS", size, lumpVersion >= 2 ? surfs : data);
     txcrd = data + offs;
 
     size = 0;
@@ -1099,6 +4323,16 @@ void kexLightmapBuilder::AddLightmapLumps(kexWadFile &wadFile)
     {
         for(j = 0; j < surfaces[i]->numVerts * 2; j++)
         {
+            if(bQuantizeUV)
+            {
+                // 0 to 65535 maps to 0 to 1 across the lightmap texture
+                float coord = MAX(MIN(surfaces[i]->lightmapCoords[j], 1.0f), 0.0f);
+
+                lumpFile.Write16((word)(coord * 65535.0f + 0.5f));
+                size += 2;
+                continue;
+            }
+
             lumpFile.WriteFloat(surfaces[i]->lightmapCoords[j]);
             size += 4;
         }
@@ -1109,22 +4343,27 @@ void kexLightmapBuilder::AddLightmapLumps(kexWadFile &wadFile)
     lmaps = txcrd + offs;
 
     // begin writing LM_LMAPS lump
+    size = 0;
+
+    if(bCompressTextures)
+    {
+        lumpFile.Write32(LMAPS_BC1_ID);
+        size += 4;
+    }
+
     lumpFile.Write32(textures.Length());
     lumpFile.Write32(textureWidth);
     lumpFile.Write32(textureHeight);
 
-    size = 12;
+    size += 12;
 
     for(i = 0; i < textures.Length(); i++)
     {
-        for(j = 0; j < (textureWidth * textureHeight) * 3; j++)
-        {
-            lumpFile.Write8(textures[i][j]);
-            size++;
-        }
+        lumpFile.WriteBytes(bCompressTextures ? compressedTextures[i] : textures[i], texSize);
+        size += texSize;
     }
 
-    offs = (lumpFile.BufferAt() - lumpFile.Buffer()) - offs;
+    assert(lumpFile.BufferAt() - lumpFile.Buffer() == lumpSize);
     wadFile.AddLump("LM_LMAPS", size, lmaps);
 }
 
@@ -1132,13 +4371,28 @@ void kexLightmapBuilder::AddLightmapLumps(kexWadFile &wadFile)
 // kexLightmapBuilder::WriteTexturesToTGA
 //
 
-void kexLightmapBuilder::WriteTexturesToTGA(void)
+void kexLightmapBuilder::WriteTexturesToTGA(const char *name)
 {
     kexBinFile file;
+    byte *texture = NULL;
+
+    // show what the engine will actually get
+    if(bCompressTextures)
+    {
+        texture = new byte[(textureWidth * textureHeight) * 3];
+    }
 
     for(unsigned int i = 0; i < textures.Length(); i++)
     {
-        file.Create(Va("lightmap_%02d.tga", i));
+        byte *pixels = textures[i];
+
+        if(bCompressTextures)
+        {
+            Compress_DecodeBC1(compressedTextures[i], textureWidth, textureHeight, texture);
+            pixels = texture;
+        }
+
+        file.Create(Va("%s_%02d.tga", name, i));
         file.Write16(0);
         file.Write16(2);
         file.Write16(0);
@@ -1151,12 +4405,14 @@ void kexLightmapBuilder::WriteTexturesToTGA(void)
 
         for(int j = 0; j < (textureWidth * textureHeight) * 3; j += 3)
         {
-            file.Write8(textures[i][j+2]);
-            file.Write8(textures[i][j+1]);
-            file.Write8(textures[i][j+0]);
+            file.Write8(pixels[j+2]);
+            file.Write8(pixels[j+1]);
+            file.Write8(pixels[j+0]);
         }
         file.Close();
     }
+
+    delete[] texture;
 }
 
 //
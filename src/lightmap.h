@@ -26,10 +26,49 @@
 #define __LIGHTMAP_H__
 
 #include "surfaces.h"
+#include "lightTable.h"
+#include "worker.h"
 
 #define LIGHTMAP_MAX_SIZE  1024
 
+// biggest block that a single chart can be traced into
+#define LIGHTMAP_MAX_BLOCK  256
+
+// features that a lighting kernel is compiled for. surfaces and
+// grid cells are routed to the kernel that matches the lights
+// that can actually reach them
+typedef enum
+{
+    LK_THINGLIGHTS      = BIT(0),
+    LK_FALLOFF          = BIT(1),
+    LK_SUN              = BIT(2),
+    LK_WALLLIGHTS       = BIT(3),
+    LK_FLATLIGHTS       = BIT(4),
+    LK_SUNLIT           = BIT(5),
+    LK_NUMKERNELS       = BIT(6)
+} lightKernelFlags_t;
+
+// flags in the header of version 2 LM_SURFS lumps
+typedef enum
+{
+    LMF_QUANTIZEDUV     = BIT(0)
+} lightmapLumpFlags_t;
+
 class kexTrace;
+class kexLightCache;
+class kexCheckpoint;
+class kexSocket;
+
+// a group of coplanar surfaces that share one lightmap block
+typedef struct
+{
+    surface_t               **surfaces;
+    int                     numSurfaces;
+    int                     samples;
+    bool                    bFixedSamples;
+    bool                    bUnlit;
+    byte                    *texels;
+} lightChart_t;
 
 class kexLightmapBuilder
 {
@@ -37,35 +76,146 @@ public:
     kexLightmapBuilder(void);
     ~kexLightmapBuilder(void);
 
-    void                    BuildSurfaceParams(surface_t *surface);
-    void                    TraceSurface(surface_t *surface);
+    void                    BuildSurfaceParams(surface_t *surface, kexBBox bounds, const int samples);
+    void                    BuildCharts(void);
+    void                    BuildChartParams(lightChart_t *chart);
+    void                    TraceChart(lightChart_t *chart, kexLightTable *surfaceLights,
+                                       int *kernelFlags);
+    void                    AdaptChartDensity(void);
+    void                    PackCharts(const bool bDryRun);
+    void                    BeginPacking(void);
+    void                    PackChart(const int chartid, const bool bDryRun);
+    void                    PackLitCharts(void);
+    void                    FinishPacking(const bool bDryRun);
+    void                    ChooseTextureSize(void);
+    void                    CompressTextures(void);
+    void                    CompressTexture(const int texid);
     void                    CreateLightGrid(void);
+    void                    CopySettings(const kexLightmapBuilder &builder);
     void                    CreateLightmaps(kexDoomMap &doomMap);
-    void                    LightSurface(const int surfid);
+    void                    LightChart(const int chartid);
+    void                    MeasureChart(const int chartid);
+    void                    SkipUnlitSurfaces(void);
     void                    LightGrid(const int gridid);
-    void                    WriteTexturesToTGA(void);
+    void                    LightJob(const int jobid);
+    void                    WriteTexturesToTGA(const char *name = "lightmap");
     void                    AddLightGridLump(kexWadFile &wadFile);
     void                    AddLightmapLumps(kexWadFile &wadFile);
+    uint64_t                JobKey(void);
+    void                    RunJob(const int pass, const int first, const int count);
+    bool                    SendJobResults(kexSocket &socket, const int pass, const int first, const int count);
+    bool                    ReceiveJobResults(kexSocket &socket, const int pass, const int first, const int count,
+                                              const bool bApply);
+    bool                    JobResumed(const int pass, const int first, const int count);
+
+    const int               JobFirst(void) const { return jobFirst; }
+    const int               NumCharts(void) const { return numCharts; }
+    const int               NumLightGrids(void) const { return numLightGrids; }
 
     int                     samples;
+    int                     minSamples;
+    int                     maxSamples;
     float                   ambience;
     int                     textureWidth;
     int                     textureHeight;
+    bool                    bAutoTextureSize;
+    int                     maxTextures;
+    bool                    bCompressTextures;
+    int                     lumpVersion;
+    bool                    bQuantizeUV;
+    bool                    bUseReject;
+    bool                    bSunClassify;
+    bool                    bGridFromTexels;
+    kexStr                  cacheFile;
+    kexStr                  checkpointFile;
+    kexStr                  coordinatorAddress;
+    kexStr                  workerAddress;
 
     static const kexVec3    gridSize;
 
 private:
-    void                    NewTexture(void);
+    void                    NewTexture(const bool bDryRun);
+    void                    ResetTextures(void);
     bool                    MakeRoomForBlock(const int width, const int height, int *x, int *y, int *num);
+    void                    PlaceBlock(const int width, const int height, int *x, int *y, int *num,
+                                       const bool bDryRun);
+    void                    SetChartCoords(lightChart_t *chart, const int num, const int x, const int y,
+                                           const bool bUniform);
+    bool                    IsUniformChart(const lightChart_t *chart, byte *rgb);
     kexBBox                 GetBoundsFromSurface(const surface_t *surface);
-    kexVec3                 LightTexelSample(kexTrace &trace, const kexVec3 &origin, surface_t *surface);
-    kexVec3                 LightCellSample(const int gridid, kexTrace &trace,
-                                            const kexVec3 &origin, const mapSubSector_t *sub);
+    int                     ClassifySurface(surface_t *surface, kexLightTable &surfaceLights);
+    int                     ClassifySunlight(kexTrace &trace, const lightChart_t *chart,
+                                             const int *kernelFlags, byte coverage[256][256],
+                                             short owners[256][256]);
+    template<int kernelFlags>
+    kexVec3                 LightTexelSample(kexTrace &trace, const kexVec3 &origin, surface_t *surface,
+                                             const kexLightTable &surfaceLights, int *survivors);
+    template<int kernelFlags>
+    kexVec3                 LightCellSample(const int gridid, kexTrace &trace, const kexVec3 &origin,
+                                            const mapSubSector_t *sub, int *survivors);
+    bool                    LightCellSun(const int gridid, kexTrace &trace,
+                                         const kexVec3 &origin, const mapSubSector_t *sub);
+    kexVec3                 GatherCellTexels(const int gridid, kexTrace &trace,
+                                             const kexVec3 &origin, const mapSubSector_t *sub);
+    void                    AddTexelsToGrid(const surface_t *surface, kexVec3 colorSamples[256][256],
+                                            byte coverage[256][256]);
+    void                    ClassifyChart(lightChart_t *chart, kexLightTable *surfaceLights,
+                                          int *kernelFlags);
+    bool                    SampleChart(lightChart_t *chart, kexLightTable *surfaceLights,
+                                        int *kernelFlags, kexVec3 colorSamples[256][256],
+                                        byte coverage[256][256], const bool bClassifySun);
+    int                     RasterizeSurface(const surface_t *surface, short owners[256][256],
+                                             const short owner, const float border, const bool bOverwrite);
+    void                    BuildCoverageMask(const lightChart_t *chart, byte coverage[256][256],
+                                              short owners[256][256]);
+    bool                    ChartFitsTexture(const surface_t *surface, const kexBBox &bounds,
+                                             const int chartSamples);
+    int                     FinestSamples(const surface_t *surface);
+    kexBBox                 GetChartBounds(const lightChart_t *chart);
+    void                    MergeCharts(int *chartRoots, kexBBox *chartBounds, int s1, int s2);
+    void                    MergeLeafCharts(int *chartRoots, kexBBox *chartBounds);
+    void                    MergeSegCharts(int *chartRoots, kexBBox *chartBounds);
+    void                    DilateSamples(const surface_t *surface, kexVec3 colorSamples[256][256],
+                                          byte coverage[256][256]);
+    void                    AllocateLightGrid(void);
+    void                    LightSurfacesAndGrid(void);
+    void                    BuildLightGridLump(void);
+    void                    PrepareCharts(void);
+    void                    OpenCheckpoint(void);
+    void                    CloseCheckpoint(void);
+    int                     ChartSize(const lightChart_t *chart);
+    void                    DistributeLightmaps(void);
+    void                    ServeLightmaps(void);
+    void                    PrintJobProgress(const int pass, const int count);
+    uint64_t                CacheMapKey(void);
+    uint64_t                CacheLightKey(const kexLightSurface *surfaceLight, const uint64_t hash);
+    uint64_t                CacheChartKey(lightChart_t *chart, const kexLightTable *surfaceLights,
+                                          const int *kernelFlags);
+    uint64_t                CacheCellKey(const int gridid, const kexVec3 &origin, int *survivors);
+    int                     *CellSurvivors(void);
+    bool                    RestoreChart(lightChart_t *chart, const uint64_t key);
     bool                    EmitFromCeiling(kexTrace &trace, const surface_t *surface, const kexVec3 &origin,
                                             const kexVec3 &normal, float *dist);
     void                    ExportTexelsToObjFile(FILE *f, const kexVec3 &org, int indices);
     void                    WriteBlock(FILE *f, const int i, const kexVec3 &org, int indices, kexBBox &box);
 
+    typedef kexVec3         (kexLightmapBuilder::*texelKernel_t)(kexTrace&, const kexVec3&, surface_t*,
+            const kexLightTable&, int*);
+    typedef kexVec3         (kexLightmapBuilder::*cellKernel_t)(const int, kexTrace&, const kexVec3&,
+            const mapSubSector_t*, int*);
+
+    static const texelKernel_t  texelKernels[LK_NUMKERNELS];
+    static const cellKernel_t   cellKernels[LK_NUMKERNELS];
+
+    typedef struct
+    {
+        byte                rgb[3];
+        int                 lightmapNum;
+        int                 x;
+        int                 y;
+        int                 next;
+    } uniformBlock_t;
+
     typedef struct
     {
         byte                marked;
@@ -73,18 +223,57 @@ private:
         kexVec3             color;
     } gridMap_t;
 
+    typedef struct
+    {
+        kexVec3             color;
+        float               weight;
+    } gridTexel_t;
+
     kexDoomMap              *map;
+    kexLightTable           lightTable;
+    kexLightCache           *cache;
+    uint64_t                cacheSurfaceLightsKey;
+    kexCheckpoint           *checkpoint;
+    bool                    *chartsResumed;
+    bool                    *cellsResumed;
+    int                     cellKernelFlags;
     kexArray<byte*>         textures;
+    kexArray<byte*>         compressedTextures;
+    double                  compressionError;
     int                     **allocBlocks;
     int                     numTextures;
     int                     extraSamples;
     int                     tracedTexels;
+    int                     sunlitTexels;
+    int                     numUnlitSurfaces;
+    int                     numSunClassified;
+    lightChart_t            *charts;
+    int                     numCharts;
+    int                     numChartsDone;
     int                     numLightGrids;
+    int                     numCellsDone;
+    int                     jobFirst;
+    int                     *jobOrder;
+    bool                    *chartsLit;
+    int                     numCellsLit;
+    int                     *uniformHash;
+    kexArray<uniformBlock_t> uniformBlocks;
+    int                     numUniformCharts;
+    int                     numChartsPacked;
+    bool                    bPacking;
+    bool                    bPackWhileTracing;
+    byte                    *gridLump;
+    int                     gridLumpSize;
     gridMap_t               *gridMap;
+    gridTexel_t             *gridTexels;
+    int                     numGatheredCells;
+    int                     *cellSurvivors[MAX_THREADS+1];
     mapSubSector_t          **gridSectors;
     kexBBox                 worldGrid;
     kexBBox                 gridBound;
     kexVec3                 gridBlock;
 };
 
+extern kexHeapBlock hb_lightmap;
+
 #endif
@@ -34,6 +34,27 @@
 #include "trace.h"
 #include "lightmap.h"
 #include "worker.h"
+#include "geometryCache.h"
+
+#ifndef KEX_WIN32
+#include <sys/time.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// how often -watch checks the config and wad for changes
+#define WATCH_POLL_MS       500
+// how long a changed file has to stay the same before it is read
+#define WATCH_SETTLE_MS     250
+
+typedef struct
+{
+    bool        bExists;
+    int64_t     mtime;
+    int64_t     mtimeNano;
+    int64_t     size;
+    int64_t     inode;
+} fileStamp_t;
 
 static kexStr basePath;
 
@@ -101,6 +122,25 @@ const int64_t GetSeconds(void)
     return time(0);
 }
 
+//
+// GetMilliseconds
+//
+
+#ifndef KEX_WIN32
+const int64_t GetMilliseconds(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (int64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+#else
+const int64_t GetMilliseconds(void)
+{
+    return (int64_t)GetTickCount();
+}
+#endif
+
 //
 // FilePath
 //
@@ -110,6 +150,435 @@ const kexStr &FilePath(void)
     return basePath;
 }
 
+//
+// ParseMapList
+//
+// Reads a comma separated list of map numbers and ranges (e.g. 1,4-6)
+//
+
+static void ParseMapList(const char *list, kexArray<int> &maps)
+{
+    const char *str = list;
+
+    while(*str)
+    {
+        int first = atoi(str);
+        int last = first;
+
+        while(*str && *str != ',' && *str != '-')
+        {
+            str++;
+        }
+
+        if(*str == '-')
+        {
+            last = atoi(++str);
+
+            while(*str && *str != ',')
+            {
+                str++;
+            }
+        }
+
+        for(int i = MAX(first, 1); i <= MIN(last, 99); i++)
+        {
+            if(!maps.Contains(i))
+            {
+                maps.Push(i);
+            }
+        }
+
+        if(*str == ',')
+        {
+            str++;
+        }
+    }
+}
+
+//
+// GetFileStamp
+//
+// Records what is needed to tell if a file was written to since
+//
+
+static void GetFileStamp(const char *fileName, fileStamp_t &stamp)
+{
+    struct stat st;
+
+    memset(&stamp, 0, sizeof(fileStamp_t));
+
+    if(stat(fileName, &st) != 0)
+    {
+        return;
+    }
+
+    stamp.bExists = true;
+    stamp.mtime = (int64_t)st.st_mtime;
+#if defined(__linux__)
+    stamp.mtimeNano = (int64_t)st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+    stamp.mtimeNano = (int64_t)st.st_mtimespec.tv_nsec;
+#endif
+    stamp.size = (int64_t)st.st_size;
+    stamp.inode = (int64_t)st.st_ino;
+}
+
+//
+// SameFileStamp
+//
+
+static bool SameFileStamp(const fileStamp_t &a, const fileStamp_t &b)
+{
+    return a.bExists == b.bExists && a.mtime == b.mtime && a.mtimeNano == b.mtimeNano &&
+           a.size == b.size && a.inode == b.inode;
+}
+
+//
+// FindLightmapLumps
+//
+// Finds the lightmap lumps that the given maps already have in the wad
+//
+
+static void FindLightmapLumps(kexWadFile &wadFile, kexArray<int> &maps, kexArray<int> &ignoreLumps)
+{
+    static const char *lmLumpNames[] =
+    {
+        "LM_CELLS", "LM_SUN", "LM_SURFS", "LM_TXCRD", "LM_LMAPS"
+    };
+
+    for(unsigned int i = 0; i < maps.Length(); i++)
+    {
+        lump_t *lmLump = wadFile.GetLumpFromName(Va("LM_MAP%02d", maps[i]));
+
+        if(lmLump)
+        {
+            int lumpnum = lmLump - wadFile.lumps;
+
+            ignoreLumps.Push(lumpnum + ML_LM_LABEL);
+
+            // only drop the lumps that really belong to this map's marker
+            for(int j = 0; j < ML_LM_LMAPS; j++)
+            {
+                lump_t *lump = wadFile.GetLumpFromName(lmLumpNames[j], lumpnum + 1,
+                                                       lumpnum + ML_LM_LMAPS + 1);
+                if(lump)
+                {
+                    ignoreLumps.Push(lump - wadFile.lumps);
+                }
+            }
+        }
+    }
+}
+
+//
+// BuildMap
+//
+// Builds the level structures and surfaces of the wad's current map,
+// or takes them from the geometry cache if the map's lumps are the
+// same as when it was saved
+//
+
+static void BuildMap(kexWadFile &wadFile, kexDoomMap &doomMap,
+                     kexGeometryCache &geometryCache, const kexStr &geometryFile)
+{
+    printf("------------- Building level structures -------------\n\n");
+
+    if(geometryFile.Length() > 0 && geometryCache.Load(geometryFile, wadFile, doomMap))
+    {
+        return;
+    }
+
+    doomMap.BuildMapFromWad(wadFile);
+
+    printf("----------- Allocating surfaces from level ----------\n\n");
+    Surface_AllocateFromMap(doomMap);
+
+    if(geometryFile.Length() > 0)
+    {
+        geometryCache.Save(geometryFile, wadFile, doomMap);
+    }
+}
+
+//
+// MapFileName
+//
+// Names a file that belongs to one map of the wad, such as
+// doom2.map01.lmcache, and keeps it next to the wad
+//
+
+static kexStr MapFileName(const char *wadName, const int map, const char *ext)
+{
+    kexStr fileName(wadName);
+
+    fileName.StripExtension();
+    fileName += Va(".map%02d.%s", map, ext);
+
+    return fileName;
+}
+
+//
+// LightMap
+//
+// Lights a map whose surfaces and lights are already created and
+// adds its lightmap lumps to the output wad
+//
+
+static void LightMap(kexDoomMap &doomMap, const kexLightmapBuilder &builder,
+                     kexWadFile &outWadFile, const int map, const kexStr &cacheFile,
+                     const kexStr &checkpointFile, const kexStr &tgaName)
+{
+    kexLightmapBuilder mapBuilder;
+
+    mapBuilder.CopySettings(builder);
+    mapBuilder.cacheFile = cacheFile;
+    mapBuilder.checkpointFile = checkpointFile;
+
+    printf("---------------- Creating lightmaps ---------------\n\n");
+    mapBuilder.CreateLightmaps(doomMap);
+    doomMap.CleanupThingLights();
+
+    if(tgaName.Length() > 0)
+    {
+        mapBuilder.WriteTexturesToTGA(tgaName.c_str());
+    }
+
+    outWadFile.AddLump(Va("LM_MAP%02d", map), 0, NULL);
+
+    mapBuilder.AddLightGridLump(outWadFile);
+    mapBuilder.AddLightmapLumps(outWadFile);
+}
+
+//
+// ServeMap
+//
+// Lights the parts of a map that the coordinator hands out. Nothing
+// is written, the coordinator adds the lumps to its wad
+//
+
+static void ServeMap(kexDoomMap &doomMap, const kexLightmapBuilder &builder)
+{
+    kexLightmapBuilder mapBuilder;
+
+    mapBuilder.CopySettings(builder);
+
+    printf("---------------- Creating lightmaps ---------------\n\n");
+    mapBuilder.CreateLightmaps(doomMap);
+    doomMap.CleanupThingLights();
+}
+
+//
+// WriteWad
+//
+// Writes the kept lumps of the wad along with the new lightmap lumps.
+// Returns false if the wad couldn't be written
+//
+
+static bool WriteWad(kexWadFile &wadFile, kexWadFile &outWadFile,
+                     const bool bAppend, const bool bBackup)
+{
+    if(bAppend)
+    {
+        printf("------------------ Updating wad ------------------\n\n");
+    }
+    else
+    {
+        printf("------------------ Rebuilding wad ----------------\n\n");
+
+        if(bBackup)
+        {
+            wadFile.CreateBackup();
+        }
+    }
+
+    printf("------------- Writing %s -------------\n\n", wadFile.wadName.c_str());
+
+    if(bAppend)
+    {
+        return outWadFile.Append(wadFile);
+    }
+
+    return outWadFile.Write(wadFile.wadName);
+}
+
+//
+// WaitForChange
+//
+// Polls the config and wad until either of them is written to, then
+// waits for the writes to settle so a half saved file isn't read
+//
+
+static void WaitForChange(const char *configFile, fileStamp_t &configStamp, bool &bConfigChanged,
+                          const char *wadName, fileStamp_t &wadStamp, bool &bWadChanged)
+{
+    fileStamp_t newConfigStamp;
+    fileStamp_t newWadStamp;
+
+    while(1)
+    {
+        Delay(WATCH_POLL_MS);
+
+        GetFileStamp(configFile, newConfigStamp);
+        GetFileStamp(wadName, newWadStamp);
+
+        if(!SameFileStamp(newConfigStamp, configStamp) ||
+           !SameFileStamp(newWadStamp, wadStamp))
+        {
+            break;
+        }
+    }
+
+    while(1)
+    {
+        fileStamp_t settledConfigStamp;
+        fileStamp_t settledWadStamp;
+
+        Delay(WATCH_SETTLE_MS);
+
+        GetFileStamp(configFile, settledConfigStamp);
+        GetFileStamp(wadName, settledWadStamp);
+
+        if(SameFileStamp(settledConfigStamp, newConfigStamp) &&
+           SameFileStamp(settledWadStamp, newWadStamp) &&
+           settledConfigStamp.bExists && settledWadStamp.bExists)
+        {
+            break;
+        }
+
+        newConfigStamp = settledConfigStamp;
+        newWadStamp = settledWadStamp;
+    }
+
+    bConfigChanged = !SameFileStamp(newConfigStamp, configStamp);
+    bWadChanged = !SameFileStamp(newWadStamp, wadStamp);
+
+    configStamp = newConfigStamp;
+    wadStamp = newWadStamp;
+}
+
+//
+// WatchMap
+//
+// Keeps the level structures and surfaces of one map loaded and lights
+// it again every time the config or wad is saved. Surfaces and grid
+// cells whose lights didn't change are taken from the cache, so only
+// what changed is traced again. Runs until the process is stopped
+//
+
+static void WatchMap(const char *wadName, const kexStr &configFile, const int map,
+                     const kexLightmapBuilder &builder, const bool bWriteTGA)
+{
+    kexWadFile *mapWadFile = NULL;
+    kexGeometryCache *geometryCache = NULL;
+    kexDoomMap *doomMap = NULL;
+    kexDoomMap *configMap = NULL;
+    fileStamp_t configStamp;
+    fileStamp_t wadStamp;
+    bool bConfigChanged = true;
+    bool bWadChanged = true;
+    bool bBackup = true;
+    kexStr cacheFile = MapFileName(wadName, map, "lmcache");
+    kexStr geometryFile = MapFileName(wadName, map, "geocache");
+
+    GetFileStamp(configFile.c_str(), configStamp);
+    GetFileStamp(wadName, wadStamp);
+
+    while(1)
+    {
+        kexWadFile wadFile;
+        kexWadFile outWadFile;
+        kexArray<int> maps;
+        kexArray<int> ignoreLumps;
+        int64_t starttime = GetMilliseconds();
+
+        if(bConfigChanged)
+        {
+            printf("---------------- Parsing config file ----------------\n\n");
+
+            delete configMap;
+            configMap = new kexDoomMap;
+            configMap->ParseConfigFile(configFile.c_str());
+        }
+
+        if(!bWadChanged && !doomMap->ReloadConfig(*configMap, map))
+        {
+            // the sky sectors changed, so the surfaces have to be built again
+            bWadChanged = true;
+        }
+
+        if(bWadChanged)
+        {
+            // the level structures point into the mapped wad and the
+            // geometry cache, so the old ones go away along with them
+            surfaces.Empty();
+            delete doomMap;
+            delete geometryCache;
+            Mem_Purge(hb_map);
+
+            if(mapWadFile)
+            {
+                mapWadFile->Close();
+                delete mapWadFile;
+            }
+
+            mapWadFile = new kexWadFile;
+            geometryCache = new kexGeometryCache;
+
+            if(!mapWadFile->Open(wadName))
+            {
+                Error("Couldn't open %s\n", wadName);
+                return;
+            }
+
+            doomMap = new kexDoomMap;
+            doomMap->CopyConfig(*configMap);
+
+            mapWadFile->SetCurrentMap(map);
+            BuildMap(*mapWadFile, *doomMap, *geometryCache, geometryFile);
+        }
+
+        printf("---------------- Allocating lights ----------------\n\n");
+        doomMap->CreateLights();
+
+        if(!wadFile.Open(wadName))
+        {
+            Error("Couldn't open %s\n", wadName);
+            return;
+        }
+
+        maps.Push(map);
+        FindLightmapLumps(wadFile, maps, ignoreLumps);
+
+        outWadFile.InitForWrite();
+        outWadFile.CopyLumpsFromWadFile(wadFile, ignoreLumps);
+
+        LightMap(*doomMap, builder, outWadFile, map, cacheFile, "",
+                 bWriteTGA ? "lightmap" : "");
+
+        // only the wad from before the first run is worth keeping. The
+        // wad is always rebuilt, appending would grow it with every run
+        if(WriteWad(wadFile, outWadFile, false, bBackup))
+        {
+            bBackup = false;
+        }
+
+        Mem_Purge(hb_lumps);
+
+        outWadFile.Close();
+        wadFile.Close();
+
+        // don't pick up our own write as a change
+        GetFileStamp(wadName, wadStamp);
+
+        printf("\nTurnaround: %.2f seconds\n\n",
+               (float)(GetMilliseconds() - starttime) / 1000.0f);
+        printf("Watching %s and %s for changes...\n\n", configFile.c_str(), wadName);
+        fflush(stdout);
+
+        WaitForChange(configFile.c_str(), configStamp, bConfigChanged,
+                      wadName, wadStamp, bWadChanged);
+    }
+}
+
 //
 // Main
 //
@@ -118,13 +587,20 @@ int main(int argc, char **argv)
 {
     kexWadFile wadFile;
     kexWadFile outWadFile;
-    kexDoomMap doomMap;
-    lump_t *lmLump;
+    kexDoomMap configMap;
     kexArray<int> ignoreLumps;
+    kexArray<int> maps;
     kexLightmapBuilder builder;
     kexStr configFile("strife_sve.cfg");
     bool bWriteTGA;
-    int map = 1;
+    bool bAppend;
+    bool bCompact;
+    bool bAllMaps;
+    bool bUseCache;
+    bool bWatch;
+    bool bResume;
+    bool bThreadsGiven;
+    bool bWritten;
     int arg = 1;
 
     printf("DLight (c) 2013-2014 Samuel Villarreal\n\n");
@@ -140,6 +616,16 @@ int main(int argc, char **argv)
     basePath.StripFile();
 
     bWriteTGA = false;
+    bAppend = false;
+    bCompact = false;
+    bAllMaps = false;
+    bUseCache = false;
+    bWatch = false;
+    bResume = false;
+    bThreadsGiven = false;
+    bWritten = true;
+
+    kexWorker::DetectCPUs();
 
     while(1)
     {
@@ -147,18 +633,93 @@ int main(int argc, char **argv)
         {
             printf("Options:\n");
             printf("-help:              displays all known options\n");
-            printf("-map:               process lightmap for MAP##\n");
+            printf("-map:               process lightmap for MAP##, a list of maps such as\n");
+            printf("                    1,4-6 or all to process every map in the wad\n");
             printf("-samples:           set texel sampling size (lowest = higher quaility but\n");
             printf("                    slow compile time) must be in powers of two\n");
             printf("-ambience:          set global ambience value for lightmaps (0.0 - 1.0)\n");
             printf("-size:              lightmap texture dimentions for width and height\n");
             printf("                    must be in powers of two (1, 2, 4, 8, 16, etc)\n");
-            printf("-threads:           set total number of threads (1 min, 128 max)\n");
+            printf("                    or auto to pick the size that needs the least memory\n");
+            printf("-maxtextures:       with -size auto, limit how many lightmap textures to use\n");
+            printf("-threads:           set total number of threads (1 min, 128 max, default:\n");
+            printf("                    the number of cpus this process is allowed to use)\n");
+            printf("-pin:               keep each thread on its own cpu and give every numa\n");
+            printf("                    node its own copy of the level geometry\n");
             printf("-config:            specify a config file to parse (default: strife_sve.cfg)\n");
             printf("-writetga:          dumps lightmaps to targa (.TGA) files\n");
+            printf("-append:            add the new lightmap lumps to the end of the wad\n");
+            printf("                    instead of rewriting it (no backup is made)\n");
+            printf("-compact:           rewrite the wad without space left behind by -append\n");
+            printf("-cache:             reuse the level structures and the lighting of unchanged\n");
+            printf("                    surfaces and grid cells from the last run (saved next\n");
+            printf("                    to the wad)\n");
+            printf("-watch:             keep the map loaded and light it again whenever\n");
+            printf("                    the config or wad is saved (implies -cache)\n");
+            printf("-resume:            keep finished lighting on disk while the map is lit\n");
+            printf("                    and pick up from it if the last run was stopped\n");
+            printf("-coordinator:       hand the lighting out to -worker processes that\n");
+            printf("                    connect to this address (host:port or unix:path)\n");
+            printf("-worker:            light the jobs of the coordinator at this address\n");
+            printf("                    instead of writing the wad\n");
+            printf("-compress:          store lightmaps BC1 (DXT1) compressed\n");
+            printf("-lmversion:         lightmap lump format to write (1 or 2, default: 1)\n");
+            printf("-quantizeuv:        store lightmap coordinates as 16-bit values (version 2)\n");
+            printf("-usereject:         use the REJECT lump to skip lights between sectors\n");
+            printf("-sunclassify:       only trace sunlight per texel on partially shaded surfaces\n");
+            printf("-gridfromtexels:    light grid cells from nearby lightmap texels\n");
+            printf("-adaptive:          pick each surface's texel sampling size between a\n");
+            printf("                    min and max value based on its lighting detail\n");
             arg++;
             return 0;
         }
+        else if(!strcmp(argv[arg], "-append"))
+        {
+            bAppend = true;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-cache"))
+        {
+            bUseCache = true;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-watch"))
+        {
+            bWatch = true;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-resume"))
+        {
+            bResume = true;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-coordinator"))
+        {
+            if(argv[arg+1] == NULL)
+            {
+                Error("Specify an address for -coordinator\n");
+                return 1;
+            }
+
+            builder.coordinatorAddress = argv[++arg];
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-worker"))
+        {
+            if(argv[arg+1] == NULL)
+            {
+                Error("Specify the coordinator's address for -worker\n");
+                return 1;
+            }
+
+            builder.workerAddress = argv[++arg];
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-compact"))
+        {
+            bCompact = true;
+            arg++;
+        }
         else if(!strcmp(argv[arg], "-map"))
         {
             if(argv[arg+1] == NULL)
@@ -167,7 +728,14 @@ int main(int argc, char **argv)
                 return 1;
             }
 
-            map = atoi(argv[++arg]);
+            if(!strcmp(argv[++arg], "all"))
+            {
+                bAllMaps = true;
+            }
+            else
+            {
+                ParseMapList(argv[arg], maps);
+            }
             arg++;
         }
         else if(!strcmp(argv[arg], "-samples"))
@@ -219,7 +787,17 @@ int main(int argc, char **argv)
                 return 1;
             }
 
-            lmDims = atoi(argv[++arg]);
+            // let the builder pick the size once everything is traced
+            if(!strcmp(argv[++arg], "auto"))
+            {
+                builder.bAutoTextureSize = true;
+                builder.textureWidth = LIGHTMAP_MAX_BLOCK;
+                builder.textureHeight = LIGHTMAP_MAX_BLOCK;
+                arg++;
+                continue;
+            }
+
+            lmDims = atoi(argv[arg]);
             if(lmDims <= 0)
             {
                 lmDims = 1;
@@ -233,12 +811,58 @@ int main(int argc, char **argv)
 
             builder.textureWidth = lmDims;
             builder.textureHeight = lmDims;
+            builder.bAutoTextureSize = false;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-compress"))
+        {
+            builder.bCompressTextures = true;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-lmversion"))
+        {
+            if(argv[arg+1] == NULL)
+            {
+                Error("Specify value for -lmversion\n");
+                return 1;
+            }
+
+            builder.lumpVersion = atoi(argv[++arg]);
+
+            if(builder.lumpVersion < 1 || builder.lumpVersion > 2)
+            {
+                Error("Unknown lightmap lump version %i\n", builder.lumpVersion);
+                return 1;
+            }
+
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-quantizeuv"))
+        {
+            builder.bQuantizeUV = true;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-maxtextures"))
+        {
+            if(argv[arg+1] == NULL)
+            {
+                Error("Specify value for -maxtextures\n");
+                return 1;
+            }
+
+            builder.maxTextures = atoi(argv[++arg]);
             arg++;
         }
         else if(!strcmp(argv[arg], "-threads"))
         {
             kexWorker::maxWorkThreads = atoi(argv[++arg]);
             kexMath::Clamp(kexWorker::maxWorkThreads, 1, MAX_THREADS);
+            bThreadsGiven = true;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-pin"))
+        {
+            kexWorker::bPinThreads = true;
             arg++;
         }
         else if(!strcmp(argv[arg], "-config"))
@@ -251,12 +875,105 @@ int main(int argc, char **argv)
             bWriteTGA = true;
             arg++;
         }
+        else if(!strcmp(argv[arg], "-usereject"))
+        {
+            builder.bUseReject = true;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-sunclassify"))
+        {
+            builder.bSunClassify = true;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-gridfromtexels"))
+        {
+            builder.bGridFromTexels = true;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-adaptive"))
+        {
+            if(argv[arg+1] == NULL || argv[arg+2] == NULL)
+            {
+                Error("Specify min and max values for -adaptive\n");
+                return 1;
+            }
+
+            builder.minSamples = atoi(argv[++arg]);
+            builder.maxSamples = atoi(argv[++arg]);
+
+            builder.minSamples = kexMath::RoundPowerOfTwo(MAX(MIN(builder.minSamples, 128), 1));
+            builder.maxSamples = kexMath::RoundPowerOfTwo(MAX(MIN(builder.maxSamples, 128), 1));
+
+            if(builder.maxSamples < builder.minSamples)
+            {
+                builder.maxSamples = builder.minSamples;
+            }
+
+            arg++;
+        }
         else
         {
             break;
         }
     }
 
+    // only version 2 lumps can tell the engine how the coordinates are stored
+    if(builder.bQuantizeUV && builder.lumpVersion < 2)
+    {
+        builder.lumpVersion = 2;
+    }
+
+    if(builder.coordinatorAddress.Length() > 0 || builder.workerAddress.Length() > 0)
+    {
+        if(builder.coordinatorAddress.Length() > 0 && builder.workerAddress.Length() > 0)
+        {
+            Error("-coordinator and -worker can't be used together\n");
+            return 1;
+        }
+
+        if(bWatch)
+        {
+            Error("-watch can't be used with -coordinator or -worker\n");
+            return 1;
+        }
+
+        // the grid would need every chart's texels on every worker
+        if(builder.bGridFromTexels)
+        {
+            Error("-gridfromtexels can't be used with -coordinator or -worker\n");
+            return 1;
+        }
+
+        if(bUseCache)
+        {
+            printf("Warning: -cache isn't used with -coordinator or -worker\n\n");
+            bUseCache = false;
+        }
+    }
+
+    if(bResume)
+    {
+        if(bWatch)
+        {
+            Error("-resume can't be used with -watch\n");
+            return 1;
+        }
+
+        // the texels the grid is gathered from aren't kept
+        if(builder.bGridFromTexels)
+        {
+            printf("Warning: -resume can't be used with -gridfromtexels\n\n");
+            bResume = false;
+        }
+
+        // the coordinator keeps the checkpoint for everyone
+        if(builder.workerAddress.Length() > 0)
+        {
+            printf("Warning: -resume isn't used with -worker\n\n");
+            bResume = false;
+        }
+    }
+
     if(argv[arg] == NULL)
     {
         printf("Usage: dlight [options] [wadfile]\n");
@@ -268,6 +985,23 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if(bCompact)
+    {
+        // copy every lump into a fresh wad, which drops anything the
+        // directory no longer points to
+        printf("------------- Compacting %s -------------\n\n", wadFile.wadName.c_str());
+        wadFile.CreateBackup();
+
+        outWadFile.InitForWrite();
+        outWadFile.CopyLumpsFromWadFile(wadFile);
+        bWritten = outWadFile.Write(wadFile.wadName);
+        outWadFile.Close();
+        wadFile.Close();
+
+        Mem_Purge(hb_static);
+        return bWritten ? 0 : 1;
+    }
+
     // concat the base path to light def file if there is none
     if(configFile.IndexOf("\\") == -1 && configFile.IndexOf("/") == -1)
     {
@@ -276,54 +1010,153 @@ int main(int argc, char **argv)
 
     int starttime = (int)GetSeconds();
 
-    printf("---------------- Parsing config file ----------------\n\n");
-    doomMap.ParseConfigFile(configFile.c_str());
+    if(bAllMaps)
+    {
+        for(int i = 1; i <= 99; i++)
+        {
+            if(wadFile.GetLumpFromName(Va("MAP%02d", i)) &&
+               wadFile.GetLumpFromName(Va("GL_MAP%02d", i)))
+            {
+                maps.Push(i);
+            }
+        }
 
-    printf("------------- Building level structures -------------\n\n");
-    wadFile.SetCurrentMap(map);
-    doomMap.BuildMapFromWad(wadFile);
+        if(maps.Length() == 0)
+        {
+            Error("No maps with GL nodes found in %s\n", wadFile.wadName.c_str());
+            return 1;
+        }
+    }
+    else if(maps.Length() == 0)
+    {
+        maps.Push(1);
+    }
 
-    printf("----------- Allocating surfaces from level ----------\n\n");
-    Surface_AllocateFromMap(doomMap);
+    if(!bThreadsGiven)
+    {
+        kexWorker::maxWorkThreads = MIN(kexWorker::NumUsableCPUs(), MAX_THREADS);
+    }
 
-    printf("---------------- Allocating lights ----------------\n\n");
-    doomMap.CreateLights();
+#if !defined(__linux__) && !defined(KEX_WIN32)
+    if(kexWorker::bPinThreads)
+    {
+        printf("Warning: -pin isn't supported on this platform\n\n");
+        kexWorker::bPinThreads = false;
+    }
+#endif
 
-    printf("---------------- Creating lightmaps ---------------\n\n");
-    builder.CreateLightmaps(doomMap);
-    doomMap.CleanupThingLights();
+    printf("Threads: %i (%i usable cpus on %i numa node%s%s)\n\n", kexWorker::maxWorkThreads,
+           kexWorker::NumUsableCPUs(), kexWorker::NumNodes(), kexWorker::NumNodes() == 1 ? "" : "s",
+           kexWorker::bPinThreads ? ", pinned" : "");
 
-    if(bWriteTGA)
+    if(bWatch)
     {
-        builder.WriteTexturesToTGA();
+        if(maps.Length() != 1)
+        {
+            Error("-watch only works on one map\n");
+            return 1;
+        }
+
+        if(bAppend)
+        {
+            printf("Warning: -append isn't used with -watch\n\n");
+        }
+
+        wadFile.Close();
+        WatchMap(argv[arg], configFile, maps[0], builder, bWriteTGA);
+        return 0;
     }
 
-    printf("------------------ Rebuilding wad ----------------\n\n");
-    wadFile.CreateBackup();
+    printf("---------------- Parsing config file ----------------\n\n");
+    configMap.ParseConfigFile(configFile.c_str());
 
-    lmLump = wadFile.GetLumpFromName(Va("LM_MAP%02d", wadFile.currentmap));
+    if(builder.workerAddress.Length() == 0)
+    {
+        FindLightmapLumps(wadFile, maps, ignoreLumps);
 
-    if(lmLump)
+        // the new lumps of every map go after the ones that are kept,
+        // and the wad is only written once all maps are done
+        outWadFile.InitForWrite();
+        outWadFile.CopyLumpsFromWadFile(wadFile, ignoreLumps);
+    }
+
+    for(unsigned int i = 0; i < maps.Length(); i++)
     {
-        int lumpnum = lmLump - wadFile.lumps;
-
-        ignoreLumps.Push(lumpnum + ML_LM_LABEL);
-        ignoreLumps.Push(lumpnum + ML_LM_CELLS);
-        ignoreLumps.Push(lumpnum + ML_LM_SUN);
-        ignoreLumps.Push(lumpnum + ML_LM_SURFS);
-        ignoreLumps.Push(lumpnum + ML_LM_TXCRD);
-        ignoreLumps.Push(lumpnum + ML_LM_LMAPS);
+        kexDoomMap doomMap;
+        kexGeometryCache geometryCache;
+        kexStr cacheFile;
+        kexStr geometryFile;
+        kexStr checkpointFile;
+        kexStr tgaName;
+
+        if(maps.Length() > 1)
+        {
+            printf("==================== MAP%02d (%i / %i) ====================\n\n",
+                   maps[i], i+1, maps.Length());
+        }
+
+        doomMap.CopyConfig(configMap);
+
+        if(bUseCache)
+        {
+            cacheFile = MapFileName(wadFile.wadName, maps[i], "lmcache");
+            geometryFile = MapFileName(wadFile.wadName, maps[i], "geocache");
+        }
+
+        if(bResume)
+        {
+            checkpointFile = MapFileName(wadFile.wadName, maps[i], "lmckpt");
+        }
+
+        if(bWriteTGA)
+        {
+            tgaName = maps.Length() > 1 ? Va("map%02d_lightmap", maps[i]) : "lightmap";
+        }
+
+        wadFile.SetCurrentMap(maps[i]);
+        BuildMap(wadFile, doomMap, geometryCache, geometryFile);
+
+        printf("---------------- Allocating lights ----------------\n\n");
+        doomMap.CreateLights();
+
+        if(builder.workerAddress.Length() > 0)
+        {
+            ServeMap(doomMap, builder);
+        }
+        else
+        {
+            LightMap(doomMap, builder, outWadFile, maps[i], cacheFile, checkpointFile, tgaName);
+        }
+
+        // the next map allocates its own surfaces and level structures,
+        // only the lumps that were added are kept until the wad is written
+        surfaces.Empty();
+        Mem_Purge(hb_map);
+
+        if(builder.workerAddress.Length() > 0)
+        {
+            Mem_Purge(hb_lumps);
+        }
     }
 
-    outWadFile.InitForWrite();
-    outWadFile.CopyLumpsFromWadFile(wadFile, ignoreLumps);
-    outWadFile.AddLump(Va("LM_MAP%02d", wadFile.currentmap), 0, NULL);
+    if(builder.workerAddress.Length() == 0)
+    {
+        bWritten = WriteWad(wadFile, outWadFile, bAppend, true);
+        Mem_Purge(hb_lumps);
 
-    builder.AddLightGridLump(outWadFile);
-    builder.AddLightmapLumps(outWadFile);
+        // once everything made it into the wad there's nothing to resume,
+        // otherwise the checkpoints are all that's left of the lighting
+        for(unsigned int i = 0; i < maps.Length() && bResume && bWritten; i++)
+        {
+            remove(MapFileName(wadFile.wadName, maps[i], "lmckpt"));
+        }
+
+        if(!bWritten && bResume)
+        {
+            printf("Warning: the checkpoints are kept, -resume picks the lighting up again\n\n");
+        }
+    }
 
-    printf("------------- Writing %s -------------\n\n", wadFile.wadName.c_str());
-    outWadFile.Write(wadFile.wadName);
     outWadFile.Close();
     wadFile.Close();
 
@@ -334,5 +1167,5 @@ int main(int argc, char **argv)
     printf("\nBuild time: %d:%02d:%02d\n",
            proctime / 3600, (proctime / 60) % 60, proctime % 60);
 
-    return 0;
+    return bWritten ? 0 : 1;
 }
@@ -32,6 +32,11 @@
 #include "kexlib/parser.h"
 #include "mapData.h"
 #include "lightSurface.h"
+#include "trace.h"
+#include "worker.h"
+
+// the level structures and surfaces of the map being lit
+kexHeapBlock hb_map("map", false, NULL, NULL);
 
 const kexVec3 kexDoomMap::defaultSunColor(1, 1, 1);
 const kexVec3 kexDoomMap::defaultSunDirection(0.45f, 0.3f, 0.9f);
@@ -60,7 +65,9 @@ kexDoomMap::kexDoomMap(void)
     this->leafSurfaces[1]   = NULL;
     this->vertexes          = NULL;
     this->mapPVS            = NULL;
+    this->mapReject         = NULL;
     this->mapDef            = NULL;
+    this->mapNum            = 0;
 
     this->numLeafs      = 0;
     this->numLines      = 0;
@@ -71,6 +78,7 @@ kexDoomMap::kexDoomMap(void)
     this->numSSects     = 0;
     this->numNodes      = 0;
     this->numVertexes   = 0;
+    this->rejectSize    = 0;
 }
 
 //
@@ -79,19 +87,29 @@ kexDoomMap::kexDoomMap(void)
 
 kexDoomMap::~kexDoomMap(void)
 {
+    CleanupThingLights();
+
+    for(unsigned int i = 0; i < lightSurfaces.Length(); i++)
+    {
+        delete lightSurfaces[i];
+    }
 }
 
 //
-// kexDoomMap::BuildMapFromWad
+// kexDoomMap::LoadMapLumps
+//
+// Points the level data at the map's lumps. Everything that
+// is built from them is left alone
 //
 
-void kexDoomMap::BuildMapFromWad(kexWadFile &wadFile)
+void kexDoomMap::LoadMapLumps(kexWadFile &wadFile)
 {
     wadFile.GetMapLump<mapThing_t>(ML_THINGS, &mapThings, &numThings);
     wadFile.GetMapLump<mapVertex_t>(ML_VERTEXES, &mapVerts, &numVerts);
     wadFile.GetMapLump<mapLineDef_t>(ML_LINEDEFS, &mapLines, &numLines);
     wadFile.GetMapLump<mapSideDef_t>(ML_SIDEDEFS, &mapSides, &numSides);
     wadFile.GetMapLump<mapSector_t>(ML_SECTORS, &mapSectors, &numSectors);
+    wadFile.GetMapLump<byte>(ML_REJECT, &mapReject, &rejectSize);
 
     wadFile.GetGLMapLump<glSeg_t>(ML_GL_SEGS, &mapSegs, &numSegs);
     wadFile.GetGLMapLump<mapSubSector_t>(ML_GL_SSECT, &mapSSects, &numSSects);
@@ -114,14 +132,17 @@ void kexDoomMap::BuildMapFromWad(kexWadFile &wadFile)
         return;
     }
 
-    for(unsigned int i = 0; i < mapDefs.Length(); ++i)
-    {
-        if(mapDefs[i].map == wadFile.currentmap)
-        {
-            mapDef = &mapDefs[i];
-            break;
-        }
-    }
+    SetMapDef(wadFile.currentmap);
+    BuildPVS();
+}
+
+//
+// kexDoomMap::BuildMapFromWad
+//
+
+void kexDoomMap::BuildMapFromWad(kexWadFile &wadFile)
+{
+    LoadMapLumps(wadFile);
 
     printf("------------- Level Info -------------\n");
     printf("Vertices: %i\n", numVerts);
@@ -131,10 +152,28 @@ void kexDoomMap::BuildMapFromWad(kexWadFile &wadFile)
     BuildVertexes(wadFile);
     BuildNodeBounds();
     BuildLeafs();
-    BuildPVS();
     CheckSkySectors();
 }
 
+//
+// kexDoomMap::SetMapDef
+//
+
+void kexDoomMap::SetMapDef(const int map)
+{
+    mapDef = NULL;
+    mapNum = map;
+
+    for(unsigned int i = 0; i < mapDefs.Length(); ++i)
+    {
+        if(mapDefs[i].map == map)
+        {
+            mapDef = &mapDefs[i];
+            break;
+        }
+    }
+}
+
 //
 // kexDoomMap::CheckSkySectors
 //
@@ -143,12 +182,12 @@ void kexDoomMap::CheckSkySectors(void)
 {
     char name[9];
 
-    bSkySectors = (bool*)Mem_Calloc(sizeof(bool) * numSectors, hb_static);
-    bSSectsVisibleToSky = (bool*)Mem_Calloc(sizeof(bool) * numSSects, hb_static);
+    bSkySectors = (bool*)Mem_Calloc(sizeof(bool) * numSectors, hb_map);
+    bSSectsVisibleToSky = (bool*)Mem_Calloc(sizeof(bool) * numSSects, hb_map);
 
     for(int i = 0; i < numSectors; ++i)
     {
-        if(mapDef->sunIgnoreTag != 0 && mapSectors[i].tag == mapDef->sunIgnoreTag)
+        if(mapDef && mapDef->sunIgnoreTag != 0 && mapSectors[i].tag == mapDef->sunIgnoreTag)
         {
             continue;
         }
@@ -197,7 +236,7 @@ void kexDoomMap::BuildPVS(void)
     }
 
     int len = ((numSSects + 7) / 8) * numSSects;
-    mapPVS = (byte*)Mem_Malloc(len, hb_static);
+    mapPVS = (byte*)Mem_Malloc(len, hb_map);
     memset(mapPVS, 0xff, len);
 }
 
@@ -218,6 +257,28 @@ bool kexDoomMap::CheckPVS(mapSubSector_t *s1, mapSubSector_t *s2)
     return ((vis[n2 >> 3] & (1 << (n2 & 7))) != 0);
 }
 
+//
+// kexDoomMap::CheckReject
+//
+// Returns false if the reject table says the two sectors
+// can't see each other. Missing or truncated tables
+// will always pass
+//
+
+bool kexDoomMap::CheckReject(const mapSector_t *s1, const mapSector_t *s2)
+{
+    int bit;
+
+    if(mapReject == NULL || rejectSize < ((numSectors * numSectors) + 7) / 8)
+    {
+        return true;
+    }
+
+    bit = ((s1 - mapSectors) * numSectors) + (s2 - mapSectors);
+
+    return ((mapReject[bit >> 3] & (1 << (bit & 7))) == 0);
+}
+
 //
 // kexDoomMap::BuildVertexes
 //
@@ -247,7 +308,7 @@ void kexDoomMap::BuildVertexes(kexWadFile &wadFile)
     count = (lump->size - GL_VERT_OFFSET) / sizeof(glVert_t);
 
     numVertexes = numVerts + count;
-    vertexes = (vertex_t*)Mem_Calloc(sizeof(vertex_t) * numVertexes, hb_static);
+    vertexes = (vertex_t*)Mem_Calloc(sizeof(vertex_t) * numVertexes, hb_map);
 
     for(int i = 0; i < numVerts; i++)
     {
@@ -274,7 +335,7 @@ void kexDoomMap::BuildNodeBounds(void)
     float   high = -M_INFINITY;
     float   low = M_INFINITY;
 
-    nodeBounds = (kexBBox*)Mem_Calloc(sizeof(kexBBox) * numNodes, hb_static);
+    nodeBounds = (kexBBox*)Mem_Calloc(sizeof(kexBBox) * numNodes, hb_map);
 
     for(i = 0; i < numSectors; ++i)
     {
@@ -316,15 +377,15 @@ void kexDoomMap::BuildLeafs(void)
     mapSector_t     *sector;
     int             count;
 
-    leafs = (leaf_t*)Mem_Calloc(sizeof(leaf_t*) * numSegs * 2, hb_static);
+    leafs = (leaf_t*)Mem_Calloc(sizeof(leaf_t*) * numSegs * 2, hb_map);
     numLeafs = numSSects;
 
     ss = mapSSects;
 
-    segLeafLookup = (int*)Mem_Calloc(sizeof(int) * numSegs, hb_static);
-    ssLeafLookup = (int*)Mem_Calloc(sizeof(int) * numSSects, hb_static);
-    ssLeafCount = (int*)Mem_Calloc(sizeof(int) * numSSects, hb_static);
-    ssLeafBounds = (kexBBox*)Mem_Calloc(sizeof(kexBBox) * numSSects, hb_static);
+    segLeafLookup = (int*)Mem_Calloc(sizeof(int) * numSegs, hb_map);
+    ssLeafLookup = (int*)Mem_Calloc(sizeof(int) * numSSects, hb_map);
+    ssLeafCount = (int*)Mem_Calloc(sizeof(int) * numSSects, hb_map);
+    ssLeafBounds = (kexBBox*)Mem_Calloc(sizeof(kexBBox) * numSSects, hb_map);
 
     count = 0;
 
@@ -622,6 +683,20 @@ const kexVec3 &kexDoomMap::GetSunColor(void) const
     return defaultSunColor;
 }
 
+//
+// kexDoomMap::GetSunIgnoreTag
+//
+
+const int kexDoomMap::GetSunIgnoreTag(void) const
+{
+    if(mapDef != NULL)
+    {
+        return mapDef->sunIgnoreTag;
+    }
+
+    return 0;
+}
+
 //
 // kexDoomMap::GetSunDirection
 //
@@ -636,6 +711,101 @@ const kexVec3 &kexDoomMap::GetSunDirection(void) const
     return defaultSunDirection;
 }
 
+//
+// kexDoomMap::GetSurfaceSamples
+//
+// Returns the texel density that the config forces on a surface,
+// or 0 if it's free to use any. Line tags win over sector tags
+//
+
+int kexDoomMap::GetSurfaceSamples(const surface_t *surface)
+{
+    mapSector_t *sector = NULL;
+    mapLineDef_t *line = NULL;
+    int samples = 0;
+
+    if(densityDefs.Length() == 0)
+    {
+        return 0;
+    }
+
+    if(surface->type == ST_FLOOR || surface->type == ST_CEILING)
+    {
+        sector = GetSectorFromSubSector(surface->subSector);
+    }
+    else
+    {
+        glSeg_t *seg = (glSeg_t*)surface->data;
+
+        if(seg->linedef != NO_LINE_INDEX)
+        {
+            line = &mapLines[seg->linedef];
+            sector = GetFrontSector(seg);
+        }
+    }
+
+    for(unsigned int i = 0; i < densityDefs.Length(); i++)
+    {
+        densityDef_t *densityDef = &densityDefs[i];
+
+        if(line && densityDef->lineTag != 0 && line->tag == densityDef->lineTag)
+        {
+            return densityDef->samples;
+        }
+
+        if(sector && densityDef->sectorTag != 0 && sector->tag == densityDef->sectorTag)
+        {
+            samples = densityDef->samples;
+        }
+    }
+
+    return samples;
+}
+
+//
+// kexDoomMap::CopyConfig
+//
+// Takes the definitions from an already parsed config file so
+// every map in a batch doesn't have to parse it again
+//
+
+void kexDoomMap::CopyConfig(const kexDoomMap &doomMap)
+{
+    lightDefs = doomMap.lightDefs;
+    surfaceLightDefs = doomMap.surfaceLightDefs;
+    mapDefs = doomMap.mapDefs;
+    densityDefs = doomMap.densityDefs;
+}
+
+//
+// kexDoomMap::ReloadConfig
+//
+// Swaps in the definitions from a config file that was parsed again
+// while the level structures stay loaded. The lights have to be
+// created again afterwards. Returns false if the level structures
+// and surfaces have to be built again, which is the case when the
+// sun ignore tag changed which sectors count as sky
+//
+
+bool kexDoomMap::ReloadConfig(const kexDoomMap &doomMap, const int map)
+{
+    int sunIgnoreTag = GetSunIgnoreTag();
+
+    CleanupThingLights();
+
+    for(unsigned int i = 0; i < lightSurfaces.Length(); i++)
+    {
+        delete lightSurfaces[i];
+    }
+
+    lightSurfaces.Empty();
+
+    CopyConfig(doomMap);
+    SetMapDef(map);
+
+    return GetSunIgnoreTag() == sunIgnoreTag;
+}
+
 //
 // kexDoomMap::ParseConfigFile
 //
@@ -809,6 +979,43 @@ void kexDoomMap::ParseConfigFile(const char *file)
 
             surfaceLightDefs.Push(surfaceLight);
         }
+
+        // check for densitydef block
+        if(lexer->Matches("densitydef"))
+        {
+            densityDef_t densityDef;
+
+            densityDef.sectorTag = 0;
+            densityDef.lineTag = 0;
+            densityDef.samples = 0;
+
+            lexer->ExpectNextToken(TK_LBRACK);
+            lexer->Find();
+
+            while(lexer->TokenType() != TK_RBRACK)
+            {
+                if(lexer->Matches("sector_tag"))
+                {
+                    densityDef.sectorTag = lexer->GetNumber();
+                }
+                else if(lexer->Matches("line_tag"))
+                {
+                    densityDef.lineTag = lexer->GetNumber();
+                }
+                else if(lexer->Matches("samples"))
+                {
+                    densityDef.samples = lexer->GetNumber();
+                }
+
+                lexer->Find();
+            }
+
+            if(densityDef.samples > 0)
+            {
+                densityDef.samples = kexMath::RoundPowerOfTwo(MIN(densityDef.samples, 128));
+                densityDefs.Push(densityDef);
+            }
+        }
     }
 
     // we're done with the file
@@ -951,4 +1158,64 @@ void kexDoomMap::CleanupThingLights(void)
     {
         delete thingLights[i];
     }
+
+    thingLights.Empty();
+}
+
+//
+// kexDoomMap::BuildTraceData
+//
+// Gives every numa node that worker threads are pinned to its own
+// copy of what traces read. Each copy is made while this thread is
+// bound to the node so its pages are allocated there
+//
+
+void kexDoomMap::BuildTraceData(void)
+{
+    int numCopies = kexWorker::NumThreadNodes();
+
+    FreeTraceData();
+
+    for(int i = 0; i < numCopies; i++)
+    {
+        if(numCopies > 1)
+        {
+            kexWorker::BindToNode(i);
+        }
+
+        traceData.Push(kexTrace::CreateData(*this));
+    }
+
+    if(numCopies > 1)
+    {
+        kexWorker::Unbind();
+    }
+}
+
+//
+// kexDoomMap::FreeTraceData
+//
+
+void kexDoomMap::FreeTraceData(void)
+{
+    for(unsigned int i = 0; i < traceData.Length(); i++)
+    {
+        kexTrace::FreeData(traceData[i]);
+    }
+
+    traceData.Empty();
+}
+
+//
+// kexDoomMap::GetTraceData
+//
+
+struct traceData_s *kexDoomMap::GetTraceData(const int node)
+{
+    if(traceData.Length() == 0)
+    {
+        return NULL;
+    }
+
+    return traceData[(unsigned int)node < traceData.Length() ? node : 0];
 }
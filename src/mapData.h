@@ -175,6 +175,13 @@ typedef struct
     kexVec3         sunColor;
 } mapDef_t;
 
+typedef struct
+{
+    int             sectorTag;
+    int             lineTag;
+    int             samples;
+} densityDef_t;
+
 typedef struct
 {
     mapThing_t      *mapThing;
@@ -195,6 +202,7 @@ public:
     kexDoomMap(void);
     ~kexDoomMap(void);
 
+    void                        LoadMapLumps(kexWadFile &wadFile);
     void                        BuildMapFromWad(kexWadFile &wadFile);
     mapSideDef_t                *GetSideDef(const glSeg_t *seg);
     mapSector_t                 *GetFrontSector(const glSeg_t *seg);
@@ -206,13 +214,22 @@ public:
             const mapSubSector_t *sub, kexVec2 &out);
     vertex_t                    *GetSegVertex(int index);
     bool                        CheckPVS(mapSubSector_t *s1, mapSubSector_t *s2);
+    bool                        CheckReject(const mapSector_t *s1, const mapSector_t *s2);
 
     void                        ParseConfigFile(const char *file);
+    void                        CopyConfig(const kexDoomMap &doomMap);
+    bool                        ReloadConfig(const kexDoomMap &doomMap, const int map);
     void                        CreateLights(void);
     void                        CleanupThingLights(void);
+    void                        BuildTraceData(void);
+    void                        FreeTraceData(void);
+    struct traceData_s          *GetTraceData(const int node);
 
     const kexVec3               &GetSunColor(void) const;
     const kexVec3               &GetSunDirection(void) const;
+    const int                   GetSunIgnoreTag(void) const;
+    const int                   GetMapNum(void) const { return mapNum; }
+    int                         GetSurfaceSamples(const surface_t *surface);
 
     mapThing_t                  *mapThings;
     mapLineDef_t                *mapLines;
@@ -225,6 +242,7 @@ public:
     leaf_t                      *leafs;
     vertex_t                    *vertexes;
     byte                        *mapPVS;
+    byte                        *mapReject;
 
     bool                        *bSkySectors;
     bool                        *bSSectsVisibleToSky;
@@ -239,6 +257,7 @@ public:
     int                         numNodes;
     int                         numLeafs;
     int                         numVertexes;
+    int                         rejectSize;
 
     int                         *segLeafLookup;
     int                         *ssLeafLookup;
@@ -256,6 +275,7 @@ public:
 private:
     void                        BuildLeafs(void);
     void                        BuildNodeBounds(void);
+    void                        SetMapDef(const int map);
     void                        CheckSkySectors(void);
     void                        BuildVertexes(kexWadFile &wadFile);
     void                        BuildPVS(void);
@@ -263,11 +283,16 @@ private:
     kexArray<lightDef_t>        lightDefs;
     kexArray<surfaceLightDef_t> surfaceLightDefs;
     kexArray<mapDef_t>          mapDefs;
+    kexArray<densityDef_t>      densityDefs;
+    kexArray<struct traceData_s*> traceData;
 
     mapDef_t                    *mapDef;
+    int                         mapNum;
 
     static const kexVec3        defaultSunColor;
     static const kexVec3        defaultSunDirection;
 };
 
+extern kexHeapBlock hb_map;
+
 #endif
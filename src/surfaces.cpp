@@ -80,9 +80,9 @@ static void Surface_AllocateFromSeg(kexDoomMap &doomMap, glSeg_t *seg)
         {
             if(side->bottomtexture[0] != '-')
             {
-                surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_static);
+                surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_map);
                 surf->numVerts = 4;
-                surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_static);
+                surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_map);
 
                 surf->verts[0].x = surf->verts[2].x = v1->x;
                 surf->verts[0].y = surf->verts[2].y = v1->y;
@@ -123,9 +123,9 @@ static void Surface_AllocateFromSeg(kexDoomMap &doomMap, glSeg_t *seg)
 
             if(side->toptexture[0] != '-' || bSky)
             {
-                surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_static);
+                surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_map);
                 surf->numVerts = 4;
-                surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_static);
+                surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_map);
 
                 surf->verts[0].x = surf->verts[2].x = v1->x;
                 surf->verts[0].y = surf->verts[2].y = v1->y;
@@ -154,9 +154,9 @@ static void Surface_AllocateFromSeg(kexDoomMap &doomMap, glSeg_t *seg)
     // middle seg
     if(back == NULL)
     {
-        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_static);
+        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_map);
         surf->numVerts = 4;
-        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_static);
+        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_map);
 
         surf->verts[0].x = surf->verts[2].x = v1->x;
         surf->verts[0].y = surf->verts[2].y = v1->y;
@@ -196,9 +196,9 @@ static void Surface_AllocateFromLeaf(kexDoomMap &doomMap)
     printf("------------- Building leaf surfaces -------------\n");
 
     doomMap.leafSurfaces[0] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
-                              doomMap.numSSects, hb_static);
+                              doomMap.numSSects, hb_map);
     doomMap.leafSurfaces[1] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
-                              doomMap.numSSects, hb_static);
+                              doomMap.numSSects, hb_map);
 
     for(i = 0; i < doomMap.numSSects; i++)
     {
@@ -219,9 +219,9 @@ static void Surface_AllocateFromLeaf(kexDoomMap &doomMap)
             return;
         }
 
-        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_static);
+        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_map);
         surf->numVerts = doomMap.ssLeafCount[i];
-        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * surf->numVerts, hb_static);
+        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * surf->numVerts, hb_map);
         surf->subSector = &doomMap.mapSSects[i];
 
         // floor verts
@@ -244,9 +244,9 @@ static void Surface_AllocateFromLeaf(kexDoomMap &doomMap)
 
         surfaces.Push(surf);
 
-        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_static);
+        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_map);
         surf->numVerts = doomMap.ssLeafCount[i];
-        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * surf->numVerts, hb_static);
+        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * surf->numVerts, hb_map);
         surf->subSector = &doomMap.mapSSects[i];
 
         if(doomMap.bSkySectors[sector-doomMap.mapSectors])
@@ -285,11 +285,11 @@ static void Surface_AllocateFromLeaf(kexDoomMap &doomMap)
 void Surface_AllocateFromMap(kexDoomMap &doomMap)
 {
     doomMap.segSurfaces[0] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
-                             doomMap.numSegs, hb_static);
+                             doomMap.numSegs, hb_map);
     doomMap.segSurfaces[1] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
-                             doomMap.numSegs, hb_static);
+                             doomMap.numSegs, hb_map);
     doomMap.segSurfaces[2] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
-                             doomMap.numSegs, hb_static);
+                             doomMap.numSegs, hb_map);
 
     printf("------------- Building seg surfaces -------------\n");
 
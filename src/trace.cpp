@@ -31,6 +31,32 @@
 #include "common.h"
 #include "mapData.h"
 #include "trace.h"
+#include "worker.h"
+
+// the parts of a surface that a trace looks at
+typedef struct traceSurface_s
+{
+    kexPlane            plane;
+    surfaceType_t       type;
+    int                 numVerts;
+    kexVec3             *verts;
+    surface_t           *surface;
+} traceSurface_t;
+
+// everything a trace reads from the map, packed together. The map
+// keeps one copy of it for each numa node that threads are pinned to
+typedef struct traceData_s
+{
+    int                 numNodes;
+    mapNode_t           *nodes;
+    kexBBox             *nodeBounds;
+    mapSubSector_t      *subSectors;
+    kexBBox             *leafBounds;
+    traceSurface_t      **segSurfaces[3];
+    traceSurface_t      **leafSurfaces[2];
+    traceSurface_t      *surfaces;
+    kexVec3             *verts;
+} traceData_t;
 
 //
 // kexTrace::kexTrace
@@ -38,7 +64,7 @@
 
 kexTrace::kexTrace(void)
 {
-    this->map = NULL;
+    this->data = NULL;
 }
 
 //
@@ -55,7 +81,167 @@ kexTrace::~kexTrace(void)
 
 void kexTrace::Init(kexDoomMap &doomMap)
 {
-    map = &doomMap;
+    data = doomMap.GetTraceData(kexWorker::CurrentNode());
+}
+
+//
+// CopySurface
+//
+
+static traceSurface_t *CopySurface(const surface_t *surface, traceSurface_t **surfaces, kexVec3 **verts)
+{
+    traceSurface_t *copy = (*surfaces)++;
+
+    copy->plane = surface->plane;
+    copy->type = surface->type;
+    copy->numVerts = surface->numVerts;
+    copy->verts = *verts;
+    copy->surface = const_cast<surface_t*>(surface);
+
+    for(int i = 0; i < surface->numVerts; i++)
+    {
+        copy->verts[i] = surface->verts[i];
+    }
+
+    *verts += surface->numVerts;
+
+    return copy;
+}
+
+//
+// kexTrace::CreateData
+//
+// Copies the nodes, leafs and surfaces that traces go through. The
+// memory is written here, so it ends up on the numa node of the
+// thread that calls this
+//
+
+traceData_t *kexTrace::CreateData(kexDoomMap &doomMap)
+{
+    traceData_t *data;
+    traceSurface_t *surfaces;
+    kexVec3 *verts;
+    int numSurfaces = 0;
+    int numVerts = 0;
+
+    for(int j = 0; j < 3; j++)
+    {
+        for(int i = 0; i < doomMap.numSegs; i++)
+        {
+            if(doomMap.segSurfaces[j][i] != NULL)
+            {
+                numSurfaces++;
+                numVerts += doomMap.segSurfaces[j][i]->numVerts;
+            }
+        }
+    }
+
+    for(int j = 0; j < 2; j++)
+    {
+        for(int i = 0; i < doomMap.numSSects; i++)
+        {
+            if(doomMap.leafSurfaces[j][i] != NULL)
+            {
+                numSurfaces++;
+                numVerts += doomMap.leafSurfaces[j][i]->numVerts;
+            }
+        }
+    }
+
+    data = (traceData_t*)Mem_Calloc(sizeof(traceData_t), hb_map);
+
+    data->numNodes = doomMap.numNodes;
+    data->nodes = (mapNode_t*)Mem_Malloc(sizeof(mapNode_t) * doomMap.numNodes, hb_map);
+    data->nodeBounds = (kexBBox*)Mem_Malloc(sizeof(kexBBox) * doomMap.numNodes, hb_map);
+    data->subSectors = (mapSubSector_t*)Mem_Malloc(sizeof(mapSubSector_t) * doomMap.numSSects, hb_map);
+    data->leafBounds = (kexBBox*)Mem_Malloc(sizeof(kexBBox) * doomMap.numSSects, hb_map);
+    data->surfaces = (traceSurface_t*)Mem_Malloc(sizeof(traceSurface_t) * numSurfaces, hb_map);
+    data->verts = (kexVec3*)Mem_Malloc(sizeof(kexVec3) * numVerts, hb_map);
+
+    memcpy(data->nodes, doomMap.nodes, sizeof(mapNode_t) * doomMap.numNodes);
+    memcpy(data->subSectors, doomMap.mapSSects, sizeof(mapSubSector_t) * doomMap.numSSects);
+
+    for(int i = 0; i < doomMap.numNodes; i++)
+    {
+        data->nodeBounds[i] = doomMap.nodeBounds[i];
+    }
+
+    for(int i = 0; i < doomMap.numSSects; i++)
+    {
+        data->leafBounds[i] = doomMap.ssLeafBounds[i];
+    }
+
+    surfaces = data->surfaces;
+    verts = data->verts;
+
+    for(int j = 0; j < 3; j++)
+    {
+        data->segSurfaces[j] = (traceSurface_t**)Mem_Calloc(sizeof(traceSurface_t*) * doomMap.numSegs, hb_map);
+
+        for(int i = 0; i < doomMap.numSegs; i++)
+        {
+            const surface_t *surface = doomMap.segSurfaces[j][i];
+
+            if(surface == NULL)
+            {
+                continue;
+            }
+
+            if(j == 0)
+            {
+                int linenum = doomMap.mapSegs[i].linedef;
+
+                // transparent 2-sided lines are left out so they are never hit
+                if(linenum != NO_LINE_INDEX && doomMap.mapLines[linenum].flags &
+                        (ML_TWOSIDED|ML_TRANSPARENT1|ML_TRANSPARENT2))
+                {
+                    continue;
+                }
+            }
+
+            data->segSurfaces[j][i] = CopySurface(surface, &surfaces, &verts);
+        }
+    }
+
+    for(int j = 0; j < 2; j++)
+    {
+        data->leafSurfaces[j] = (traceSurface_t**)Mem_Calloc(sizeof(traceSurface_t*) * doomMap.numSSects, hb_map);
+
+        for(int i = 0; i < doomMap.numSSects; i++)
+        {
+            if(doomMap.leafSurfaces[j][i] != NULL)
+            {
+                data->leafSurfaces[j][i] = CopySurface(doomMap.leafSurfaces[j][i], &surfaces, &verts);
+            }
+        }
+    }
+
+    return data;
+}
+
+//
+// kexTrace::FreeData
+//
+
+void kexTrace::FreeData(traceData_t *data)
+{
+    for(int j = 0; j < 3; j++)
+    {
+        Mem_Free(data->segSurfaces[j]);
+    }
+
+    for(int j = 0; j < 2; j++)
+    {
+        Mem_Free(data->leafSurfaces[j]);
+    }
+
+    Mem_Free(data->nodes);
+    Mem_Free(data->nodeBounds);
+    Mem_Free(data->subSectors);
+    Mem_Free(data->leafBounds);
+    Mem_Free(data->surfaces);
+    Mem_Free(data->verts);
+    Mem_Free(data);
 }
 
 //
@@ -72,19 +258,19 @@ void kexTrace::Trace(const kexVec3 &startVec, const kexVec3 &endVec)
     hitSurface = NULL;
     fraction = 1;
 
-    if(map == NULL)
+    if(data == NULL)
     {
         return;
     }
 
-    TraceBSPNode(map->numNodes - 1);
+    TraceBSPNode(data->numNodes - 1);
 }
 
 //
 // kexTrace::TraceSurface
 //
 
-void kexTrace::TraceSurface(surface_t *surface)
+void kexTrace::TraceSurface(traceSurface_t *surface)
 {
     kexPlane *plane;
     kexVec3 hit;
@@ -184,7 +370,7 @@ void kexTrace::TraceSurface(surface_t *surface)
 
     hitNormal = normal;
     hitVector = hit;
-    hitSurface = surface;
+    hitSurface = surface->surface;
     fraction = frac;
 }
 
@@ -198,39 +384,29 @@ void kexTrace::TraceSubSector(int num)
     int i;
     int j;
 
-    sub = &map->mapSSects[num];
+    sub = &data->subSectors[num];
 
-    if(!map->ssLeafBounds[num].LineIntersect(start, end))
+    if(!data->leafBounds[num].LineIntersect(start, end))
     {
         return;
     }
 
-    // test line segments
+    // test line segments. transparent 2-sided lines were
+    // already left out when the trace data was copied
     for(i = 0; i < sub->numsegs; i++)
     {
         int segnum = sub->firstseg + i;
 
         for(j = 0; j < 3; j++)
         {
-            if(j == 0)
-            {
-                int linenum = map->mapSegs[segnum].linedef;
-
-                if(linenum != NO_LINE_INDEX && map->mapLines[linenum].flags &
-                        (ML_TWOSIDED|ML_TRANSPARENT1|ML_TRANSPARENT2))
-                {
-                    // don't trace transparent 2-sided lines
-                    continue;
-                }
-            }
-            TraceSurface(map->segSurfaces[j][segnum]);
+            TraceSurface(data->segSurfaces[j][segnum]);
         }
     }
 
     // test subsector leafs
     for(j = 0; j < 2; j++)
     {
-        TraceSurface(map->leafSurfaces[j][num]);
+        TraceSurface(data->leafSurfaces[j][num]);
     }
 }
 
@@ -252,12 +428,12 @@ void kexTrace::TraceBSPNode(int num)
         return;
     }
 
-    if(!map->nodeBounds[num & (~NF_SUBSECTOR)].LineIntersect(start, end))
+    if(!data->nodeBounds[num & (~NF_SUBSECTOR)].LineIntersect(start, end))
     {
         return;
     }
 
-    node = &map->nodes[num];
+    node = &data->nodes[num];
 
     kexVec3 pt1(F(node->x << 16), F(node->y << 16), 0);
     kexVec3 pt2(F(node->dx << 16), F(node->dy << 16), 0);
@@ -27,6 +27,9 @@
 
 class kexDoomMap;
 
+struct traceData_s;
+struct traceSurface_s;
+
 class kexTrace
 {
 public:
@@ -36,6 +39,9 @@ public:
     void                Init(kexDoomMap &doomMap);
     void                Trace(const kexVec3 &startVec, const kexVec3 &endVec);
 
+    static struct traceData_s   *CreateData(kexDoomMap &doomMap);
+    static void                 FreeData(struct traceData_s *data);
+
     kexVec3             start;
     kexVec3             end;
     kexVec3             dir;
@@ -47,9 +53,9 @@ public:
 private:
     void                TraceBSPNode(int num);
     void                TraceSubSector(int num);
-    void                TraceSurface(surface_t *surface);
+    void                TraceSurface(struct traceSurface_s *surface);
 
-    kexDoomMap          *map;
+    struct traceData_s  *data;
 
 };
 
@@ -30,6 +30,24 @@
 #include "common.h"
 #include "wad.h"
 
+#ifndef KEX_WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// new lumps that are added to a wad, kept until the wad is written
+kexHeapBlock hb_lumps("lumps", false, NULL, NULL);
+
+//
+// kexWadFile::kexWadFile
+//
+
+kexWadFile::kexWadFile(void)
+{
+    this->lumps = NULL;
+    this->lumpHashNext = NULL;
+}
+
 //
 // kexWadFile::~kexWadFile
 //
@@ -45,7 +63,7 @@ kexWadFile::~kexWadFile(void)
 
 bool kexWadFile::Open(const char *fileName)
 {
-    if(!file.Open(fileName))
+    if(!file.OpenMapped(fileName))
     {
         return false;
     }
@@ -54,49 +72,314 @@ bool kexWadFile::Open(const char *fileName)
     lumps = (lump_t*)file.GetOffset(2);
     wadName = fileName;
     bWriting = false;
+
+    HashLumps();
     return true;
 }
 
+//
+// kexWadFile::HashLumps
+//
+// Chains every lump into a table by name. Lumps are linked from the
+// last to the first so each chain is in directory order, which keeps
+// the first of any duplicate names the one that is found
+//
+
+void kexWadFile::HashLumps(void)
+{
+    char n[9];
+
+    for(int i = 0; i < MAX_HASH; i++)
+    {
+        lumpHash[i] = -1;
+    }
+
+    lumpHashNext = (int*)Mem_Malloc(sizeof(int) * (header.lmpcount + 1), hb_static);
+
+    n[8] = 0;
+
+    for(int i = header.lmpcount - 1; i >= 0; i--)
+    {
+        int hash;
+
+        strncpy(n, lumps[i].name, 8);
+        hash = kexStr::Hash(n);
+
+        lumpHashNext[i] = lumpHash[hash];
+        lumpHash[hash] = i;
+    }
+}
+
+//
+// kexWadFile::PackHeader
+//
+// The header and directory are written out field by field,
+// so the wad is little endian whatever the host is
+//
+
+void kexWadFile::PackHeader(byte *data)
+{
+    kexBinFile out;
+
+    out.SetBuffer(data);
+    out.WriteBytes((byte*)header.id, 4);
+    out.Write32(header.lmpcount);
+    out.Write32(header.lmpdirpos);
+}
+
+//
+// kexWadFile::PackDirectory
+//
+// Returns a buffer that has to be deleted once it's written
+//
+
+byte *kexWadFile::PackDirectory(kexArray<lump_t> &directory)
+{
+    byte *data = new byte[directory.Length() * sizeof(lump_t)];
+    kexBinFile out;
+
+    out.SetBuffer(data);
+
+    for(unsigned int i = 0; i < directory.Length(); i++)
+    {
+        out.Write32(directory[i].filepos);
+        out.Write32(directory[i].size);
+        out.WriteBytes((byte*)directory[i].name, 8);
+    }
+
+    return data;
+}
+
 //
 // kexWadFile::Write
 //
+// The lumps being written usually point into the mapping of the wad
+// that is being replaced, so the new wad is written next to it and
+// renamed over it once it's complete
+//
 
-void kexWadFile::Write(const char *fileName)
+bool kexWadFile::Write(const char *fileName)
 {
     assert(bWriting == true);
 
-    file.Create(fileName);
-    file.Write8(header.id[0]);
-    file.Write8(header.id[1]);
-    file.Write8(header.id[2]);
-    file.Write8(header.id[3]);
-    file.Write32(header.lmpcount);
-    file.Write32(header.lmpdirpos);
+#ifdef KEX_WIN32
+    kexStr outName = fileName;
+#else
+    kexStr outName = kexStr(fileName) + ".tmp";
+#endif
 
-    for(unsigned int i = 0; i < writeLumpList.Length(); i++)
+    if(!file.Create(outName))
+    {
+        printf("kexWadFile::Write: couldn't create %s\n", outName.c_str());
+        return false;
+    }
+
+    kexArray<byte*> blocks;
+    kexArray<int> lengths;
+    byte headerData[sizeof(wadHeader_t)];
+    byte *directoryData;
+    unsigned int i = 0;
+    bool bWritten = true;
+
+    PackHeader(headerData);
+    blocks.Push(headerData);
+    lengths.Push(sizeof(wadHeader_t));
+
+    while(i < writeLumpList.Length() && bWritten)
     {
         byte *data = writeDataList[i];
+        kexBinFile *src = writeSourceList[i];
+        int size = writeLumpList[i].size;
+
+        i++;
+
+        if(!data || size == 0)
+        {
+            continue;
+        }
 
-        if(!data)
+        if(src == NULL)
         {
+            blocks.Push(data);
+            lengths.Push(size);
             continue;
         }
 
-        for(int j = 0; j < writeLumpList[i].size; j++)
+        // lumps that came from the same spot in the source wad are copied
+        // in one go, which is usually everything except the old LM_ lumps
+        while(i < writeLumpList.Length() && writeSourceList[i] == src)
+        {
+            if(writeLumpList[i].size != 0 && writeDataList[i] != data + size)
+            {
+                break;
+            }
+
+            size += writeLumpList[i].size;
+            i++;
+        }
+
+        bWritten = WriteBlocks(file, blocks, lengths) &&
+                   file.CopyRange(*src, (off_t)(data - src->Buffer()), (size_t)size);
+    }
+
+    directoryData = PackDirectory(writeLumpList);
+    blocks.Push(directoryData);
+    lengths.Push(writeLumpList.Length() * sizeof(lump_t));
+
+    bWritten = bWritten && WriteBlocks(file, blocks, lengths);
+    delete[] directoryData;
+
+    if(!bWritten)
+    {
+        printf("kexWadFile::Write: couldn't write %s\n", outName.c_str());
+        file.Close();
+#ifndef KEX_WIN32
+        remove(outName);
+#endif
+        return false;
+    }
+
+#ifndef KEX_WIN32
+    struct stat info;
+
+    // the new wad takes the place of the old one, so it keeps its
+    // permissions and, where we're allowed to, its owner
+    if(stat(fileName, &info) == 0)
+    {
+        int fd = fileno(file.Handle());
+
+        // chown clears the set-id bits, so the mode goes on last
+        if((info.st_uid != geteuid() || info.st_gid != getegid()) &&
+           fchown(fd, info.st_uid, info.st_gid) != 0)
+        {
+            printf("Warning: couldn't keep the owner of %s\n", fileName);
+        }
+
+        if(fchmod(fd, info.st_mode & 07777) != 0)
         {
-            file.Write8(data[j]);
+            printf("Warning: couldn't keep the permissions of %s\n", fileName);
         }
     }
 
+    file.Close();
+
+    if(rename(outName, fileName) != 0)
+    {
+        printf("kexWadFile::Write: couldn't replace %s\n", fileName);
+        remove(outName);
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+//
+// kexWadFile::Append
+//
+// Updates wadFile on disk instead of rewriting it. Lumps that came from
+// it stay where they are, while new lumps and the new directory are added
+// to the end of the file. The header is only patched after everything
+// else made it to the disk, so if the update is interrupted the wad still
+// points at the old directory. Replaced lumps are left behind as unused
+// space until the wad is compacted
+//
+
+bool kexWadFile::Append(kexWadFile &wadFile)
+{
+    kexBinFile update;
+    kexArray<lump_t> directory;
+    kexArray<byte*> blocks;
+    kexArray<int> lengths;
+    byte *directoryData;
+    bool bWritten;
+    int filePos;
+    int endPos;
+
+    assert(bWriting == true);
+
+    if(!update.OpenForUpdate(wadFile.wadName))
+    {
+        printf("kexWadFile::Append: couldn't open %s\n", wadFile.wadName.c_str());
+        return false;
+    }
+
+    filePos = update.Length();
+    endPos = filePos;
+
     for(unsigned int i = 0; i < writeLumpList.Length(); i++)
     {
-        file.Write32(writeLumpList[i].filepos);
-        file.Write32(writeLumpList[i].size);
-        for(int j = 0; j < 8; j++)
+        lump_t lump = writeLumpList[i];
+        byte *data = writeDataList[i];
+
+        if(writeSourceList[i] == &wadFile.file)
+        {
+            lump.filepos = data - wadFile.file.Buffer();
+        }
+        else
         {
-            file.Write8(writeLumpList[i].name[j]);
+            lump.filepos = endPos;
+
+            if(data && lump.size > 0)
+            {
+                blocks.Push(data);
+                lengths.Push(lump.size);
+                endPos += lump.size;
+            }
         }
+
+        directory.Push(lump);
     }
+
+    header.lmpcount = directory.Length();
+    header.lmpdirpos = endPos;
+
+    directoryData = PackDirectory(directory);
+    blocks.Push(directoryData);
+    lengths.Push(directory.Length() * sizeof(lump_t));
+
+    update.Seek(filePos);
+    bWritten = WriteBlocks(update, blocks, lengths) && update.Sync();
+    delete[] directoryData;
+
+    if(!bWritten)
+    {
+        printf("kexWadFile::Append: couldn't write %s\n", wadFile.wadName.c_str());
+        return false;
+    }
+
+    // the lump count and directory offset share one sector, so this is
+    // the only point where the wad switches over to the new directory
+    update.Seek(4);
+    update.Write32(header.lmpcount);
+    update.Write32(header.lmpdirpos);
+
+    if(!update.Sync())
+    {
+        printf("kexWadFile::Append: couldn't update the header of %s\n", wadFile.wadName.c_str());
+        return false;
+    }
+
+    update.Close();
+    return true;
+}
+
+//
+// kexWadFile::WriteBlocks
+//
+
+bool kexWadFile::WriteBlocks(kexBinFile &out, kexArray<byte*> &blocks, kexArray<int> &lengths)
+{
+    bool bResult = true;
+
+    if(blocks.Length() > 0)
+    {
+        bResult = out.WriteBlocks(&blocks[0], &lengths[0], blocks.Length());
+    }
+
+    blocks.Empty();
+    lengths.Empty();
+    return bResult;
 }
 
 //
@@ -109,6 +392,11 @@ void kexWadFile::Close(void)
     {
         file.Close();
     }
+    if(lumpHashNext)
+    {
+        Mem_Free(lumpHashNext);
+        lumpHashNext = NULL;
+    }
 }
 
 //
@@ -116,17 +404,31 @@ void kexWadFile::Close(void)
 //
 
 lump_t *kexWadFile::GetLumpFromName(const char *name)
+{
+    return GetLumpFromName(name, 0, header.lmpcount);
+}
+
+//
+// kexWadFile::GetLumpFromName
+//
+// Only finds lumps with an index from start up to, but not including, end
+//
+
+lump_t *kexWadFile::GetLumpFromName(const char *name, const int start, const int end)
 {
     char n[9];
 
-    for(int i = 0; i < header.lmpcount; i++)
+    if(lumpHashNext == NULL)
     {
-        // could be optimized here but I really don't feel like
-        // wasting time on this
-        strncpy(n, lumps[i].name, 8);
-        n[8] = 0;
+        return NULL;
+    }
+
+    strncpy(n, name, 8);
+    n[8] = 0;
 
-        if(!strncmp(n, name, 8))
+    for(int i = lumpHash[kexStr::Hash(n)]; i != -1 && i < end; i = lumpHashNext[i])
+    {
+        if(i >= start && !strncmp(lumps[i].name, n, 8))
         {
             return &lumps[i];
         }
@@ -250,6 +552,7 @@ void kexWadFile::CopyLumpsFromWadFile(kexWadFile &wadFile)
     {
         lump = wadFile.lumps[i];
         AddLump(wadFile.lumps[i].name, lump.size, &wadFile.file.Buffer()[lump.filepos]);
+        writeSourceList[writeSourceList.Length()-1] = &wadFile.file;
     }
 }
 
@@ -260,32 +563,35 @@ void kexWadFile::CopyLumpsFromWadFile(kexWadFile &wadFile)
 void kexWadFile::CopyLumpsFromWadFile(kexWadFile &wadFile, kexArray<int> &lumpIgnoreList)
 {
     lump_t lump;
-    unsigned int j;
-    bool bSkip;
+    byte *skipBits;
 
     assert(bWriting == true);
 
-    for(int i = 0; i < wadFile.header.lmpcount; ++i)
+    skipBits = (byte*)Mem_Calloc((wadFile.header.lmpcount >> 3) + 1, hb_static);
+
+    for(unsigned int i = 0; i < lumpIgnoreList.Length(); ++i)
     {
-        lump = wadFile.lumps[i];
-        bSkip = false;
+        int lumpnum = lumpIgnoreList[i];
 
-        for(j = 0; j < lumpIgnoreList.Length(); ++j)
+        if(lumpnum >= 0 && lumpnum < wadFile.header.lmpcount)
         {
-            if(lumpIgnoreList[j] == i)
-            {
-                bSkip = true;
-                break;
-            }
+            skipBits[lumpnum >> 3] |= BIT(lumpnum & 7);
         }
+    }
 
-        if(bSkip)
+    for(int i = 0; i < wadFile.header.lmpcount; ++i)
+    {
+        if(skipBits[i >> 3] & BIT(i & 7))
         {
             continue;
         }
 
+        lump = wadFile.lumps[i];
         AddLump(wadFile.lumps[i].name, lump.size, &wadFile.file.Buffer()[lump.filepos]);
+        writeSourceList[writeSourceList.Length()-1] = &wadFile.file;
     }
+
+    Mem_Free(skipBits);
 }
 
 //
@@ -304,6 +610,7 @@ void kexWadFile::AddLump(const char *name, const int size, byte *data)
 
     writeLumpList.Push(lump);
     writeDataList.Push(data);
+    writeSourceList.Push(NULL);
 
     header.lmpcount++;
     header.lmpdirpos += lump.size;
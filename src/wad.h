@@ -85,6 +85,7 @@ typedef struct
 class kexWadFile
 {
 public:
+    kexWadFile(void);
     ~kexWadFile(void);
 
     wadHeader_t         header;
@@ -96,13 +97,15 @@ public:
     int                 currentmap;
 
     lump_t              *GetLumpFromName(const char *name);
+    lump_t              *GetLumpFromName(const char *name, const int start, const int end);
     lump_t              *GetMapLump(mapLumps_t lumpID);
     lump_t              *GetGLMapLump(glMapLumps_t lumpID);
     byte                *GetLumpData(const lump_t *lump);
     byte                *GetLumpData(const char *name);
     void                SetCurrentMap(const int map);
     bool                Open(const char *fileName);
-    void                Write(const char *fileName);
+    bool                Write(const char *fileName);
+    bool                Append(kexWadFile &wadFile);
     void                Close(void);
     void                CreateBackup(void);
     void                InitForWrite(void);
@@ -151,11 +154,22 @@ public:
     }
 
 private:
+    void                HashLumps(void);
+    void                PackHeader(byte *data);
+    byte                *PackDirectory(kexArray<lump_t> &directory);
+    bool                WriteBlocks(kexBinFile &out, kexArray<byte*> &blocks,
+                                    kexArray<int> &lengths);
+
     kexBinFile          file;
+    int                 lumpHash[MAX_HASH];
+    int                 *lumpHashNext;
     bool                bWriting;
     int                 writePos;
     kexArray<lump_t>    writeLumpList;
     kexArray<byte*>     writeDataList;
+    kexArray<kexBinFile*> writeSourceList;
 };
 
+extern kexHeapBlock hb_lumps;
+
 #endif
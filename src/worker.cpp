@@ -30,33 +30,528 @@
 #include "common.h"
 #include "worker.h"
 
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#elif !defined(KEX_WIN32)
+#include <unistd.h>
+#endif
+
 int kexWorker::maxWorkThreads = 4;
+bool kexWorker::bPinThreads = false;
+
+// the cpus this process is allowed to run on, grouped by numa node
+static kexArray<int> nodeCPUs[MAX_NUMA_NODES];
+static int numNodes = 0;
+static int numUsableCPUs = 1;
+static bool bDetectedCPUs = false;
+static pthread_key_t nodeKey;
+static pthread_key_t threadKey;
+
+#if defined(__linux__)
+static cpu_set_t processMask;
+#elif defined(KEX_WIN32)
+static DWORD_PTR processMask;
+#endif
+
+#if defined(__linux__)
 
 //
-// WorkThread
+// ReadCPUList
+//
+// Reads a list of cpus such as 0-3,8-11 from a sysfs file
 //
 
-void *WorkThread(void *p)
+static bool ReadCPUList(const char *fileName, kexArray<int> &cpus)
 {
-    jobFuncArgs_t *args = (jobFuncArgs_t*)p;
-    kexWorker *worker = args->worker;
+    FILE *f;
+    char line[4096];
+    char *p;
 
-    while(1)
+    if(!(f = fopen(fileName, "r")))
     {
-        int jobid;
+        return false;
+    }
 
-        worker->LockMutex();
+    if(!fgets(line, sizeof(line), f))
+    {
+        fclose(f);
+        return false;
+    }
+
+    fclose(f);
+    p = line;
+
+    while(*p >= '0' && *p <= '9')
+    {
+        int first = strtol(p, &p, 10);
+        int last = first;
+
+        if(*p == '-')
+        {
+            last = strtol(p + 1, &p, 10);
+        }
+
+        for(int i = first; i <= last; i++)
+        {
+            cpus.Push(i);
+        }
 
-        if(worker->FinishedAllJobs())
+        if(*p != ',')
         {
-            worker->UnlockMutex();
             break;
         }
 
-        jobid = worker->DispatchJob();
-        worker->UnlockMutex();
+        p++;
+    }
+
+    return true;
+}
+
+//
+// ReadCGroupQuota
+//
+// Returns how many cpus worth of time a cgroup may use,
+// or 0 if it isn't limited
+//
+
+static int ReadCGroupQuota(const char *dir)
+{
+    FILE *f;
+    char quota[32];
+    long long period = 0;
+    long long value = -1;
+
+    // cgroup v2 keeps the quota and period together
+    if((f = fopen(Va("%s/cpu.max", dir), "r")))
+    {
+        if(fscanf(f, "%31s %lld", quota, &period) == 2 && strcmp(quota, "max"))
+        {
+            value = atoll(quota);
+        }
+
+        fclose(f);
+    }
+    else
+    {
+        if((f = fopen(Va("%s/cpu.cfs_quota_us", dir), "r")))
+        {
+            if(fscanf(f, "%lld", &value) != 1)
+            {
+                value = -1;
+            }
+
+            fclose(f);
+        }
+
+        if((f = fopen(Va("%s/cpu.cfs_period_us", dir), "r")))
+        {
+            if(fscanf(f, "%lld", &period) != 1)
+            {
+                period = 0;
+            }
+
+            fclose(f);
+        }
+    }
+
+    if(value <= 0 || period <= 0)
+    {
+        return 0;
+    }
+
+    return (int)((value + period - 1) / period);
+}
+
+//
+// CGroupCPULimit
+//
+// Finds the tightest cpu quota of the cgroups this process is in,
+// including the ones above it. Returns 0 if there is none
+//
+
+static int CGroupCPULimit(void)
+{
+    FILE *f;
+    char line[1024];
+    int limit = 0;
+
+    if(!(f = fopen("/proc/self/cgroup", "r")))
+    {
+        return 0;
+    }
+
+    while(fgets(line, sizeof(line), f))
+    {
+        char *controllers;
+        char *path;
+        char dir[1024];
+        const char *root;
+
+        // hierarchy-id:controllers:path
+        if(!(controllers = strchr(line, ':')) || !(path = strchr(controllers + 1, ':')))
+        {
+            continue;
+        }
+
+        *path++ = 0;
+        controllers++;
+        path[strcspn(path, "\n")] = 0;
+
+        if(*controllers == 0)
+        {
+            root = "/sys/fs/cgroup";
+        }
+        else if(!strcmp(controllers, "cpu") || !strcmp(controllers, "cpu,cpuacct"))
+        {
+            root = Va("/sys/fs/cgroup/%s", controllers);
+        }
+        else
+        {
+            continue;
+        }
+
+        snprintf(dir, sizeof(dir), "%s%s", root, path);
+
+        while(1)
+        {
+            int quota = ReadCGroupQuota(dir);
+            char *slash;
+
+            if(quota > 0 && (limit == 0 || quota < limit))
+            {
+                limit = quota;
+            }
+
+            if(strlen(dir) <= strlen("/sys/fs/cgroup") || !(slash = strrchr(dir, '/')))
+            {
+                break;
+            }
+
+            *slash = 0;
+        }
+    }
+
+    fclose(f);
+    return limit;
+}
+
+#endif
+
+//
+// kexWorker::DetectCPUs
+//
+// Works out which cpus this process can use and which numa node each
+// one is on. The affinity mask and the cgroup cpu quota are both
+// taken into account
+//
+
+void kexWorker::DetectCPUs(void)
+{
+    int count = 0;
+
+    for(int i = 0; i < MAX_NUMA_NODES; i++)
+    {
+        nodeCPUs[i].Empty();
+    }
+
+    numNodes = 0;
+
+#if defined(__linux__)
+    kexArray<int> nodes;
+    int limit;
+
+    CPU_ZERO(&processMask);
+
+    if(sched_getaffinity(0, sizeof(processMask), &processMask) != 0)
+    {
+        int online = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+        for(int i = 0; i < online && i < CPU_SETSIZE; i++)
+        {
+            CPU_SET(i, &processMask);
+        }
+    }
+
+    count = CPU_COUNT(&processMask);
+
+    if(ReadCPUList("/sys/devices/system/node/online", nodes))
+    {
+        for(unsigned int i = 0; i < nodes.Length() && numNodes < MAX_NUMA_NODES; i++)
+        {
+            kexArray<int> cpus;
+
+            ReadCPUList(Va("/sys/devices/system/node/node%d/cpulist", nodes[i]), cpus);
+
+            for(unsigned int j = 0; j < cpus.Length(); j++)
+            {
+                if(cpus[j] < CPU_SETSIZE && CPU_ISSET(cpus[j], &processMask))
+                {
+                    nodeCPUs[numNodes].Push(cpus[j]);
+                }
+            }
+
+            if(nodeCPUs[numNodes].Length() > 0)
+            {
+                numNodes++;
+            }
+        }
+    }
+
+    if(numNodes == 0)
+    {
+        for(int i = 0; i < CPU_SETSIZE; i++)
+        {
+            if(CPU_ISSET(i, &processMask))
+            {
+                nodeCPUs[0].Push(i);
+            }
+        }
+
+        numNodes = 1;
+    }
+
+    limit = CGroupCPULimit();
 
+    if(limit > 0 && limit < count)
+    {
+        count = limit;
+    }
+#elif defined(KEX_WIN32)
+    DWORD_PTR systemMask;
+    ULONG highestNode;
+
+    if(!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+    {
+        processMask = 1;
+    }
+
+    for(int i = 0; i < (int)(sizeof(DWORD_PTR) * 8); i++)
+    {
+        if(processMask & ((DWORD_PTR)1 << i))
+        {
+            count++;
+        }
+    }
+
+    if(GetNumaHighestNodeNumber(&highestNode))
+    {
+        for(ULONG n = 0; n <= highestNode && numNodes < MAX_NUMA_NODES; n++)
+        {
+            ULONGLONG nodeMask;
+
+            if(!GetNumaNodeProcessorMask((UCHAR)n, &nodeMask))
+            {
+                continue;
+            }
+
+            for(int i = 0; i < (int)(sizeof(DWORD_PTR) * 8); i++)
+            {
+                if((nodeMask & processMask) & ((DWORD_PTR)1 << i))
+                {
+                    nodeCPUs[numNodes].Push(i);
+                }
+            }
+
+            if(nodeCPUs[numNodes].Length() > 0)
+            {
+                numNodes++;
+            }
+        }
+    }
+
+    if(numNodes == 0)
+    {
+        for(int i = 0; i < (int)(sizeof(DWORD_PTR) * 8); i++)
+        {
+            if(processMask & ((DWORD_PTR)1 << i))
+            {
+                nodeCPUs[0].Push(i);
+            }
+        }
+
+        numNodes = 1;
+    }
+#else
+    count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    for(int i = 0; i < count; i++)
+    {
+        nodeCPUs[0].Push(i);
+    }
+
+    numNodes = 1;
+#endif
+
+    numUsableCPUs = MAX(count, 1);
+
+    if(!bDetectedCPUs)
+    {
+        pthread_key_create(&nodeKey, NULL);
+        pthread_key_create(&threadKey, NULL);
+        bDetectedCPUs = true;
+    }
+}
+
+//
+// kexWorker::NumUsableCPUs
+//
+
+int kexWorker::NumUsableCPUs(void)
+{
+    return numUsableCPUs;
+}
+
+//
+// kexWorker::NumNodes
+//
+
+int kexWorker::NumNodes(void)
+{
+    return MAX(numNodes, 1);
+}
+
+//
+// kexWorker::NumThreadNodes
+//
+// How many numa nodes the threads are spread over. Threads that
+// aren't pinned can move between nodes, so they all count as one
+//
+
+int kexWorker::NumThreadNodes(void)
+{
+    if(!bPinThreads)
+    {
+        return 1;
+    }
+
+    return MIN(NumNodes(), maxWorkThreads);
+}
+
+//
+// kexWorker::CurrentNode
+//
+// The node the calling thread was placed on. Always 0 for
+// threads that aren't part of the pool
+//
+
+int kexWorker::CurrentNode(void)
+{
+    if(!bDetectedCPUs)
+    {
+        return 0;
+    }
+
+    return (int)(intptr_t)pthread_getspecific(nodeKey);
+}
+
+//
+// kexWorker::CurrentThread
+//
+// The index of the calling thread in the pool, or -1
+// for threads that aren't part of it
+//
+
+int kexWorker::CurrentThread(void)
+{
+    if(!bDetectedCPUs)
+    {
+        return -1;
+    }
+
+    return (int)(intptr_t)pthread_getspecific(threadKey) - 1;
+}
+
+//
+// kexWorker::BindToCPU
+//
+
+void kexWorker::BindToCPU(const int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(KEX_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#endif
+}
+
+//
+// kexWorker::BindToNode
+//
+
+void kexWorker::BindToNode(const int node)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+
+    for(unsigned int i = 0; i < nodeCPUs[node].Length(); i++)
+    {
+        CPU_SET(nodeCPUs[node][i], &set);
+    }
+
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(KEX_WIN32)
+    DWORD_PTR mask = 0;
+
+    for(unsigned int i = 0; i < nodeCPUs[node].Length(); i++)
+    {
+        mask |= (DWORD_PTR)1 << nodeCPUs[node][i];
+    }
+
+    SetThreadAffinityMask(GetCurrentThread(), mask);
+#endif
+}
+
+//
+// kexWorker::Unbind
+//
+// Lets the calling thread run on any cpu the process can use again
+//
+
+void kexWorker::Unbind(void)
+{
+#if defined(__linux__)
+    pthread_setaffinity_np(pthread_self(), sizeof(processMask), &processMask);
+#elif defined(KEX_WIN32)
+    SetThreadAffinityMask(GetCurrentThread(), processMask);
+#endif
+}
+
+//
+// WorkThread
+//
+
+void *WorkThread(void *p)
+{
+    jobFuncArgs_t *args = (jobFuncArgs_t*)p;
+    kexWorker *worker = args->worker;
+    int jobid;
+
+    if(args->cpu >= 0)
+    {
+        kexWorker::BindToCPU(args->cpu);
+    }
+
+    if(args->node != 0)
+    {
+        pthread_setspecific(nodeKey, (void*)(intptr_t)args->node);
+    }
+
+    if(bDetectedCPUs)
+    {
+        pthread_setspecific(threadKey, (void*)(intptr_t)(args->jobID + 1));
+    }
+
+    while(worker->WaitForJob(&jobid))
+    {
         worker->RunJob(args->data, jobid);
+        worker->FinishJob();
     }
 
     pthread_exit(NULL);
@@ -71,6 +566,9 @@ kexWorker::kexWorker(void)
 {
     this->numWorkLoad = 0;
     this->jobsWorked = 0;
+    this->jobsDone = 0;
+    this->numThreads = 0;
+    this->bQuit = false;
     this->job = NULL;
 
 #ifdef KEX_WIN32
@@ -120,36 +618,101 @@ void kexWorker::UnlockMutex(void)
 #endif
 }
 
+//
+// kexWorker::WaitForJob
+//
+// Sleeps until there is a job left to hand out. Returns
+// false once the threads are told to shut down
+//
+
+bool kexWorker::WaitForJob(int *jobid)
+{
+    LockMutex();
+
+    while(!bQuit && FinishedAllJobs())
+    {
+        pthread_cond_wait(&jobCond, &mutex);
+    }
+
+    if(bQuit)
+    {
+        UnlockMutex();
+        return false;
+    }
+
+    *jobid = DispatchJob();
+    UnlockMutex();
+
+    return true;
+}
+
+//
+// kexWorker::FinishJob
+//
+
+void kexWorker::FinishJob(void)
+{
+    LockMutex();
+
+    if(++jobsDone == numWorkLoad)
+    {
+        pthread_cond_signal(&doneCond);
+    }
+
+    UnlockMutex();
+}
+
 //
 // kexWorker::Destroy
 //
+// Shuts the threads down. The next call to RunThreads starts them up again
+//
 
 void kexWorker::Destroy(void)
 {
-#ifdef KEX_WIN32
-    if(this->mutex)
+    void *status;
+    int rc;
+
+    if(numThreads == 0)
     {
-#endif
-        pthread_mutex_destroy(&this->mutex);
-#ifdef KEX_WIN32
+        return;
+    }
+
+    LockMutex();
+    bQuit = true;
+    pthread_cond_broadcast(&jobCond);
+    UnlockMutex();
+
+    for(int i = 0; i < numThreads; ++i)
+    {
+        if((rc = pthread_join(threads[i], &status)))
+        {
+            Error("pthread_join failed (error code %i)\n", rc);
+            return;
+        }
     }
+
+    numThreads = 0;
+    bQuit = false;
+
+    pthread_cond_destroy(&jobCond);
+    pthread_cond_destroy(&doneCond);
+    pthread_mutex_destroy(&this->mutex);
+
+#ifdef KEX_WIN32
+    this->mutex = NULL;
 #endif
 }
 
 //
-// kexWorker::RunThreads
+// kexWorker::StartThreads
 //
 
-void kexWorker::RunThreads(const int count, void *data, jobFunc_t jobFunc)
+void kexWorker::StartThreads(void)
 {
     pthread_attr_t attr;
-    void *status;
     int rc;
 
-    job = jobFunc;
-    numWorkLoad = count;
-    jobsWorked = 0;
-
 #ifdef KEX_WIN32
     if(!mutex)
     {
@@ -163,6 +726,12 @@ void kexWorker::RunThreads(const int count, void *data, jobFunc_t jobFunc)
     }
 #endif
 
+    if((rc = pthread_cond_init(&jobCond, NULL)) || (rc = pthread_cond_init(&doneCond, NULL)))
+    {
+        Error("pthread_cond_init failed (error code %i)\n", rc);
+        return;
+    }
+
     if((rc = pthread_attr_init(&attr)))
     {
         Error("pthread_attr_init failed (error code %i)\n", rc);
@@ -181,27 +750,67 @@ void kexWorker::RunThreads(const int count, void *data, jobFunc_t jobFunc)
         return;
     }
 
+    // spread the threads over the nodes, then over the cpus of each node
     for(int i = 0; i < kexWorker::maxWorkThreads; ++i)
     {
+        int numThreadNodes = NumThreadNodes();
+        int node = i % numThreadNodes;
+
         jobArgs[i].worker = this;
         jobArgs[i].jobID = i;
-        jobArgs[i].data = data;
+        jobArgs[i].node = node;
+        jobArgs[i].cpu = -1;
+
+        if(bPinThreads && nodeCPUs[node].Length() > 0)
+        {
+            jobArgs[i].cpu = nodeCPUs[node][(i / numThreadNodes) % nodeCPUs[node].Length()];
+        }
 
         if((rc = pthread_create(&threads[i], &attr, WorkThread, (void*)&jobArgs[i])))
         {
             Error("pthread_create failed (error code %i)\n", rc);
             return;
         }
+
+        numThreads++;
     }
 
     pthread_attr_destroy(&attr);
+}
 
-    for(int i = 0; i < kexWorker::maxWorkThreads; ++i)
+//
+// kexWorker::RunThreads
+//
+// Hands count jobs to the threads and returns once every one of
+// them is done. The threads are only started on the first call
+//
+
+void kexWorker::RunThreads(const int count, void *data, jobFunc_t jobFunc)
+{
+    if(numThreads != kexWorker::maxWorkThreads)
     {
-        if((rc = pthread_join(threads[i], &status)))
-        {
-            Error("pthread_join failed (error code %i)\n", rc);
-            return;
-        }
+        Destroy();
+        StartThreads();
+    }
+
+    LockMutex();
+
+    for(int i = 0; i < numThreads; ++i)
+    {
+        jobArgs[i].data = data;
+    }
+
+    job = jobFunc;
+    numWorkLoad = count;
+    jobsWorked = 0;
+    jobsDone = 0;
+
+    pthread_cond_broadcast(&jobCond);
+
+    while(jobsDone < numWorkLoad)
+    {
+        pthread_cond_wait(&doneCond, &mutex);
     }
+
+    UnlockMutex();
 }
@@ -28,6 +28,7 @@
 #include <pthread.h>
 
 #define MAX_THREADS     128
+#define MAX_NUMA_NODES  64
 
 class kexWorker;
 
@@ -38,8 +39,14 @@ typedef struct
     kexWorker *worker;
     void *data;
     int jobID;
+    int node;
+    int cpu;
 } jobFuncArgs_t;
 
+//
+// a pool of threads that stays up between calls to RunThreads,
+// which hands them the jobs and sleeps until the last one is done
+//
 class kexWorker
 {
 public:
@@ -51,6 +58,9 @@ public:
     void                UnlockMutex(void);
     void                Destroy(void);
 
+    bool                WaitForJob(int *jobid);
+    void                FinishJob(void);
+
     bool                FinishedAllJobs(void) { return jobsWorked == numWorkLoad; }
     int                 DispatchJob(void) { int j = jobsWorked; jobsWorked++; return j; }
     void                RunJob(void *data, const int jobID) { job(data, jobID); }
@@ -58,15 +68,33 @@ public:
     jobFuncArgs_t       *Args(const int id) { return &jobArgs[id]; }
     const int           JobsWorked(void) const { return jobsWorked; }
 
+    static void         DetectCPUs(void);
+    static int          NumUsableCPUs(void);
+    static int          NumNodes(void);
+    static int          NumThreadNodes(void);
+    static int          CurrentNode(void);
+    static int          CurrentThread(void);
+    static void         BindToNode(const int node);
+    static void         BindToCPU(const int cpu);
+    static void         Unbind(void);
+
     static int          maxWorkThreads;
+    static bool         bPinThreads;
 
 private:
+    void                StartThreads(void);
+
     pthread_t           threads[MAX_THREADS];
     jobFuncArgs_t       jobArgs[MAX_THREADS];
     pthread_mutex_t     mutex;
+    pthread_cond_t      jobCond;
+    pthread_cond_t      doneCond;
     jobFunc_t           job;
     int                 jobsWorked;
+    int                 jobsDone;
     int                 numWorkLoad;
+    int                 numThreads;
+    bool                bQuit;
 };
 
 #endif